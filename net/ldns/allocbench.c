@@ -0,0 +1,155 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+/*
+ * Count the heap allocations made to answer a query, in process. The
+ * zones are loaded as by the server, and every name and type they hold
+ * is asked through each path:
+ *
+ *   fast    handle_dns_fast, on a response cache miss
+ *   wire    handle_dns_wire, on a response cache miss
+ *   cached  handle_dns_wire, answered from the response cache
+ *
+ * malloc, calloc, realloc and free are replaced by counting wrappers,
+ * which also see the calls made inside libldns. Built with NO_ARENA
+ * (see arena.h), it gives the counts of the server before the arena.
+ *
+ * Use: allocbench [--iterations=<n>] <zone file>...
+ */
+
+#include "dns_server.h"
+#include "dns_fast.h"
+#include "response_cache.h"
+#include "arena.h"
+#include "stats.h"
+#include <getopt.h>
+
+opts_struct opts;
+int udp_sock;
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static bool counting;
+static uint64_t allocs, frees;
+
+void *malloc(size_t size) {
+    if (counting) allocs++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    if (counting) allocs++;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (counting) allocs++;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    if (counting && ptr) frees++;
+    __libc_free(ptr);
+}
+
+typedef struct query {
+    uint8_t *wire;
+    size_t size;
+} query;
+
+static query *queries;
+static size_t query_count, query_capacity;
+
+static void add_query(const ldns_rdf *name, ldns_rr_type type, ldns_rr_class rr_class) {
+    ldns_pkt *pkt = ldns_pkt_query_new(ldns_rdf_clone(name), type, rr_class, 0);
+    ldns_pkt_set_edns_udp_size(pkt, UDP_PAYLOAD_DEFAULT);
+    if (query_count == query_capacity) {
+        query_capacity = query_capacity ? query_capacity * 2 : 256;
+        queries = LDNS_XREALLOC(queries, query, query_capacity);
+    }
+    query *q = &queries[query_count];
+    if (ldns_pkt2wire(&q->wire, pkt, &q->size) == LDNS_STATUS_OK) query_count++;
+    ldns_pkt_free(pkt);
+}
+
+#define PATH_FAST 0
+#define PATH_WIRE 1
+#define PATH_CACHED 2
+
+static void run(int path, int iterations, bool count) {
+    static uint8_t buf[65535];
+    uint64_t elapsed = 0;
+    allocs = frees = 0;
+    for (int n = 0; n < iterations; n++) {
+        for (size_t i = 0; i < query_count; i++) {
+            if (path != PATH_CACHED) response_cache_invalidate_all();
+            uint64_t start = stats_now();
+            counting = count;
+            if (path == PATH_FAST) {
+                handle_dns_fast(queries[i].wire, queries[i].size, buf, sizeof buf, false);
+            } else {
+                uint8_t *outbuf;
+                size_t answer_size;
+                handle_dns_wire(queries[i].wire, queries[i].size, &outbuf, &answer_size, 0);
+                arena_reset();
+            }
+            counting = false;
+            elapsed += stats_now() - start;
+        }
+    }
+
+    if (!count) return;
+    static const char *names[] = { "fast", "wire", "cached" };
+    double total = (double) query_count * iterations;
+    printf("%-8s %12.2f %12.2f %12.0f\n", names[path], allocs / total, frees / total, elapsed / total);
+}
+
+int main(int argc, char *argv[]) {
+    int iterations = 10;
+    struct option longopts[] = {
+        { "iterations", true, NULL, 1 },
+        { 0, 0, 0, 0 }};
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+        if (opt == 1) iterations = atoi(optarg);
+        else return 1;
+    }
+    if (optind == argc || iterations < 1) {
+        fprintf(stderr, "Use: %s [--iterations=<n>] <zone file>...\n", argv[0]);
+        return 1;
+    }
+
+    for (int i = optind; i < argc; i++) {
+        ldns_zone *zone = zone_read(argv[i]);
+        if (!zone || !ldns_zone_soa(zone)) {
+            fprintf(stderr, "Cannot read zone %s\n", argv[i]);
+            return 1;
+        }
+        zone_add(zone);
+
+        ldns_rr *soa = ldns_zone_soa(zone);
+        add_query(ldns_rr_owner(soa), LDNS_RR_TYPE_SOA, ldns_rr_get_class(soa));
+        for (size_t j = 0; j < ldns_zone_rr_count(zone); j++) {
+            ldns_rr *rr = ldns_rr_list_rr(ldns_zone_rrs(zone), j);
+            add_query(ldns_rr_owner(rr), ldns_rr_get_type(rr), ldns_rr_get_class(rr));
+        }
+    }
+    fprintf(stderr, "%zu queries, %d iterations\n", query_count, iterations);
+
+    printf("%-8s %12s %12s %12s\n", "path", "allocs/query", "frees/query", "ns/query");
+    for (int path = PATH_FAST; path <= PATH_CACHED; path++) {
+        // the first round warms up the per-thread state and the cache
+        run(path, 1, false);
+        run(path, iterations, true);
+    }
+    return 0;
+}
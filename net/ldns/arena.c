@@ -0,0 +1,74 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+#include "arena.h"
+#include <ldns/ldns.h>
+#include <stdint.h>
+
+#define ARENA_CHUNK 65536
+#define ARENA_ALIGN 16
+
+typedef struct arena_chunk {
+    struct arena_chunk *next;  // smaller, outgrown by the current request
+    size_t size;
+    size_t used;
+    _Alignas(ARENA_ALIGN) uint8_t data[];
+} arena_chunk;
+
+#ifdef NO_ARENA
+
+// each allocation is a malloc of its own, freed on reset as the callers did before
+static __thread void **blocks;
+static __thread size_t block_count, block_cap;
+
+void *arena_alloc(size_t size) {
+    if (block_count == block_cap) {
+        block_cap = block_cap ? block_cap * 2 : 64;
+        blocks = LDNS_XREALLOC(blocks, void*, block_cap);
+    }
+    return blocks[block_count++] = LDNS_XMALLOC(uint8_t, size);
+}
+
+void arena_reset() {
+    while (block_count) free(blocks[--block_count]);
+}
+
+#else
+
+// the largest chunk first
+static __thread arena_chunk *chunks;
+
+void *arena_alloc(size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+    arena_chunk *chunk = chunks;
+    if (!chunk || chunk->size - chunk->used < size) {
+        size_t chunk_size = chunk ? chunk->size * 2 : ARENA_CHUNK;
+        while (chunk_size < size) chunk_size *= 2;
+        chunk = (arena_chunk*) LDNS_XMALLOC(uint8_t, sizeof(arena_chunk) + chunk_size);
+        chunk->next = chunks;
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        chunks = chunk;
+    }
+    void *p = chunk->data + chunk->used;
+    chunk->used += size;
+    return p;
+}
+
+void arena_reset() {
+    arena_chunk *chunk = chunks;
+    if (!chunk) return;
+    while (chunk->next) {
+        arena_chunk *next = chunk->next;
+        chunk->next = next->next;
+        LDNS_FREE(next);
+    }
+    chunk->used = 0;
+}
+
+#endif
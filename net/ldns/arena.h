@@ -0,0 +1,34 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/*
+ * Per-thread bump allocator for the memory that lives as long as a request,
+ * such as the answers returned by handle_dns_wire. Each thread allocates
+ * from its own arena without locking, and releases everything at once with
+ * arena_reset when the request (or a batch of them) is done.
+ *
+ * When a request does not fit, a chunk twice as large is added; the
+ * smaller chunks are freed on the next reset, so that a thread settles on
+ * a single chunk as large as its biggest request, and allocates from the
+ * system no more.
+ *
+ * Built with NO_ARENA (make NO_ARENA=1), each allocation is a malloc of
+ * its own and arena_reset frees them, and answers clone the records of the
+ * zone instead of borrowing them (dns_bsd3.c): the allocation pattern of
+ * the server before the arena, for comparison with allocbench.
+ */
+
+void *arena_alloc(size_t size);
+void arena_reset();
+
+#endif
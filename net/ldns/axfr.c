@@ -0,0 +1,257 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+#include "axfr.h"
+#include "dns_fast.h"
+#include "journal.h"
+#include "rrset_index.h"
+#include "zone_snapshot.h"
+#include "wire.h"
+#include <pthread.h>
+
+#define AXFR_MAX_MESSAGE 65535
+#define OPT_SIZE 11
+
+typedef struct axfr_entry {
+    ldns_rdf *apex;
+    ldns_rr_class rr_class;
+    uint32_t serial;
+    axfr_stream *streams[2];  // without and with EDNS
+    struct axfr_entry *next;
+} axfr_entry;
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static axfr_entry *cache;
+static uint64_t cache_gen;  // bumped by axfr_cache_invalidate
+
+typedef struct axfr_render {
+    axfr_stream *stream;
+    size_t capacity;
+    bool edns;
+    const ldns_zone *zone;
+    ldns_rr_type qtype;
+
+    wire_writer w;
+    uint16_t ancount;
+    bool first;
+} axfr_render;
+
+static void message_start(axfr_render *r) {
+    // room for the length prefix and a full message
+    size_t needed = r->stream->size + 2 + AXFR_MAX_MESSAGE;
+    if (needed > r->capacity) {
+        r->capacity = needed * 2;
+        r->stream = realloc(r->stream, sizeof(axfr_stream) + r->capacity);
+    }
+
+    wire_init(&r->w, r->stream->data + r->stream->size + 2, AXFR_MAX_MESSAGE - (r->edns ? OPT_SIZE : 0));
+    r->w.pos = LDNS_HEADER_SIZE;
+    r->ancount = 0;
+
+    if (r->first) {
+        ldns_rdf *apex = ldns_rr_owner(ldns_zone_soa(r->zone));
+        wire_write_name(&r->w, ldns_rdf_data(apex), ldns_rdf_size(apex), true);
+        wire_write_u16(&r->w, r->qtype);
+        wire_write_u16(&r->w, ldns_rr_get_class(ldns_zone_soa(r->zone)));
+    }
+}
+
+static void message_finish(axfr_render *r) {
+    wire_writer *w = &r->w;
+    if (r->edns) {
+        // OPT record, root owner name and the payload size of the other answers
+        w->size = AXFR_MAX_MESSAGE;
+        wire_write_bytes(w, "", 1);
+        wire_write_u16(w, LDNS_RR_TYPE_OPT);
+        wire_write_u16(w, udp_payload);
+        wire_write_u32(w, 0);
+        wire_write_u16(w, 0);
+    }
+
+    uint8_t *header = w->buf;
+    memset(header, 0, LDNS_HEADER_SIZE);
+    header[2] = 0x84;  // QR, AA
+    ldns_write_uint16(header + 4, r->first ? 1 : 0);
+    ldns_write_uint16(header + 6, r->ancount);
+    ldns_write_uint16(header + 10, r->edns ? 1 : 0);
+
+    ldns_write_uint16(w->buf - 2, w->pos);
+    r->stream->size += 2 + w->pos;
+    r->stream->messages++;
+    r->first = false;
+}
+
+static bool render_rr(axfr_render *r, const ldns_rr *rr) {
+    wire_mark mark = wire_save(&r->w);
+    wire_write_rr(&r->w, rr);
+    if (!r->w.error) {
+        r->ancount++;
+        return true;
+    }
+
+    wire_rollback(&r->w, mark);
+    if (!r->ancount) return false;  // it does not fit in a message of its own
+    message_finish(r);
+    message_start(r);
+    wire_write_rr(&r->w, rr);
+    if (r->w.error) return false;
+    r->ancount++;
+    return true;
+}
+
+static void render_start(axfr_render *r, const ldns_zone *zone, ldns_rr_type qtype, bool edns) {
+    *r = (axfr_render) { .edns = edns, .zone = zone, .qtype = qtype, .first = true };
+    r->stream = LDNS_MALLOC(axfr_stream);
+    atomic_init(&r->stream->refs, 1);
+    r->stream->size = 0;
+    r->stream->messages = 0;
+    message_start(r);
+}
+
+static bool render_list(axfr_render *r, const ldns_rr_list *rrs) {
+    for (size_t i = 0; i < ldns_rr_list_rr_count(rrs); i++) {
+        if (!render_rr(r, ldns_rr_list_rr(rrs, i))) return false;
+    }
+    return true;
+}
+
+static axfr_stream *render_finish(axfr_render *r, bool ok) {
+    if (!ok) {
+        fprintf(stderr, "Cannot render zone transfer: record too large\n");
+        LDNS_FREE(r->stream);
+        return NULL;
+    }
+    message_finish(r);
+    return r->stream;
+}
+
+static bool render_foreach(const ldns_rr *rr, void *r) {
+    return render_rr(r, rr);
+}
+
+static axfr_stream *render(const ldns_zone *zone, bool edns) {
+    rrset_index *index = zone_snapshot_index(zone);
+
+    axfr_render r;
+    render_start(&r, zone, LDNS_RR_TYPE_AXFR, edns);
+    bool ok = render_rr(&r, ldns_zone_soa(zone))
+        && (index ? rrset_index_foreach(index, render_foreach, &r) : render_list(&r, ldns_zone_rrs(zone)))
+        && render_rr(&r, ldns_zone_soa(zone));
+    return render_finish(&r, ok);
+}
+
+static axfr_entry *entry_find(const ldns_rdf *apex, ldns_rr_class rr_class, axfr_entry ***link) {
+    for (axfr_entry **p = &cache; *p; p = &(*p)->next) {
+        if ((*p)->rr_class == rr_class && dname_equal((*p)->apex, apex)) {
+            if (link) *link = p;
+            return *p;
+        }
+    }
+    return NULL;
+}
+
+static void entry_clear(axfr_entry *entry) {
+    for (int i = 0; i < 2; i++) {
+        if (entry->streams[i]) axfr_stream_release(entry->streams[i]);
+        entry->streams[i] = NULL;
+    }
+}
+
+axfr_stream *axfr_stream_get(const ldns_zone *zone, bool edns) {
+    ldns_rr *soa = ldns_zone_soa(zone);
+    if (!soa) return NULL;
+    ldns_rdf *apex = ldns_rr_owner(soa);
+    ldns_rr_class rr_class = ldns_rr_get_class(soa);
+    uint32_t serial = ldns_rdf2native_int32(ldns_rr_rdf(soa, 2));
+
+    pthread_mutex_lock(&cache_mutex);
+    axfr_entry *entry = entry_find(apex, rr_class, NULL);
+    axfr_stream *stream = entry && entry->serial == serial ? entry->streams[edns] : NULL;
+    if (stream) atomic_fetch_add(&stream->refs, 1);
+    uint64_t gen = cache_gen;
+    pthread_mutex_unlock(&cache_mutex);
+    if (stream) return stream;
+
+    // rendered without holding the lock, a concurrent transfer may render it too
+    stream = render(zone, edns);
+    if (!stream) return NULL;
+
+    pthread_mutex_lock(&cache_mutex);
+    if (gen != cache_gen) {
+        // the zone was replaced while rendering, this stream may be stale
+        pthread_mutex_unlock(&cache_mutex);
+        return stream;
+    }
+    entry = entry_find(apex, rr_class, NULL);
+    if (!entry) {
+        entry = LDNS_CALLOC(axfr_entry, 1);
+        entry->apex = ldns_rdf_clone(apex);
+        entry->rr_class = rr_class;
+        entry->serial = serial;
+        entry->next = cache;
+        cache = entry;
+    } else if (entry->serial != serial) {
+        entry_clear(entry);
+        entry->serial = serial;
+    }
+    if (!entry->streams[edns]) {
+        atomic_fetch_add(&stream->refs, 1);
+        entry->streams[edns] = stream;
+    }
+    pthread_mutex_unlock(&cache_mutex);
+    return stream;
+}
+
+void axfr_stream_release(axfr_stream *stream) {
+    if (atomic_fetch_sub(&stream->refs, 1) == 1) free(stream);
+}
+
+axfr_stream *ixfr_stream_get(const ldns_zone *zone, uint32_t serial, bool edns) {
+    ldns_rr *soa = ldns_zone_soa(zone);
+    if (!soa) return NULL;
+
+    axfr_render r;
+    bool ok;
+    if ((int32_t) (serial - ldns_rdf2native_int32(ldns_rr_rdf(soa, 2))) >= 0) {
+        // the client is up to date
+        render_start(&r, zone, LDNS_RR_TYPE_IXFR, edns);
+        ok = render_rr(&r, soa);
+    } else {
+        ldns_rr *old_soa;
+        ldns_rr_list *deleted, *added;
+        if (!journal_condense(zone, serial, &old_soa, &deleted, &added)) return NULL;
+
+        render_start(&r, zone, LDNS_RR_TYPE_IXFR, edns);
+        ok = render_rr(&r, soa)
+            && render_rr(&r, old_soa) && render_list(&r, deleted)
+            && render_rr(&r, soa) && render_list(&r, added)
+            && render_rr(&r, soa);
+
+        ldns_rr_free(old_soa);
+        ldns_rr_list_deep_free(deleted);
+        ldns_rr_list_deep_free(added);
+    }
+    return render_finish(&r, ok);
+}
+
+void axfr_cache_invalidate(const ldns_zone *zone) {
+    ldns_rr *soa = ldns_zone_soa(zone);
+    if (!soa) return;
+
+    pthread_mutex_lock(&cache_mutex);
+    cache_gen++;
+    axfr_entry **link;
+    axfr_entry *entry = entry_find(ldns_rr_owner(soa), ldns_rr_get_class(soa), &link);
+    if (entry) {
+        *link = entry->next;
+        entry_clear(entry);
+        ldns_rdf_deep_free(entry->apex);
+        LDNS_FREE(entry);
+    }
+    pthread_mutex_unlock(&cache_mutex);
+}
@@ -0,0 +1,48 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+#ifndef AXFR_H
+#define AXFR_H
+
+#include <ldns/ldns.h>
+#include <stdatomic.h>
+
+/*
+ * Rendered zone transfers. A transfer is the SOA, the records of the zone
+ * and the SOA again, packed into as few messages of up to 64 KB as they
+ * fit in, with name compression within each message. The question is
+ * only included in the first message.
+ *
+ * The stream is cached per zone apex, class and SOA serial, with and
+ * without EDNS, so that repeated transfers of the same version of a zone
+ * are served from memory. zone_replace and zone_del drop the cached
+ * streams of the zone, which covers updates that keep the serial.
+ *
+ * Incremental transfers are rendered on demand from the journal, as a
+ * single condensed diff from the serial of the client to the current one,
+ * so their size follows the size of the change. ixfr_stream_get returns
+ * NULL when the journal does not reach back to that serial, and the
+ * client should get a full transfer instead.
+ */
+
+typedef struct axfr_stream {
+    _Atomic int refs;
+    size_t size;
+    size_t messages;
+    // messages with their two-byte length prefix, and message ID 0
+    uint8_t data[];
+} axfr_stream;
+
+axfr_stream *axfr_stream_get(const ldns_zone *zone, bool edns);
+void axfr_stream_release(axfr_stream *stream);
+
+axfr_stream *ixfr_stream_get(const ldns_zone *zone, uint32_t serial, bool edns);
+
+void axfr_cache_invalidate(const ldns_zone *zone);
+
+#endif
@@ -30,35 +30,94 @@
  */
 
 #include "dns_server.h"
+#include "rcu.h"
+#include "response_cache.h"
+#include "dns_fast.h"
+#include "query_log.h"
+#include "zone_snapshot.h"
+#include "stats.h"
+#include "notify.h"
+#include "arena.h"
+#include "trace.h"
+#ifdef MULTI_PRIMARY
+#include "replicator.h"
+#endif
 
 extern opts_struct opts;
 extern int udp_sock;
 
-pthread_rwlock_t lock;
 pthread_mutex_t update_mutex;
 
+void handle_ixfr_request(ldns_zone* zone, uint32_t serial, ldns_pkt* answer_pkt, int sock);
+
+// the records of an answer are cloned from the zone with NO_ARENA, see arena.h
+#ifdef NO_ARENA
+#define BORROW_RECORDS false
+#else
+#define BORROW_RECORDS true
+#endif
+
+static void answer_wire(void* inbuf,ssize_t nb,uint8_t** outbuf, size_t *answer_size, int sock);
+static ldns_status truncate_answer(ldns_pkt *answer_pkt, size_t limit, bool borrowed, ldns_buffer *wire);
+
+/*
+ * The answer is allocated from the arena of the calling thread, and stays
+ * valid until its next arena_reset.
+ */
 void handle_dns_wire(void* inbuf,ssize_t nb,uint8_t** outbuf, size_t *answer_size, int sock) {
-    printf("Got query of %u bytes\n", (unsigned int) nb);
+    uint64_t start = stats_now();
+    answer_wire(inbuf, nb, outbuf, answer_size, sock);
+    // transfers are timed on their own
+    if (*outbuf) stats_time(STATS_WIRE, stats_now() - start);
+}
 
+static void answer_wire(void* inbuf,ssize_t nb,uint8_t** outbuf, size_t *answer_size, int sock) {
     ldns_status status;
     ldns_pkt *query_pkt;
     ldns_pkt *answer_pkt;
 
     *outbuf = NULL;
 
+    cache_query cq;
+    bool cacheable = response_cache_parse(inbuf, nb, sock != 0, &cq);
+    if (cacheable) {
+        bool hit = response_cache_get(&cq, inbuf, outbuf, answer_size);
+        trace_lap(TRACE_CACHE);
+        if (hit) return;
+        response_cache_prepare(&cq);
+    }
+
     status = ldns_wire2pkt(&query_pkt, inbuf, (size_t) nb);
+    trace_lap(TRACE_PARSE);
     if (status != LDNS_STATUS_OK) {
-        printf("Got bad packet: %s\n", ldns_get_errorstr_by_id(status));
+        if (query_log_level >= QLOG_TEXT) printf("Got bad packet: %s\n", ldns_get_errorstr_by_id(status));
         return;
     } 
-    ldns_pkt_print(stdout, query_pkt);
+    if (query_log_level >= QLOG_TEXT) {
+        printf("Got query of %u bytes\n", (unsigned int) nb);
+        ldns_pkt_print(stdout, query_pkt);
+    }
     
     if (ldns_pkt_qr(query_pkt) && ldns_pkt_get_opcode(query_pkt)!=LDNS_PACKET_NOTIFY) {
-        printf("Received DNS response\n");
+        if (query_log_level >= QLOG_TEXT) printf("Received DNS response\n");
         ldns_pkt_free(query_pkt);
         return;
     }
     
+    // largest answer the client accepts over UDP
+    size_t limit = UDP_PAYLOAD_MIN;
+    if (ldns_pkt_edns(query_pkt)) {
+        limit = ldns_pkt_edns_udp_size(query_pkt);
+        if (limit < UDP_PAYLOAD_MIN) limit = UDP_PAYLOAD_MIN;
+        if (limit > udp_payload) limit = udp_payload;
+    }
+
+    // the records of an answer to a query are borrowed from the zone, which
+    // must not be reclaimed until the answer is rendered
+    bool query = ldns_pkt_get_opcode(query_pkt)==LDNS_PACKET_QUERY;
+    bool borrowed = query && BORROW_RECORDS;
+    if (query) rcu_read_lock();
+
     answer_pkt = ldns_pkt_new();
 
     ldns_pkt_set_opcode(answer_pkt, ldns_pkt_get_opcode(query_pkt));
@@ -66,7 +125,7 @@ void handle_dns_wire(void* inbuf,ssize_t nb,uint8_t** outbuf, size_t *answer_siz
     ldns_pkt_set_qr(answer_pkt, 1);
 
     if (ldns_pkt_edns(query_pkt)) {
-        ldns_pkt_set_edns_udp_size(answer_pkt, 4096);
+        ldns_pkt_set_edns_udp_size(answer_pkt, udp_payload);
         if (ldns_pkt_edns_version(query_pkt)>0) {
             ldns_pkt_set_edns_extended_rcode(answer_pkt, 1);
         }
@@ -83,43 +142,122 @@ void handle_dns_wire(void* inbuf,ssize_t nb,uint8_t** outbuf, size_t *answer_siz
 
     ldns_pkt_free(query_pkt);
     
-    if (ldns_pkt_get_rcode(answer_pkt)==LDNS_RCODE_ALREADY_HANDLED) {
-        ldns_pkt_free(answer_pkt);
-        return;
-    } 
+    if (ldns_pkt_get_rcode(answer_pkt)!=LDNS_RCODE_ALREADY_HANDLED) {
+        // rendered into a buffer kept by the thread, then copied to the arena
+        #ifdef NO_ARENA
+        ldns_buffer *wire = ldns_buffer_new(LDNS_MAX_PACKETLEN);
+        #else
+        static __thread ldns_buffer *wire;
+        if (!wire) wire = ldns_buffer_new(LDNS_MAX_PACKETLEN);
+        ldns_buffer_clear(wire);
+        #endif
 
-    status = ldns_pkt2wire(outbuf, answer_pkt, answer_size);
-    
-    if (status != LDNS_STATUS_OK) {
-        printf("Error creating answer: %s\n", ldns_get_errorstr_by_id(status));
-        LDNS_FREE(outbuf);
-    } else {
-        ldns_pkt_print(stdout, answer_pkt);
+        status = ldns_pkt2buffer_wire(wire, answer_pkt);
+        if (status == LDNS_STATUS_OK && !sock && ldns_buffer_position(wire) > limit) {
+            status = truncate_answer(answer_pkt, limit, borrowed, wire);
+        }
+        trace_lap(TRACE_RENDER);
+
+        if (status != LDNS_STATUS_OK) {
+            printf("Error creating answer: %s\n", ldns_get_errorstr_by_id(status));
+        } else {
+            *answer_size = ldns_buffer_position(wire);
+            *outbuf = arena_alloc(*answer_size);
+            memcpy(*outbuf, ldns_buffer_begin(wire), *answer_size);
+            if (cacheable) response_cache_put(&cq, inbuf, *outbuf, *answer_size);
+            if (query_log_level >= QLOG_TEXT) ldns_pkt_print(stdout, answer_pkt);
+        }
+        #ifdef NO_ARENA
+        ldns_buffer_free(wire);
+        #endif
     }
+
+    if (borrowed) {
+        // returned to the zone before the packet is freed
+        ldns_rr_list_set_rr_count(ldns_pkt_answer(answer_pkt), 0);
+        ldns_rr_list_set_rr_count(ldns_pkt_authority(answer_pkt), 0);
+        ldns_rr_list_set_rr_count(ldns_pkt_additional(answer_pkt), 0);
+    }
+    if (query) rcu_read_unlock();
     ldns_pkt_free(answer_pkt);
 
 }
 
+static void drop_rr(ldns_rr *rr, bool borrowed) {
+    if (!borrowed) ldns_rr_free(rr);
+}
+
+static void clear_section(ldns_rr_list *rrs, bool borrowed) {
+    while (ldns_rr_list_rr_count(rrs)) drop_rr(ldns_rr_list_pop_rr(rrs), borrowed);
+}
+
+/*
+ * Fit a UDP answer into limit bytes (RFC 2181, section 9): the additional
+ * and authority sections are dropped first, then whole RRsets from the end
+ * of the answer section. TC is set once a record the client needs is left
+ * out, so that it retries over TCP.
+ */
+static ldns_status truncate_answer(ldns_pkt *answer_pkt, size_t limit, bool borrowed, ldns_buffer *wire) {
+    while (ldns_buffer_position(wire) > limit) {
+        ldns_rr_list *an = ldns_pkt_answer(answer_pkt);
+        if (ldns_pkt_arcount(answer_pkt)) {
+            clear_section(ldns_pkt_additional(answer_pkt), borrowed);
+            ldns_pkt_set_arcount(answer_pkt, 0);
+        } else if (ldns_pkt_nscount(answer_pkt)) {
+            // the SOA of a negative answer is required
+            if (!ldns_pkt_ancount(answer_pkt)) ldns_pkt_set_tc(answer_pkt, 1);
+            clear_section(ldns_pkt_authority(answer_pkt), borrowed);
+            ldns_pkt_set_nscount(answer_pkt, 0);
+        } else if (ldns_rr_list_rr_count(an)) {
+            ldns_rr *last = ldns_rr_list_pop_rr(an);
+            while (ldns_rr_list_rr_count(an)) {
+                ldns_rr *rr = ldns_rr_list_rr(an, ldns_rr_list_rr_count(an) - 1);
+                if (ldns_rr_get_type(rr) != ldns_rr_get_type(last)
+                    || ldns_dname_compare(ldns_rr_owner(rr), ldns_rr_owner(last))) break;
+                drop_rr(ldns_rr_list_pop_rr(an), borrowed);
+            }
+            drop_rr(last, borrowed);
+            ldns_pkt_set_ancount(answer_pkt, ldns_rr_list_rr_count(an));
+            ldns_pkt_set_tc(answer_pkt, 1);
+        } else {
+            // nothing left to drop, the answer is sent as it is
+            ldns_pkt_set_tc(answer_pkt, 1);
+            limit = SIZE_MAX;
+        }
+
+        ldns_buffer_clear(wire);
+        ldns_status status = ldns_pkt2buffer_wire(wire, answer_pkt);
+        if (status != LDNS_STATUS_OK) return status;
+    }
+    return LDNS_STATUS_OK;
+}
+
+// queries are answered within the read-side section of the caller
 void handle_dns_pkt(const ldns_pkt* query_pkt, ldns_pkt* answer_pkt, int sock) {
     if (ldns_pkt_get_opcode(query_pkt)==LDNS_PACKET_QUERY) {
-        pthread_rwlock_rdlock(&lock);
         handle_dns_query(query_pkt, answer_pkt, sock);
-        pthread_rwlock_unlock(&lock);
     } else if (ldns_pkt_get_opcode(query_pkt)==LDNS_PACKET_UPDATE) {
-        pthread_mutex_lock(&update_mutex);
+        update_mutex_lock();
         ldns_pkt_rcode rcode = handle_dns_update(query_pkt, answer_pkt);
+        #ifdef MULTI_PRIMARY
+        // acknowledged once durable locally, the push to git follows asynchronously
+        if (rcode == LDNS_RCODE_NOERROR && !replicator_log(query_pkt)) rcode = LDNS_RCODE_SERVFAIL;
+        #endif
         ldns_pkt_set_rcode(answer_pkt, rcode);
-        pthread_mutex_unlock(&update_mutex);
+        update_mutex_unlock();
+        stats_update(rcode);
     } else if (ldns_pkt_get_opcode(query_pkt)==LDNS_PACKET_NOTIFY) {
         ldns_pkt_rcode rcode = handle_dns_notify(query_pkt, answer_pkt);
         ldns_pkt_set_rcode(answer_pkt, rcode);
     }
 }
 
+static ldns_rr *answer_rr(ldns_rr *rr) {
+    return BORROW_RECORDS ? rr : ldns_rr_clone(rr);
+}
+
 void handle_dns_query(const ldns_pkt* query_pkt, ldns_pkt* answer_pkt, int sock) {
     ldns_rr_list *answer_an;
-    ldns_rr_list *answer_ns;
-    ldns_rr_list *answer_ad;
 
     size_t qdcount = ldns_pkt_qdcount(query_pkt);
     if (qdcount!=1) {
@@ -131,6 +269,7 @@ void handle_dns_query(const ldns_pkt* query_pkt, ldns_pkt* answer_pkt, int sock)
     ldns_rr2canonical(query_rr);
 
     ldns_zone *zone = zone_find(ldns_rr_owner(query_rr), ldns_rr_get_class(query_rr));
+    trace_lap(TRACE_ZONE);
    
     ldns_pkt_push_rr(answer_pkt, LDNS_SECTION_QUESTION, ldns_rr_clone(query_rr));
 
@@ -138,31 +277,51 @@ void handle_dns_query(const ldns_pkt* query_pkt, ldns_pkt* answer_pkt, int sock)
         ldns_pkt_set_aa(answer_pkt, 1);
         if (ldns_rr_get_type(query_rr)==LDNS_RR_TYPE_AXFR) {
             if (sock) {
-                zone = ldns_zone_clone(zone);
-                pthread_rwlock_unlock(&lock);
+                // streamed from the published zone, which stays alive until the transfer is done
+                zone = zone_snapshot_get(zone);
+                rcu_read_unlock();
                 handle_axfr_request(zone, answer_pkt, sock);
                 ldns_pkt_set_rcode(answer_pkt, LDNS_RCODE_ALREADY_HANDLED);
-                ldns_zone_deep_free(zone);
-                pthread_rwlock_rdlock(&lock);
+                zone_snapshot_put(zone);
+                rcu_read_lock();
              } else {
                 ldns_pkt_set_rcode(answer_pkt, LDNS_RCODE_SERVFAIL);
              }
              return;
         }
 
-        answer_an = get_rrset(zone, ldns_rr_owner(query_rr), ldns_rr_get_type(query_rr), ldns_rr_get_class(query_rr), RRSET_CLONE|RRSET_FOLLOW_CNAME);
-        answer_ns = ldns_rr_list_new();
-        answer_ad = ldns_rr_list_new();
-
-        ldns_rr_list_push_rr(answer_ns, ldns_rr_clone(ldns_zone_soa(zone)));
+        if (ldns_rr_get_type(query_rr)==LDNS_RR_TYPE_IXFR) {
+            // the version held by the client is given by the SOA in the authority section
+            ldns_rr *client_soa = ldns_rr_list_rr(ldns_pkt_authority(query_pkt), 0);
+            if (!client_soa || ldns_rr_get_type(client_soa)!=LDNS_RR_TYPE_SOA || !ldns_rr_rdf(client_soa, 2)) {
+                ldns_pkt_set_rcode(answer_pkt, LDNS_RCODE_FORMERR);
+            } else if (sock) {
+                zone = zone_snapshot_get(zone);
+                rcu_read_unlock();
+                handle_ixfr_request(zone, ldns_rdf2native_int32(ldns_rr_rdf(client_soa, 2)), answer_pkt, sock);
+                ldns_pkt_set_rcode(answer_pkt, LDNS_RCODE_ALREADY_HANDLED);
+                zone_snapshot_put(zone);
+                rcu_read_lock();
+            } else {
+                // over UDP, the current SOA tells the client to retry over TCP (RFC 1995)
+                ldns_pkt_push_rr(answer_pkt, LDNS_SECTION_ANSWER, answer_rr(ldns_zone_soa(zone)));
+                ldns_pkt_set_rcode(answer_pkt, LDNS_RCODE_NOERROR);
+            }
+            return;
+        }
 
+        // the records are borrowed, see answer_wire
+        answer_an = get_rrset(zone, ldns_rr_owner(query_rr), ldns_rr_get_type(query_rr), ldns_rr_get_class(query_rr),
+            BORROW_RECORDS ? RRSET_FOLLOW_CNAME : RRSET_CLONE|RRSET_FOLLOW_CNAME);
+        trace_lap(TRACE_RRSET);
         ldns_pkt_push_rr_list(answer_pkt, LDNS_SECTION_ANSWER, answer_an);
-        ldns_pkt_push_rr_list(answer_pkt, LDNS_SECTION_AUTHORITY, answer_ns);
-        ldns_pkt_push_rr_list(answer_pkt, LDNS_SECTION_ADDITIONAL, answer_ad);
-        
+
+        // with minimal responses, the SOA is only given in negative answers
+        if (!minimal_responses || !ldns_rr_list_rr_count(answer_an)) {
+            ldns_pkt_push_rr(answer_pkt, LDNS_SECTION_AUTHORITY, answer_rr(ldns_zone_soa(zone)));
+        }
+
         ldns_rr_list_free(answer_an);
-        ldns_rr_list_free(answer_ns);
-        ldns_rr_list_free(answer_ad);
 
         ldns_pkt_set_rcode(answer_pkt, LDNS_RCODE_NOERROR);
     } else {
@@ -171,62 +330,7 @@ void handle_dns_query(const ldns_pkt* query_pkt, ldns_pkt* answer_pkt, int sock)
 } 
 
 void send_notify(ldns_zone* zone) {
-    ldns_rr *soa = ldns_zone_soa(zone);
-    if (!soa) return;
-
-    ldns_pkt* notify = ldns_pkt_new();
-    ldns_rr *question = ldns_rr_new();
-
-    ldns_rr_set_class(question, ldns_rr_get_class(soa));
-    ldns_rr_set_owner(question, ldns_rdf_clone(ldns_rr_owner(soa)));
-    ldns_rr_set_type(question, LDNS_RR_TYPE_SOA);
-    ldns_rr_set_question(question, true);
-    ldns_pkt_set_opcode(notify, LDNS_PACKET_NOTIFY);
-    ldns_pkt_push_rr(notify, LDNS_SECTION_QUESTION, question);
-    ldns_pkt_set_aa(notify, true);
-    ldns_pkt_set_random_id(notify);
-
-    uint8_t *wire = NULL;
-    size_t wiresize = 0;
-
-    ldns_status status = ldns_pkt2wire(&wire, notify, &wiresize);
-    ldns_pkt_free(notify);
-    if (status) {
-        fprintf(stderr, "Error converting notify packet to hex: %s\n",
-                ldns_get_errorstr_by_id(status));
-        return;
-    } 
-
-    ldns_rr_list *rrlist_a  = ldns_rr_list_new();
-    ldns_rr_list *rrlist_ns = get_rrset(zone, ldns_rr_owner(soa), LDNS_RR_TYPE_NS, ldns_rr_get_class(soa), 0);
-    for (uint16_t i=ldns_rr_list_rr_count(rrlist_ns); i-->0;) {
-        ldns_rr *rr = ldns_rr_list_rr(rrlist_ns,i);
-        ldns_rdf *nsdname = ldns_rr_ns_nsdname(rr);
-        ldns_rr_list *rrs = get_rrset(zone_find(nsdname, LDNS_RR_CLASS_IN), nsdname, LDNS_RR_TYPE_A, LDNS_RR_CLASS_IN, 0);
-        if (ldns_rr_list_rr_count(rrs)) {
-            ldns_rr* rr_a = ldns_rr_list_rr(rrs,0);
-            ldns_rdf* address = ldns_rr_a_address(rr_a);
-            if (ldns_rdf_size(address) == 4
-             && ldns_rdf_get_type(address)==LDNS_RDF_TYPE_A
-             && memcmp(ldns_rdf_data(address), &opts.address, 4)!=0) {
-                ldns_rr_list_push_rr(rrlist_a, ldns_rr_clone(rr_a)); 
-            }
-        }
-        ldns_rr_list_free(rrs);
-    }
-
-    ldns_rr_list_free(rrlist_ns);
-    for (uint16_t i=ldns_rr_list_rr_count(rrlist_a); i-->0;) {
-       ldns_rr *rr = ldns_rr_list_rr(rrlist_a,i);
-       ldns_rdf* address = ldns_rr_a_address(rr);
-       struct sockaddr_in addr;
-       addr.sin_family = AF_INET;
-       addr.sin_port = htons(53);
-       memcpy(&addr.sin_addr.s_addr,ldns_rdf_data(address),4);
-       sendto(udp_sock, (void*)wire, wiresize, 0, (struct sockaddr*)&addr, sizeof addr);
-    }
-
-    ldns_rr_list_deep_free(rrlist_a);
-    LDNS_FREE(wire);
+    // sent in the background, together with the other changes within the window
+    notify_schedule(zone);
 }
 
@@ -0,0 +1,156 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+#include "dns_fast.h"
+#include "response_cache.h"
+#include "rrset_index.h"
+#include "zone_table.h"
+#include "rcu.h"
+#include "wire.h"
+#include "trace.h"
+
+#define MAX_CNAME_CHAIN 20
+#define OPT_SIZE 11
+
+bool minimal_responses;
+uint16_t udp_payload = UDP_PAYLOAD_DEFAULT;
+
+/*
+ * Same records as get_rrset with RRSET_FOLLOW_CNAME, written as they are
+ * found. An RRset that does not fit is removed, and nothing is written
+ * after it: the answer is truncated.
+ */
+static uint16_t write_answer(wire_writer *w, const rrset_index *index, const ldns_rdf *qname, ldns_rr_type qtype, ldns_rr_class qclass, bool *truncated) {
+    uint16_t count = 0;
+    const ldns_rdf *name = qname;
+    while (name) {
+        const rrset_node *node = rrset_index_find(index, name);
+        if (!node) break;
+        name = NULL;
+
+        const ldns_rr *cname = NULL;
+        if (qtype != LDNS_RR_TYPE_CNAME && qtype != LDNS_RR_TYPE_ANY) {
+            for (size_t i = 0; i < node->count && !cname; i++) {
+                const rrset *set = node->rrsets[i];
+                if (set->type != LDNS_RR_TYPE_CNAME || (set->rr_class != qclass && LDNS_RR_CLASS_ANY != qclass)) continue;
+                cname = ldns_rr_list_rr(set->rrs, 0);
+            }
+        }
+        if (cname) {
+            wire_mark mark = wire_save(w);
+            wire_write_rr(w, cname);
+            if (w->error) {
+                wire_rollback(w, mark);
+                *truncated = true;
+                break;
+            }
+            if (++count < MAX_CNAME_CHAIN) name = ldns_rr_rdf(cname, 0);
+            continue;
+        }
+
+        for (size_t i = 0; i < node->count; i++) {
+            const rrset *set = node->rrsets[i];
+            if ((set->type == qtype || LDNS_RR_TYPE_ANY == qtype) &&
+                (set->rr_class == qclass || LDNS_RR_CLASS_ANY == qclass)) {
+                wire_mark mark = wire_save(w);
+                size_t n = ldns_rr_list_rr_count(set->rrs);
+                for (size_t j = 0; j < n; j++) {
+                    wire_write_rr(w, ldns_rr_list_rr(set->rrs, j));
+                }
+                if (w->error) {
+                    wire_rollback(w, mark);
+                    *truncated = true;
+                    return count;
+                }
+                count += n;
+            }
+        }
+    }
+    return count;
+}
+
+size_t handle_dns_fast(const uint8_t *inbuf, size_t nb, uint8_t *outbuf, size_t size, bool tcp) {
+    cache_query cq;
+    if (!response_cache_parse(inbuf, nb, tcp, &cq)) return 0;
+
+    // BADVERS is answered by handle_dns_wire
+    if (cq.edns & EDNS_VERSION) return 0;
+
+    size_t answer_size = response_cache_copy(&cq, inbuf, outbuf, size);
+    trace_lap(TRACE_CACHE);
+    if (answer_size) return answer_size;
+    response_cache_prepare(&cq);
+
+    // room is kept for the OPT record, which is never left out
+    size_t opt_size = (cq.edns & EDNS_PRESENT) ? OPT_SIZE : 0;
+    size_t limit = cq.max_size < size ? cq.max_size : size;
+    if (limit < LDNS_HEADER_SIZE + cq.qname_len + 4 + opt_size) return 0;
+
+    wire_writer w;
+    wire_init(&w, outbuf, limit - opt_size);
+    w.pos = LDNS_HEADER_SIZE;
+
+    // the question as sent by the client
+    wire_write_name(&w, inbuf + LDNS_HEADER_SIZE, cq.qname_len, true);
+    wire_write_bytes(&w, inbuf + LDNS_HEADER_SIZE + cq.qname_len, 4);
+
+    ldns_rdf qname = { ._size = cq.qname_len, ._type = LDNS_RDF_TYPE_DNAME, ._data = cq.key };
+    uint16_t ancount = 0;
+    uint16_t nscount = 0;
+
+    rcu_read_lock();
+    ldns_zone *zone = zone_table_find(&qname, cq.qclass);
+    rrset_index *index = zone ? zone_index(zone) : NULL;
+    if (zone && !index) {
+        rcu_read_unlock();
+        return 0;
+    }
+    bool truncated = false;
+    if (zone) {
+        ancount = write_answer(&w, index, &qname, cq.qtype, cq.qclass, &truncated);
+        // the SOA is only needed by negative answers, which are truncated without it
+        if (!truncated && (!minimal_responses || !ancount)) {
+            wire_mark mark = wire_save(&w);
+            wire_write_rr(&w, ldns_zone_soa(zone));
+            if (w.error) {
+                wire_rollback(&w, mark);
+                truncated = !ancount;
+            } else {
+                nscount = 1;
+            }
+        }
+    }
+    rcu_read_unlock();
+    trace_lap(TRACE_FAST);
+
+    // over TCP the full answer is rendered by handle_dns_wire
+    if (w.error || (truncated && tcp)) return 0;
+
+    if (cq.edns & EDNS_PRESENT) {
+        // OPT record, root owner name and our payload size
+        w.size = limit;
+        wire_write_bytes(&w, "", 1);
+        wire_write_u16(&w, LDNS_RR_TYPE_OPT);
+        wire_write_u16(&w, udp_payload);
+        wire_write_u32(&w, 0);
+        wire_write_u16(&w, 0);
+    }
+
+    if (w.error) return 0;
+
+    memcpy(outbuf, inbuf, 2);
+    outbuf[2] = 0x80 | (zone ? 0x04 : 0) | (truncated ? 0x02 : 0);
+    outbuf[3] = zone ? LDNS_RCODE_NOERROR : LDNS_RCODE_NXDOMAIN;
+    ldns_write_uint16(outbuf + 4, 1);
+    ldns_write_uint16(outbuf + 6, ancount);
+    ldns_write_uint16(outbuf + 8, nscount);
+    ldns_write_uint16(outbuf + 10, (cq.edns & EDNS_PRESENT) ? 1 : 0);
+
+    response_cache_put(&cq, inbuf, outbuf, w.pos);
+    return w.pos;
+}
@@ -0,0 +1,42 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+#ifndef DNS_FAST_H
+#define DNS_FAST_H
+
+#include <ldns/ldns.h>
+
+/*
+ * Fast path for plain queries: opcode QUERY, one question, and at most an
+ * OPT record (EDNS version 0). The header and question are parsed straight
+ * from the wire, and the answer is rendered with name compression into the
+ * buffer provided by the caller, without building ldns packets and without
+ * allocating.
+ *
+ * Over UDP, answers are limited to the payload size of the client (see
+ * response_cache_parse); an answer that does not fit is truncated after
+ * the last whole RRset that does, and sent with TC set.
+ *
+ * Returns the size of the answer, or 0 if the query must be handled by
+ * handle_dns_wire (anything unusual, or a TCP answer that does not fit).
+ */
+size_t handle_dns_fast(const uint8_t *inbuf, size_t nb, uint8_t *outbuf, size_t size, bool tcp);
+
+/*
+ * Shaping of the answers, shared with handle_dns_query. With
+ * minimal_responses the SOA is only added to the authority section of
+ * negative answers (NXDOMAIN and NODATA). udp_payload is the largest UDP
+ * answer, advertised in the OPT record of the answers.
+ */
+#define UDP_PAYLOAD_DEFAULT 1232
+#define UDP_PAYLOAD_MIN 512
+
+extern bool minimal_responses;
+extern uint16_t udp_payload;
+
+#endif
@@ -35,6 +35,18 @@
  */
 
 #include <ldns/ldns.h>
+#include "rrset_index.h"
+#include "zone_table.h"
+#include "rcu.h"
+#include "response_cache.h"
+#include "query_log.h"
+#include "tcp_server.h"
+#include "axfr.h"
+#include "journal.h"
+#include "zone_snapshot.h"
+#include "zone_compiled.h"
+#include "stats.h"
+#include "notify.h"
 
 #define CAN_CREATE_ZONE
 #define CAN_DELETE_ZONE
@@ -49,30 +61,12 @@
 
 #include <pthread.h>
 
-#define LDNS_RCODE_ALREADY_HANDLED 255
-#define INBUF_SIZE 4096
-
-void handle_dns_wire(void* inbuf,ssize_t nb, uint8_t** outbuf, size_t *answer_size, int sock);
-void handle_dns_pkt(const ldns_pkt* query_pkt, ldns_pkt* answer_pkt, int sock);
-void handle_dns_query(const ldns_pkt* query_pkt, ldns_pkt* answer_pkt, int sock);
 ldns_pkt_rcode handle_dns_update(const ldns_pkt* query_pkt, ldns_pkt* answer_pkt);
 void handle_axfr_request(ldns_zone*, ldns_pkt* answer_pkt, int sock);
+void handle_ixfr_request(ldns_zone*, uint32_t serial, ldns_pkt* answer_pkt, int sock);
 
-
-static pthread_mutex_t mutex;
-static pthread_mutex_t update_mutex;
-
-static void* listen_tcp(void* psock);
-
-static int bind_port(int sock, int port, in_addr_t maddr)
-{
-    struct sockaddr_in addr;
-    addr.sin_family = AF_INET;
-    addr.sin_port = (in_port_t) htons((uint16_t)port);
-    addr.sin_addr.s_addr = maddr;
-    return bind(sock, (struct sockaddr *)&addr, (socklen_t) sizeof(addr));
-}
-
+// changes made by the update being applied, under the update mutex
+static journal_diff *update_diff;
 
 #define RRSET_CLONE 1
 #define RRSET_FOLLOW_CNAME 2
@@ -84,7 +78,40 @@ get_rrset_into(const ldns_zone *zone, const ldns_rdf *owner_name, const ldns_rr_
         fprintf(stderr, "Warning: get_rrset called with NULL zone or owner name\n");
         return;
     }
-    
+
+    rrset_index *index = zone_index(zone);
+    if (index) {
+        const rrset_node *node = rrset_index_find(index, owner_name);
+        if (!node) return;
+
+        if ((flags&RRSET_FOLLOW_CNAME) && qtype!=LDNS_RR_TYPE_CNAME && qtype!=LDNS_RR_TYPE_ANY) {
+            for (size_t i = 0; i < node->count; i++) {
+                const rrset *set = node->rrsets[i];
+                if (set->type!=LDNS_RR_TYPE_CNAME || (set->rr_class!=qclass && LDNS_RR_CLASS_ANY!=qclass)) continue;
+                ldns_rr *rr = ldns_rr_list_rr(set->rrs, 0);
+                if (flags&RRSET_CLONE) rr = ldns_rr_clone(rr);
+                ldns_rr_list_push_rr(rrlist, rr);
+                if (ldns_rr_list_rr_count(rrlist)<20) {
+                  get_rrset_into(zone, ldns_rr_rdf(rr,0), qtype, qclass, flags, rrlist);
+                }
+                return;
+            }
+        }
+
+        for (size_t i = 0; i < node->count; i++) {
+            const rrset *set = node->rrsets[i];
+            if ((set->type == qtype || LDNS_RR_TYPE_ANY == qtype) &&
+                (set->rr_class == qclass || LDNS_RR_CLASS_ANY == qclass)) {
+                for (size_t j = 0; j < ldns_rr_list_rr_count(set->rrs); j++) {
+                    ldns_rr *rr = ldns_rr_list_rr(set->rrs, j);
+                    if (flags&RRSET_CLONE) rr = ldns_rr_clone(rr);
+                    ldns_rr_list_push_rr(rrlist, rr);
+                }
+            }
+        }
+        return;
+    }
+
     for (uint16_t i = 0; i < ldns_zone_rr_count(zone); i++) {
         ldns_rr *rr = ldns_rr_list_rr(ldns_zone_rrs(zone), i);
         if (ldns_dname_compare(ldns_rr_owner(rr), owner_name) == 0 &&
@@ -104,7 +131,7 @@ get_rrset_into(const ldns_zone *zone, const ldns_rdf *owner_name, const ldns_rr_
     }
 }
 
-static ldns_rr_list *
+ldns_rr_list *
 get_rrset(const ldns_zone *zone, const ldns_rdf *owner_name, const ldns_rr_type qtype, const ldns_rr_class qclass, int flags)
 {
     ldns_rr_list *rrlist = ldns_rr_list_new();
@@ -121,310 +148,83 @@ bool test_rrset(const ldns_zone *zone, const ldns_rr *rr, const ldns_rr_type qty
    return count>0;
 }
 
-void start_dns_server(struct in_addr my_address, int port) {
-
-    printf("Listening on port %d\n", port);
-    int udp_sock =  socket(AF_INET, SOCK_DGRAM, 0);
-    if (udp_sock < 0) {
-        fprintf(stderr, "socket(): %s\n", strerror(errno));
-        exit(1);
-    }
-
-    int tcp_sock =  socket(AF_INET, SOCK_STREAM, 0);
-    if (tcp_sock < 0) {
-        fprintf(stderr, "socket(): %s\n", strerror(errno));
-        exit(1);
-    }
-
-    if (setsockopt(tcp_sock, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) <0) {
-        fprintf(stderr, "setsockopt(SO_REUSEADDR): %s\n", strerror(errno));
-        exit(1);
-    }
-
-    if (bind_port(udp_sock, port, my_address.s_addr)) {
-        fprintf(stderr, "cannot bind(): %s\n", strerror(errno));
-        exit(errno);
-    }
-
-    if (bind_port(tcp_sock, port, my_address.s_addr)) {
-        fprintf(stderr, "cannot bind(): %s\n", strerror(errno));
-        exit(errno);
-    }
-
-    if (listen(tcp_sock, 5) < 0) {
-        fprintf(stderr, "listen(): %s\n", strerror(errno));
-        exit(1);
-    }
-
-    /* Done. Now receive */
-    pthread_t tcp_thread;
-    pthread_create(&tcp_thread, NULL, listen_tcp, &tcp_sock);
-
-    while (1) {
-        uint8_t inbuf[INBUF_SIZE];
-
-        struct sockaddr addr_him;
-        socklen_t hislen = (socklen_t) sizeof(addr_him);
-
-        ssize_t nb = recvfrom(udp_sock, (void*)inbuf, INBUF_SIZE, 0, &addr_him, &hislen);
-		
-        if (nb < 1) {
-            fprintf(stderr, "recvfrom(): %s\n", strerror(errno));
-            exit(1);
-        }
-        
-        uint8_t *outbuf=NULL;
-        size_t answer_size;
-        handle_dns_wire(inbuf,nb,&outbuf,&answer_size,0);
-
-        if (outbuf) {
-            (void) sendto(udp_sock, (void*)outbuf, answer_size, 0, &addr_him, hislen);
-            LDNS_FREE(outbuf);        
-        }
-        
-    }
-
+ldns_zone* zone_find(ldns_rdf* name, ldns_rr_class zclass) {
+    return zone_table_find(name, zclass);
 }
 
-
-static void* listen_tcp(void* psock) {
-    int sock = *(int*)psock;
-    while (1) {
-        int fd = accept(sock, NULL,NULL);
-        if (fd < 0) {
-            fprintf(stderr, "accept(): %s\n", strerror(errno));
-            exit(1);
-        }
-
-        size_t nb; 
-        struct timeval timeout = {1};
-        uint8_t *inbuf = ldns_tcp_read_wire_timeout(fd, &nb, timeout);
-        uint8_t *outbuf=NULL;
-        size_t answer_size;
-        handle_dns_wire(inbuf,nb,&outbuf,&answer_size,fd);
-
-        if (outbuf) {
-            uint16_t size = htons(answer_size);
-            struct iovec iov[2] = {{&size,2}, {outbuf, answer_size}};
-            writev(fd, iov, 2);
-            LDNS_FREE(outbuf);        
-        }
-          
-        LDNS_FREE(inbuf);
-    }
+static void zone_release(ldns_zone* zone) {
+    rrset_index_free(zone_index_put(zone, NULL));
+    ldns_zone_deep_free(zone);
 }
 
-void handle_dns_wire(void* inbuf,ssize_t nb,uint8_t** outbuf, size_t *answer_size, int sock) {
-        printf("Got query of %u bytes\n", (unsigned int) nb);
-
-        ldns_status status;
-        ldns_pkt *query_pkt;
-        ldns_pkt *answer_pkt;
-
-        *outbuf = NULL;
-
-        status = ldns_wire2pkt(&query_pkt, inbuf, (size_t) nb);
-        if (status != LDNS_STATUS_OK) {
-            printf("Got bad packet: %s\n", ldns_get_errorstr_by_id(status));            
-            return;
-        } 
-	ldns_pkt_print(stdout, query_pkt);
-        
-
-        if (ldns_pkt_qr(query_pkt)) {
-            printf("Received DNS response\n");
-            ldns_pkt_free(query_pkt);
-            return;
-        }
-        
-        answer_pkt = ldns_pkt_new();
-
-        ldns_pkt_set_opcode(answer_pkt, ldns_pkt_get_opcode(query_pkt));
-        ldns_pkt_set_id(answer_pkt, ldns_pkt_id(query_pkt));
-        ldns_pkt_set_qr(answer_pkt, 1);
-
-        if (ldns_pkt_edns(query_pkt)) {
-          ldns_pkt_set_edns_udp_size(answer_pkt, 4096);
-          if (ldns_pkt_edns_version(query_pkt)>0) {
-            ldns_pkt_set_edns_extended_rcode(answer_pkt, 1);
-          }
-          //ldns_edns_option_list *edns_opts = ldns_edns_option_list_new();
-          //ldns_edns_option *nsid = ldns_edns_new_from_data(LDNS_EDNS_NSID,2,"\x10");
-          //ldns_edns_option_list_push(edns_opts, nsid);
-          //ldns_pkt_set_edns_option_list(answer_pkt,edns_opts);
-        }            
-        
-        if (!ldns_pkt_get_rcode(answer_pkt) && !ldns_pkt_edns_extended_rcode(answer_pkt)) {
-          ldns_pkt_set_rcode(answer_pkt, LDNS_RCODE_NOTIMPL);
-          handle_dns_pkt(query_pkt, answer_pkt, sock);
-        }
-        
-        ldns_pkt_free(query_pkt);
-        if (ldns_pkt_get_rcode(answer_pkt)==LDNS_RCODE_ALREADY_HANDLED) {
-           ldns_pkt_free(answer_pkt);
-            return;
-        } 
-        status = ldns_pkt2wire(outbuf, answer_pkt, answer_size);
-        
-        if (status != LDNS_STATUS_OK) {
-            printf("Error creating answer: %s\n", ldns_get_errorstr_by_id(status));
-            LDNS_FREE(outbuf);        
-        } else {
-            ldns_pkt_print(stdout, answer_pkt);            
-        }
-        ldns_pkt_free(answer_pkt);
-
+static void zone_free(void* zone) {
+    // a transfer still streaming the zone releases it when it is done
+    if (!zone_snapshot_retire(zone, zone_release)) zone_release(zone);
 }
 
-
-static ldns_zone **zones;
-
-ldns_zone* zone_find(ldns_rdf* name, ldns_rr_class zclass) {
-    for (ldns_zone** z = zones; *z; ++z) {
-        ldns_rr *soa = ldns_zone_soa(*z);
-        if (ldns_rr_get_class(soa)==zclass && !ldns_dname_compare(ldns_rr_owner(soa), name)) return *z;
-    } 
-    name = ldns_dname_left_chop(name);
-    if (name) {
-      ldns_zone* zone=zone_find(name, zclass);
-      ldns_rdf_deep_free(name);
-      return zone;
-    } else {
-      return NULL;
-    }
+void zone_add(ldns_zone* zone) {
+    if (!zone_index(zone)) zone_index_put(zone, rrset_index_new(zone));
+    zone_table_insert(zone);
+    response_cache_invalidate_all();
 }
 
-void zone_add(ldns_zone* zone) {
-    size_t count = 0;
-    for (ldns_zone** z = zones; *z; ++z) count++; 
-    zones = LDNS_XREALLOC(zones, ldns_zone*, count+2);
-    zones[count]=zone;
-    zones[count+1]=NULL;
+void zone_replace(ldns_zone* old_zone, ldns_zone* zone) {
+    if (!zone_index(zone)) zone_index_put(zone, rrset_index_new(zone));
+    zone_table_replace(old_zone, zone);
+    response_cache_invalidate_zone(old_zone);
+    axfr_cache_invalidate(old_zone);
+    rcu_retire(zone_free, old_zone);
 }
 
 void zone_del(ldns_zone* zone) {
-    size_t count = 0;
-    for (ldns_zone** z = zones; *z; ++z) count++; 
-    for (ldns_zone** z = zones; *z; ++z) {
-      if (*z==zone) {
-        ldns_zone_deep_free(zone);
-        zones[count-1]=NULL;
-        return;
-      }
-    }
+    zone_table_remove(zone);
+    response_cache_invalidate_all();
+    axfr_cache_invalidate(zone);
+    journal_drop(zone);
+    rcu_retire(zone_free, zone);
 }
 
 bool del_rr_data(ldns_zone* zone, ldns_rr* rr) {
-   ldns_rr_list* rrs = ldns_zone_rrs(zone);
-   size_t count = ldns_rr_list_rr_count(rrs);
-   for (size_t i=0;i<count;i++) {
-     if (ldns_rr_compare(rr, ldns_rr_list_rr(rrs,i))==0) {
-       fprintf(stderr, "Delete RR\n");
-       ldns_rr_list_set_rr(rrs,ldns_rr_list_rr(rrs,count-1),i);
-       ldns_rr_list_set_rr_count(rrs,count-1);
-       ldns_rr_free(rr);
-       return true;
-     }
-   }
-   return false;
+   ldns_rr *zrr = rrset_index_remove(zone_index(zone), rr);
+   if (!zrr) return false;
+   fprintf(stderr, "Delete RR\n");
+   if (update_diff) journal_diff_record(update_diff, zrr, false); else ldns_rr_free(zrr);
+   return true;
 }
 
 bool del_rr(ldns_zone* zone, ldns_rdf* name, ldns_rr_type type) {
-   bool result = false;
-   ldns_rr_list* rrs = ldns_zone_rrs(zone);
-   size_t count = ldns_rr_list_rr_count(rrs);
-   for (size_t i=0;i<count;i++) {
-     ldns_rr *rr = ldns_rr_list_rr(rrs,i);
-     if ((type==LDNS_RR_TYPE_ANY || ldns_rr_get_type(rr)==type) && (ldns_dname_compare(name, ldns_rr_owner(rr))==0)) {
-       fprintf(stderr, "Delete RR\n");
-       ldns_rr_list_set_rr(rrs,ldns_rr_list_rr(rrs,--count),i--);
-       ldns_rr_list_set_rr_count(rrs,count);
-       ldns_rr_free(rr);
-       result = true;
-     }
+   ldns_rr_list *removed = rrset_index_remove_rrsets(zone_index(zone), name, type);
+   if (!removed) return false;
+   for (size_t i=0;i<ldns_rr_list_rr_count(removed);i++) {
+     ldns_rr *rr = ldns_rr_list_rr(removed,i);
+     fprintf(stderr, "Delete RR\n");
+     if (update_diff) journal_diff_record(update_diff, rr, false); else ldns_rr_free(rr);
    }
-   return result;
-}
-
-void add_rr_list(ldns_zone* zone, ldns_rr_list *push_list) {
-   ldns_rr_list* rrs = ldns_zone_rrs(zone);
-   ldns_rr_list_push_rr_list(rrs, push_list);
+   ldns_rr_list_free(removed);
+   return true;
 }
 
 void add_rr(ldns_zone* zone, ldns_rr *rr) {
-   ldns_rr_list* rrs = ldns_zone_rrs(zone);
-   ldns_rr_list_push_rr(rrs, rr);
+   rrset_index_add(zone_index(zone), rr);
+   if (update_diff) journal_diff_record(update_diff, ldns_rr_clone(rr), true);
 }
 
-void handle_dns_pkt(const ldns_pkt* query_pkt, ldns_pkt* answer_pkt, int sock) {
-  if (ldns_pkt_get_opcode(query_pkt)==LDNS_PACKET_QUERY) {
-    pthread_mutex_lock(&mutex);
-    handle_dns_query(query_pkt, answer_pkt, sock);
-    pthread_mutex_unlock(&mutex);
-  } else if (ldns_pkt_get_opcode(query_pkt)==LDNS_PACKET_UPDATE) {
-    pthread_mutex_lock(&update_mutex);
-    ldns_pkt_rcode rcode = handle_dns_update(query_pkt, answer_pkt);
-    ldns_pkt_set_rcode(answer_pkt, rcode);
-    pthread_mutex_unlock(&update_mutex);
-  }
+void add_rr_list(ldns_zone* zone, ldns_rr_list *push_list) {
+   for (size_t i=0;i<ldns_rr_list_rr_count(push_list);i++) {
+     add_rr(zone, ldns_rr_list_rr(push_list,i));
+   }
 }
 
-void handle_dns_query(const ldns_pkt* query_pkt, ldns_pkt* answer_pkt, int sock) {
-    ldns_rr_list *answer_an;
-    ldns_rr_list *answer_ns;
-    ldns_rr_list *answer_ad;
-
-    size_t qdcount = ldns_pkt_qdcount(query_pkt);
-    if (qdcount!=1) {
-      ldns_pkt_set_rcode(answer_pkt, LDNS_RCODE_FORMERR);
-      return;
-    }
-    
-    ldns_rr *query_rr = ldns_rr_list_rr(ldns_pkt_question(query_pkt), 0);
-    ldns_pkt_push_rr(answer_pkt, LDNS_SECTION_QUESTION, ldns_rr_clone(query_rr));
-
-    ldns_zone *zone = zone_find(ldns_rr_owner(query_rr), ldns_rr_get_class(query_rr));
-    ldns_rr2canonical(query_rr);
-   
-    if (zone) {
-        ldns_pkt_set_aa(answer_pkt, 1);
-        if (ldns_rr_get_type(query_rr)==LDNS_RR_TYPE_AXFR) {
-            if (sock) {
-                handle_axfr_request(zone, answer_pkt, sock);
-                ldns_pkt_set_rcode(answer_pkt, LDNS_RCODE_ALREADY_HANDLED);
-             } else {
-                ldns_pkt_set_rcode(answer_pkt, LDNS_RCODE_SERVFAIL);
-             }
-             return;
-        }
-
-        answer_an = get_rrset(zone, ldns_rr_owner(query_rr), ldns_rr_get_type(query_rr), ldns_rr_get_class(query_rr), RRSET_CLONE|RRSET_FOLLOW_CNAME);
-        answer_ns = ldns_rr_list_new();
-        answer_ad = ldns_rr_list_new();
-
-        ldns_rr_list_push_rr(answer_ns, ldns_rr_clone(ldns_zone_soa(zone)));
-
-        ldns_pkt_push_rr_list(answer_pkt, LDNS_SECTION_ANSWER, answer_an);
-        ldns_pkt_push_rr_list(answer_pkt, LDNS_SECTION_AUTHORITY, answer_ns);
-        ldns_pkt_push_rr_list(answer_pkt, LDNS_SECTION_ADDITIONAL, answer_ad);
-                
-        ldns_rr_list_free(answer_an);
-        ldns_rr_list_free(answer_ns);
-        ldns_rr_list_free(answer_ad);
-
-        ldns_pkt_set_rcode(answer_pkt, LDNS_RCODE_NOERROR);
-    } else {
-       ldns_pkt_set_rcode(answer_pkt, LDNS_RCODE_NXDOMAIN);
-    }
-} 
-
+// A new version of the zone, which shares its RRsets with zone until they are changed
 ldns_zone* ldns_zone_clone(ldns_zone *zone) {
   if (!zone) return NULL;
+  rrset_index *index = zone_index(zone);
   ldns_rr *soa = ldns_rr_clone(ldns_zone_soa(zone));
   ldns_rr_list* rrs = ldns_rr_list_clone(ldns_zone_rrs(zone));
   zone=ldns_zone_new();
   ldns_zone_set_soa(zone, soa);
   ldns_zone_set_rrs(zone, rrs);
+  zone_index_put(zone, index ? rrset_index_copy(index) : rrset_index_new(zone));
   return zone;
 }
 
@@ -440,7 +240,6 @@ ldns_pkt_rcode handle_dns_update(const ldns_pkt* query_pkt, ldns_pkt* answer_pkt
       return LDNS_RCODE_FORMERR;
     }
 
-    pthread_mutex_lock(&mutex);
     ldns_zone *zone =  zone_find(ldns_rr_owner(zone_rr), ldns_rr_get_class(zone_rr));
     ldns_rdf* zname = ldns_rr_owner(zone_rr);
     ldns_rr_class zclass = ldns_rr_get_class(zone_rr);
@@ -537,7 +336,7 @@ ldns_pkt_rcode handle_dns_update(const ldns_pkt* query_pkt, ldns_pkt* answer_pkt
     // update
     ldns_zone *original_zone =  zone;
     zone = ldns_zone_clone(original_zone);
-    pthread_mutex_unlock(&mutex);
+    if (zone) update_diff = journal_diff_new();
 
     bool increment_serial = false;
     for (uint16_t i=0; i<ldns_update_upcount(query_pkt); i++) {
@@ -562,6 +361,7 @@ ldns_pkt_rcode handle_dns_update(const ldns_pkt* query_pkt, ldns_pkt* answer_pkt
                    fprintf(stderr, "Create zone\n");
                    zone = ldns_zone_new();
                    ldns_zone_set_soa(zone, ldns_rr_clone(rr));
+                   zone_index_put(zone, rrset_index_new(zone));
                  }
                  #endif
                } else {
@@ -607,8 +407,11 @@ ldns_pkt_rcode handle_dns_update(const ldns_pkt* query_pkt, ldns_pkt* answer_pkt
           } else if (ldns_rr_get_type(rr) == LDNS_RR_TYPE_SOA && ldns_dname_compare(ldns_rr_owner(rr),zname)==0) { 
               #ifdef CAN_DELETE_ZONE 
               fprintf(stderr, "Delete Zone\n");
-              ldns_zone_deep_free(zone);
+              journal_diff_free(update_diff);
+              update_diff = NULL;
+              zone_free(zone);
               zone_del(original_zone);
+              rcu_synchronize();
               return LDNS_RCODE_NOERROR;
               #endif
           } else if (ldns_rr_get_type(rr) == LDNS_RR_TYPE_NS && ldns_dname_compare(ldns_rr_owner(rr),zname)==0) { 
@@ -632,69 +435,69 @@ ldns_pkt_rcode handle_dns_update(const ldns_pkt* query_pkt, ldns_pkt* answer_pkt
       }
     }
 
-    pthread_mutex_lock(&mutex);
-    zone_del(original_zone);
-    zone_add(zone);
-    pthread_mutex_unlock(&mutex);
+    if (update_diff) {
+      journal_commit(original_zone, zone, update_diff);
+      update_diff = NULL;
+    }
+
+    if (original_zone) {
+      zone_replace(original_zone, zone);
+      zone_compiled_schedule(zone);
+    } else if (zone) {
+      zone_add(zone);
+    }
+    if (zone && increment_serial) notify_schedule(zone);
+    rcu_synchronize();
 
     return LDNS_RCODE_NOERROR;
 }
 
-bool send_axfr_message(ldns_pkt* pkt, ldns_rr *rr, int sock) {
-    ldns_pkt_push_rr(pkt, LDNS_SECTION_ANSWER, rr);
-
-    uint8_t *outbuf=NULL;
-    size_t answer_size;
-    ldns_status status = ldns_pkt2wire(&outbuf, pkt, &answer_size);
-     
-    ldns_rr_list_pop_rr(ldns_pkt_answer(pkt));
-    ldns_pkt_set_ancount(pkt,0);
-
-    if (status != LDNS_STATUS_OK) {
-        printf("Error creating answer: %s\n", ldns_get_errorstr_by_id(status));
-        LDNS_FREE(outbuf);
-        return false;
-    } else {
-        ldns_pkt_print(stdout, pkt);
+static void send_transfer(axfr_stream *stream, ldns_pkt* pkt, int sock) {
+    const uint8_t *data = stream->data;
+    size_t size = stream->size;
+    uint16_t length = ldns_read_uint16(data);
+
+    // the answer to the query is the first message of the transfer
+    query_log_answer(data + 2, length);
+
+    // the question of the first message is an uncompressed name
+    size_t pos = LDNS_HEADER_SIZE;
+    while (pos < length && data[2 + pos]) pos += data[2 + pos] + 1;
+    pos++;
+
+    ldns_rr_type qtype = ldns_rr_get_type(ldns_rr_list_rr(ldns_pkt_question(pkt), 0));
+    if (pos + 2 <= length && ldns_read_uint16(data + 2 + pos) != qtype) {
+        // a full transfer answering an IXFR query, whose question must be echoed
+        uint8_t *first = LDNS_XMALLOC(uint8_t, length);
+        memcpy(first, data + 2, length);
+        ldns_write_uint16(first + pos, qtype);
+        ldns_write_uint16(first, ldns_pkt_id(pkt));
+        tcp_send(sock, first, length);
+        LDNS_FREE(first);
+        data += 2 + length;
+        size -= 2 + length;
     }
-
-    if (outbuf) {
-        uint16_t size = htons(answer_size);
-        struct iovec iov[2] = {{&size,2}, {outbuf, answer_size}};
-        writev(sock, iov, 2);
-        LDNS_FREE(outbuf);
-    }
-
-    return true;
+    tcp_send_stream(sock, data, size, ldns_pkt_id(pkt));
 }
 
 void handle_axfr_request(ldns_zone* zone, ldns_pkt* pkt, int sock) {
-    zone = ldns_zone_clone(zone);
-    pthread_mutex_unlock(&mutex);
-
-    do {
-      ldns_pkt_set_rcode(pkt, LDNS_RCODE_NOERROR);
-      if (!send_axfr_message(pkt,ldns_zone_soa(zone),sock)) break;
-
-      ldns_rr *rr;
-      while (rr = ldns_rr_list_pop_rr(ldns_pkt_additional(pkt))) {
-        ldns_rr_free(rr);
-      }
-      ldns_pkt_set_arcount(pkt,0);
-
-      for (uint16_t i = 0; i < ldns_zone_rr_count(zone); i++) {
-        rr = ldns_rr_list_rr(ldns_zone_rrs(zone), i);
-        if (!send_axfr_message(pkt,rr,sock)) break;
-      }
-      if (!send_axfr_message(pkt,ldns_zone_soa(zone),sock)) break;
-    } while(0);
-    pthread_mutex_lock(&mutex);
+    uint64_t start = stats_now();
+    axfr_stream *stream = axfr_stream_get(zone, ldns_pkt_edns(pkt));
+    if (!stream) return;
+    send_transfer(stream, pkt, sock);
+    stats_transfer(false, stream->size, stats_now() - start);
+    axfr_stream_release(stream);
 }
 
-void main() {
-    zones = LDNS_CALLOC(ldns_zone*,1);
-    struct in_addr dns_address = {0};
-    int dns_port = 53;
-    start_dns_server(dns_address, dns_port);
+void handle_ixfr_request(ldns_zone* zone, uint32_t serial, ldns_pkt* pkt, int sock) {
+    uint64_t start = stats_now();
+    axfr_stream *stream = ixfr_stream_get(zone, serial, ldns_pkt_edns(pkt));
+    if (!stream) {
+        // the journal does not go back to the serial of the client
+        handle_axfr_request(zone, pkt, sock);
+        return;
+    }
+    send_transfer(stream, pkt, sock);
+    stats_transfer(true, stream->size, stats_now() - start);
+    axfr_stream_release(stream);
 }
-
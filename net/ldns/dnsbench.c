@@ -0,0 +1,748 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+/*
+ * Load generator for the DNS server, meant to be run against a server on
+ * loopback to compare builds.
+ *
+ * Queries are read from a text file (one "name type" per line), replayed
+ * from a binary query log (see query_log.h), or synthesized from the
+ * records of a zone file. Each thread sends them in turn over its own UDP
+ * socket or TCP connection, either open loop at --rate queries per second
+ * (shared among the threads), or as fast as possible with at most
+ * --window queries outstanding per thread.
+ *
+ * Optionally, dynamic updates (adding and removing a TXT record at
+ * _dnsbench.<zone>) and full zone transfers run alongside the queries,
+ * each on its own thread at a fixed rate.
+ *
+ * The results are printed to stdout as JSON: achieved rate, latency
+ * percentiles, timeouts and rcodes for queries and updates, and duration,
+ * size and failures for transfers.
+ *
+ * Use: dnsbench [--server=<addr>] [--port=<n>] [--tcp] [--threads=<n>]
+ *               [--rate=<qps>] [--window=<n>] [--duration=<sec>] [--timeout=<msec>]
+ *               [--queries=<file> | --replay=<qlog> | --zone=<file>]
+ *               [--update-zone=<apex> [--update-rate=<n>]]
+ *               [--axfr-zone=<apex> [--axfr-rate=<n>]]
+ */
+
+#define _GNU_SOURCE
+#include "query_log.h"
+#include <ldns/ldns.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+#define MAX_MESSAGE 65535
+#define SWEEP_NS 100000000ull
+
+typedef struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t buckets[HIST_BUCKETS];
+} histogram;
+
+typedef struct bench_result {
+    uint64_t sent;
+    uint64_t received;
+    uint64_t timeouts;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t messages;
+    uint64_t rcodes[16];
+    histogram latency;
+} bench_result;
+
+typedef struct query {
+    uint8_t *wire;
+    size_t size;
+} query;
+
+typedef struct bench_thread {
+    pthread_t thread;
+    int index;
+    int fd;
+    bool closed;
+    size_t outstanding;
+    uint64_t *sent_at;  // by message ID, 0 when not outstanding
+    size_t in_len;      // TCP only, bytes of incomplete answers
+    uint8_t in[2 * (MAX_MESSAGE + 2)];
+    bench_result result;
+} bench_thread;
+
+static struct sockaddr_in server = { .sin_family = AF_INET };
+static bool use_tcp;
+static int threads = 1;
+static double rate;
+static size_t window = 64;
+static double duration = 10;
+static uint64_t timeout_ns = 1000000000ull;
+static const char *update_zone;
+static double update_rate = 1;
+static const char *axfr_zone;
+static double axfr_rate = 1;
+
+static query *queries;
+static size_t query_count;
+static size_t query_capacity;
+
+static uint64_t start_ns;
+static uint64_t end_ns;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static size_t hist_index(uint64_t value) {
+    if (value < HIST_SUB) return value;
+    int msb = 63 - __builtin_clzll(value);
+    return (msb - HIST_SUB_BITS + 1) * HIST_SUB + ((value >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Largest value counted in a bucket */
+static uint64_t hist_upper(size_t index) {
+    size_t exponent = index / HIST_SUB;
+    if (!exponent) return index;
+    int shift = exponent - 1;
+    uint64_t lower = (uint64_t) (HIST_SUB + index % HIST_SUB) << shift;
+    return lower + ((uint64_t) 1 << shift) - 1;
+}
+
+static void hist_add(histogram *h, uint64_t value) {
+    h->count++;
+    h->sum += value;
+    h->buckets[hist_index(value)]++;
+}
+
+static uint64_t hist_quantile(const histogram *h, double q) {
+    if (!h->count) return 0;
+    uint64_t rank = q * h->count;
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) return hist_upper(i);
+    }
+    return hist_upper(HIST_BUCKETS - 1);
+}
+
+static void result_merge(bench_result *into, const bench_result *from) {
+    into->sent += from->sent;
+    into->received += from->received;
+    into->timeouts += from->timeouts;
+    into->errors += from->errors;
+    into->bytes += from->bytes;
+    into->messages += from->messages;
+    for (int i = 0; i < 16; i++) into->rcodes[i] += from->rcodes[i];
+    into->latency.count += from->latency.count;
+    into->latency.sum += from->latency.sum;
+    for (size_t i = 0; i < HIST_BUCKETS; i++) into->latency.buckets[i] += from->latency.buckets[i];
+}
+
+static void query_add(const uint8_t *wire, size_t size) {
+    if (query_count == query_capacity) {
+        query_capacity = query_capacity ? query_capacity * 2 : 1024;
+        queries = LDNS_XREALLOC(queries, query, query_capacity);
+    }
+    queries[query_count].wire = LDNS_XMALLOC(uint8_t, size);
+    memcpy(queries[query_count].wire, wire, size);
+    queries[query_count].size = size;
+    query_count++;
+}
+
+/* A query with ID 0 and RD clear, for a name in wire format */
+static void query_add_question(const uint8_t *name, size_t len, uint16_t type, uint16_t rr_class) {
+    uint8_t wire[LDNS_HEADER_SIZE + LDNS_MAX_DOMAINLEN + 5] = {0};
+    if (len > LDNS_MAX_DOMAINLEN + 1) return;
+    ldns_write_uint16(wire + 4, 1);
+    memcpy(wire + LDNS_HEADER_SIZE, name, len);
+    ldns_write_uint16(wire + LDNS_HEADER_SIZE + len, type);
+    ldns_write_uint16(wire + LDNS_HEADER_SIZE + len + 2, rr_class);
+    query_add(wire, LDNS_HEADER_SIZE + len + 4);
+}
+
+static bool load_query_file(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) return false;
+    char line[1024], name[1024], type[64];
+    while (fgets(line, sizeof line, fp)) {
+        if (line[0] == '#' || line[0] == ';') continue;
+        if (sscanf(line, "%1023s %63s", name, type) != 2) continue;
+        ldns_rdf *dname = ldns_dname_new_frm_str(name);
+        ldns_rr_type qtype = ldns_get_rr_type_by_name(type);
+        if (!dname || !qtype) {
+            fprintf(stderr, "Ignoring query %s %s\n", name, type);
+        } else {
+            query_add_question(ldns_rdf_data(dname), ldns_rdf_size(dname), qtype, LDNS_RR_CLASS_IN);
+        }
+        if (dname) ldns_rdf_deep_free(dname);
+    }
+    fclose(fp);
+    return true;
+}
+
+static bool load_replay(const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return false;
+    char magic[sizeof QLOG_MAGIC - 1];
+    if (fread(magic, 1, sizeof magic, fp) != sizeof magic || memcmp(magic, QLOG_MAGIC, sizeof magic)) {
+        fprintf(stderr, "Not a query log: %s\n", path);
+        fclose(fp);
+        return false;
+    }
+    query_log_record record;
+    uint8_t wire[QLOG_MAX_WIRE];
+    while (fread(&record, sizeof record, 1, fp) == 1) {
+        if (record.size > QLOG_MAX_WIRE || fread(wire, 1, record.size, fp) != record.size) break;
+        // truncated queries cannot be replayed
+        if (record.kind == QLOG_KIND_QUERY && record.size == record.length && record.size >= LDNS_HEADER_SIZE) {
+            query_add(wire, record.size);
+        }
+    }
+    fclose(fp);
+    return true;
+}
+
+/* A query for each record of the zone, with its owner and type */
+static bool load_zone(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) return false;
+    ldns_zone *zone;
+    ldns_status status = ldns_zone_new_frm_fp(&zone, fp, NULL, 3600, LDNS_RR_CLASS_IN);
+    fclose(fp);
+    if (status != LDNS_STATUS_OK) {
+        fprintf(stderr, "Cannot read zone %s: %s\n", path, ldns_get_errorstr_by_id(status));
+        return false;
+    }
+    ldns_rr *soa = ldns_zone_soa(zone);
+    if (soa) query_add_question(ldns_rdf_data(ldns_rr_owner(soa)), ldns_rdf_size(ldns_rr_owner(soa)), LDNS_RR_TYPE_SOA, ldns_rr_get_class(soa));
+    for (size_t i = 0; i < ldns_zone_rr_count(zone); i++) {
+        ldns_rr *rr = ldns_rr_list_rr(ldns_zone_rrs(zone), i);
+        ldns_rdf *owner = ldns_rr_owner(rr);
+        query_add_question(ldns_rdf_data(owner), ldns_rdf_size(owner), ldns_rr_get_type(rr), ldns_rr_get_class(rr));
+    }
+    ldns_zone_deep_free(zone);
+    return true;
+}
+
+static int bench_connect(bool tcp) {
+    int fd = socket(AF_INET, tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*) &server, sizeof server)) {
+        fprintf(stderr, "connect(): %s\n", strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    if (tcp) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+    return fd;
+}
+
+static bool send_all(int fd, const uint8_t *data, size_t size) {
+    while (size) {
+        ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool recv_all(int fd, uint8_t *data, size_t size) {
+    while (size) {
+        ssize_t n = recv(fd, data, size, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+/* Count the queries outstanding since before deadline as timed out */
+static void sweep(bench_thread *t, uint64_t deadline) {
+    for (size_t id = 0; id < 65536 && t->outstanding; id++) {
+        if (t->sent_at[id] && t->sent_at[id] < deadline) {
+            t->sent_at[id] = 0;
+            t->outstanding--;
+            t->result.timeouts++;
+        }
+    }
+}
+
+static void send_query(bench_thread *t, const query *q, uint16_t id, uint64_t now) {
+    uint8_t buf[MAX_MESSAGE + 2];
+    size_t offset = use_tcp ? 2 : 0;
+    if (use_tcp) ldns_write_uint16(buf, q->size);
+    memcpy(buf + offset, q->wire, q->size);
+    ldns_write_uint16(buf + offset, id);
+
+    // the ID is reused after 65536 queries, an answer still missing by then is not coming
+    if (t->sent_at[id]) {
+        t->sent_at[id] = 0;
+        t->outstanding--;
+        t->result.timeouts++;
+    }
+
+    bool ok = use_tcp ? send_all(t->fd, buf, q->size + 2) : send(t->fd, buf, q->size, 0) == (ssize_t) q->size;
+    if (!ok) {
+        t->result.errors++;
+        if (use_tcp) t->closed = true;
+        return;
+    }
+    t->sent_at[id] = now;
+    t->outstanding++;
+    t->result.sent++;
+    t->result.bytes += q->size;
+}
+
+static void handle_answer(bench_thread *t, const uint8_t *wire, size_t size, uint64_t now) {
+    if (size < LDNS_HEADER_SIZE) return;
+    uint16_t id = ldns_read_uint16(wire);
+    // late answers, already counted as timeouts
+    if (!t->sent_at[id]) return;
+
+    uint64_t latency = now - t->sent_at[id];
+    t->sent_at[id] = 0;
+    t->outstanding--;
+    if (latency > timeout_ns) {
+        t->result.timeouts++;
+        return;
+    }
+    t->result.received++;
+    t->result.rcodes[LDNS_RCODE_WIRE(wire)]++;
+    hist_add(&t->result.latency, latency);
+}
+
+static void read_answers(bench_thread *t) {
+    uint64_t now = now_ns();
+    if (!use_tcp) {
+        uint8_t buf[MAX_MESSAGE];
+        ssize_t n;
+        while ((n = recv(t->fd, buf, sizeof buf, MSG_DONTWAIT)) > 0) handle_answer(t, buf, n, now);
+        return;
+    }
+
+    ssize_t n = recv(t->fd, t->in + t->in_len, sizeof t->in - t->in_len, MSG_DONTWAIT);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+        fprintf(stderr, "Connection closed by the server\n");
+        t->closed = true;
+        return;
+    }
+    if (n < 0) return;
+    t->in_len += n;
+
+    size_t pos = 0;
+    while (t->in_len - pos >= 2) {
+        size_t size = ldns_read_uint16(t->in + pos);
+        if (t->in_len - pos - 2 < size) break;
+        handle_answer(t, t->in + pos + 2, size, now);
+        pos += 2 + size;
+    }
+    memmove(t->in, t->in + pos, t->in_len - pos);
+    t->in_len -= pos;
+}
+
+static void *run_queries(void *arg) {
+    bench_thread *t = arg;
+    t->fd = bench_connect(use_tcp);
+    if (t->fd < 0) {
+        t->result.errors++;
+        return NULL;
+    }
+    t->sent_at = LDNS_CALLOC(uint64_t, 65536);
+
+    // the threads share the rate, and start at different points of the query list
+    uint64_t interval = rate > 0 ? 1e9 * threads / rate : 0;
+    uint64_t next = start_ns + interval * t->index / threads;
+    uint64_t last_sweep = start_ns;
+    size_t qi = query_count * t->index / threads;
+    uint16_t id = 0;
+    int burst = 0;
+
+    while (!t->closed) {
+        uint64_t now = now_ns();
+        if (now >= end_ns) break;
+
+        bool due = interval ? now >= next : t->outstanding < window;
+        if (due) {
+            send_query(t, &queries[qi], id++, now);
+            qi = (qi + 1) % query_count;
+            next += interval;
+            // behind schedule the queries keep going out, reading answers in between
+            if (++burst < 64) continue;
+        }
+        burst = 0;
+
+        uint64_t wait = due ? 0 : interval ? next - now : 1000000;
+        if (wait > 1000000) wait = 1000000;
+        struct pollfd pfd = { t->fd, POLLIN };
+        struct timespec ts = { 0, wait };
+        if (ppoll(&pfd, 1, &ts, NULL) > 0) read_answers(t);
+
+        if (now - last_sweep > SWEEP_NS) {
+            sweep(t, now - timeout_ns);
+            last_sweep = now;
+        }
+    }
+
+    // wait for the answers still in flight
+    uint64_t deadline = now_ns() + timeout_ns;
+    while (t->outstanding && !t->closed && now_ns() < deadline) {
+        struct pollfd pfd = { t->fd, POLLIN };
+        if (poll(&pfd, 1, 1) > 0) read_answers(t);
+    }
+    sweep(t, UINT64_MAX);
+
+    close(t->fd);
+    LDNS_FREE(t->sent_at);
+    return NULL;
+}
+
+/* Sleep until the next event of a thread running at a fixed rate */
+static bool pace(uint64_t *next, double per_second) {
+    *next += 1e9 / per_second;
+    uint64_t now = now_ns();
+    if (*next >= end_ns) return false;
+    if (*next > now) {
+        uint64_t wait = *next - now;
+        struct timespec ts = { wait / 1000000000ull, wait % 1000000000ull };
+        nanosleep(&ts, NULL);
+    }
+    return true;
+}
+
+/* Alternately add and remove a TXT record at _dnsbench.<zone>, over UDP */
+static void *run_updates(void *arg) {
+    bench_result *result = arg;
+    int fd = bench_connect(false);
+    if (fd < 0) {
+        result->errors++;
+        return NULL;
+    }
+    struct timeval tv = { timeout_ns / 1000000000ull, timeout_ns % 1000000000ull / 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+
+    char text[LDNS_MAX_DOMAINLEN + 64];
+    uint64_t next = start_ns;
+    for (uint64_t k = 0; ; k++) {
+        snprintf(text, sizeof text, "_dnsbench.%s 300 IN TXT \"%llu\"", update_zone, (unsigned long long) (k / 2));
+        ldns_rr *rr;
+        if (ldns_rr_new_frm_str(&rr, text, 300, NULL, NULL) != LDNS_STATUS_OK) {
+            fprintf(stderr, "Invalid --update-zone %s\n", update_zone);
+            break;
+        }
+        if (k % 2) {
+            // delete an RR from an RRset
+            ldns_rr_set_class(rr, LDNS_RR_CLASS_NONE);
+            ldns_rr_set_ttl(rr, 0);
+        }
+        ldns_rr_list *updates = ldns_rr_list_new();
+        ldns_rr_list_push_rr(updates, rr);
+        ldns_pkt *pkt = ldns_update_pkt_new(ldns_dname_new_frm_str(update_zone), LDNS_RR_CLASS_IN, NULL, updates, NULL);
+        ldns_rr_list_free(updates);
+        ldns_pkt_set_id(pkt, k);
+
+        uint8_t *wire;
+        size_t size;
+        ldns_status status = ldns_pkt2wire(&wire, pkt, &size);
+        ldns_pkt_free(pkt);
+        if (status != LDNS_STATUS_OK) {
+            result->errors++;
+            break;
+        }
+
+        uint64_t sent = now_ns();
+        if (send(fd, wire, size, 0) != (ssize_t) size) {
+            result->errors++;
+        } else {
+            result->sent++;
+            result->bytes += size;
+            uint8_t answer[MAX_MESSAGE];
+            ssize_t n;
+            // skip answers to earlier updates that timed out
+            while ((n = recv(fd, answer, sizeof answer, 0)) >= LDNS_HEADER_SIZE && ldns_read_uint16(answer) != (uint16_t) k);
+            if (n < LDNS_HEADER_SIZE) {
+                result->timeouts++;
+            } else {
+                result->received++;
+                result->rcodes[LDNS_RCODE_WIRE(answer)]++;
+                hist_add(&result->latency, now_ns() - sent);
+            }
+        }
+        LDNS_FREE(wire);
+
+        if (!pace(&next, update_rate)) break;
+    }
+    close(fd);
+    return NULL;
+}
+
+/* One full transfer on a new connection, true if it completed */
+static bool transfer(bench_result *result, const ldns_rdf *apex) {
+    int fd = bench_connect(true);
+    if (fd < 0) return false;
+    struct timeval tv = { timeout_ns / 1000000000ull, timeout_ns % 1000000000ull / 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+
+    uint8_t request[2 + LDNS_HEADER_SIZE + LDNS_MAX_DOMAINLEN + 5] = {0};
+    size_t len = ldns_rdf_size(apex);
+    size_t size = LDNS_HEADER_SIZE + len + 4;
+    ldns_write_uint16(request, size);
+    ldns_write_uint16(request + 2, 0xaf12);
+    ldns_write_uint16(request + 2 + 4, 1);
+    memcpy(request + 2 + LDNS_HEADER_SIZE, ldns_rdf_data(apex), len);
+    ldns_write_uint16(request + 2 + LDNS_HEADER_SIZE + len, LDNS_RR_TYPE_AXFR);
+    ldns_write_uint16(request + 2 + LDNS_HEADER_SIZE + len + 2, LDNS_RR_CLASS_IN);
+
+    bool done = false;
+    int soa_count = 0;
+    uint8_t *message = LDNS_XMALLOC(uint8_t, MAX_MESSAGE);
+    if (send_all(fd, request, size + 2)) {
+        uint8_t prefix[2];
+        while (!done && recv_all(fd, prefix, 2)) {
+            size_t length = ldns_read_uint16(prefix);
+            if (!recv_all(fd, message, length)) break;
+            result->bytes += length + 2;
+            result->messages++;
+
+            ldns_pkt *pkt;
+            if (ldns_wire2pkt(&pkt, message, length) != LDNS_STATUS_OK) break;
+            if (soa_count == 0) result->rcodes[ldns_pkt_get_rcode(pkt) & 15]++;
+            bool failed = ldns_pkt_get_rcode(pkt) != LDNS_RCODE_NOERROR;
+            // the transfer ends with the second SOA
+            for (size_t i = 0; i < ldns_pkt_ancount(pkt); i++) {
+                if (ldns_rr_get_type(ldns_rr_list_rr(ldns_pkt_answer(pkt), i)) == LDNS_RR_TYPE_SOA) soa_count++;
+            }
+            ldns_pkt_free(pkt);
+            if (failed) break;
+            done = soa_count >= 2;
+        }
+    }
+    LDNS_FREE(message);
+    close(fd);
+    return done;
+}
+
+static void *run_transfers(void *arg) {
+    bench_result *result = arg;
+    ldns_rdf *apex = ldns_dname_new_frm_str(axfr_zone);
+    if (!apex) {
+        fprintf(stderr, "Invalid --axfr-zone %s\n", axfr_zone);
+        return NULL;
+    }
+    uint64_t next = start_ns;
+    do {
+        uint64_t start = now_ns();
+        result->sent++;
+        if (transfer(result, apex)) {
+            result->received++;
+            hist_add(&result->latency, now_ns() - start);
+        } else {
+            result->errors++;
+        }
+    } while (pace(&next, axfr_rate));
+    ldns_rdf_deep_free(apex);
+    return NULL;
+}
+
+static void print_latency(const char *name, const histogram *h, double unit) {
+    printf("\"%s\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f, \"mean\": %.1f}",
+        name, hist_quantile(h, 0.5) / unit, hist_quantile(h, 0.9) / unit, hist_quantile(h, 0.99) / unit,
+        hist_quantile(h, 0.999) / unit, hist_quantile(h, 1) / unit, h->count ? h->sum / unit / h->count : 0);
+}
+
+static void print_rcodes(const bench_result *result) {
+    printf("\"rcodes\": {");
+    const char *sep = "";
+    for (int i = 0; i < 16; i++) {
+        if (!result->rcodes[i]) continue;
+        char *name = ldns_pkt_rcode2str(i);
+        printf("%s\"%s\": %llu", sep, name, (unsigned long long) result->rcodes[i]);
+        LDNS_FREE(name);
+        sep = ", ";
+    }
+    printf("}");
+}
+
+static void print_result(const char *name, const bench_result *result, double seconds, bool transfers) {
+    printf(",\n  \"%s\": {\"sent\": %llu, \"completed\": %llu, \"timeouts\": %llu, \"errors\": %llu, \"rate\": %.1f, \"bytes\": %llu, ",
+        name, (unsigned long long) result->sent, (unsigned long long) result->received,
+        (unsigned long long) result->timeouts, (unsigned long long) result->errors,
+        result->received / seconds, (unsigned long long) result->bytes);
+    if (transfers) {
+        printf("\"messages\": %llu, ", (unsigned long long) result->messages);
+        print_latency("duration_ms", &result->latency, 1e6);
+    } else {
+        print_latency("latency_us", &result->latency, 1e3);
+    }
+    printf(", ");
+    print_rcodes(result);
+    printf("}");
+}
+
+static void print_help(char *argv[]) {
+    fprintf(stderr, "Use: %s [--server=<addr>] [--port=<n>] [--tcp] [--threads=<n>]", argv[0]);
+    fprintf(stderr, " [--rate=<qps>] [--window=<n>] [--duration=<sec>] [--timeout=<msec>]");
+    fprintf(stderr, " [--queries=<file> | --replay=<qlog> | --zone=<file>]");
+    fprintf(stderr, " [--update-zone=<apex> [--update-rate=<n>]]");
+    fprintf(stderr, " [--axfr-zone=<apex> [--axfr-rate=<n>]]\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    const char *query_file = NULL, *replay_file = NULL, *zone_file = NULL;
+    server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    server.sin_port = htons(53);
+
+    struct option longopts[] = {
+        { "help", false, NULL, 'h' },
+        { "server", true, NULL, 1 },
+        { "port", true, NULL, 2 },
+        { "tcp", false, NULL, 3 },
+        { "threads", true, NULL, 4 },
+        { "rate", true, NULL, 5 },
+        { "window", true, NULL, 6 },
+        { "duration", true, NULL, 7 },
+        { "timeout", true, NULL, 8 },
+        { "queries", true, NULL, 9 },
+        { "replay", true, NULL, 10 },
+        { "zone", true, NULL, 11 },
+        { "update-zone", true, NULL, 12 },
+        { "update-rate", true, NULL, 13 },
+        { "axfr-zone", true, NULL, 14 },
+        { "axfr-rate", true, NULL, 15 },
+        { 0, 0, 0, 0}};
+
+    while (true) {
+        int longindex = 0;
+        const int opt = getopt_long(argc, argv, "h", longopts, &longindex);
+        if (opt == -1) break;
+        switch (opt) {
+        case 1:
+            if (inet_pton(AF_INET, optarg, &server.sin_addr) != 1) {
+                fprintf(stderr, "Invalid --server %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 2:
+            server.sin_port = htons(atoi(optarg));
+            break;
+        case 3:
+            use_tcp = true;
+            break;
+        case 4:
+            threads = atoi(optarg);
+            break;
+        case 5:
+            rate = atof(optarg);
+            break;
+        case 6:
+            window = atoi(optarg);
+            break;
+        case 7:
+            duration = atof(optarg);
+            break;
+        case 8:
+            timeout_ns = atoi(optarg) * 1000000ull;
+            break;
+        case 9:
+            query_file = optarg;
+            break;
+        case 10:
+            replay_file = optarg;
+            break;
+        case 11:
+            zone_file = optarg;
+            break;
+        case 12:
+            update_zone = optarg;
+            break;
+        case 13:
+            update_rate = atof(optarg);
+            break;
+        case 14:
+            axfr_zone = optarg;
+            break;
+        case 15:
+            axfr_rate = atof(optarg);
+            break;
+        default:
+            print_help(argv);
+        }
+    }
+
+    if (threads < 1 || window < 1 || window > 65535 || duration <= 0 || rate < 0
+        || update_rate <= 0 || axfr_rate <= 0 || !timeout_ns) {
+        print_help(argv);
+    }
+    if ((query_file != NULL) + (replay_file != NULL) + (zone_file != NULL) > 1) print_help(argv);
+
+    const char *source = query_file ? query_file : replay_file ? replay_file : zone_file;
+    bool loaded = !source
+        || (query_file && load_query_file(query_file))
+        || (replay_file && load_replay(replay_file))
+        || (zone_file && load_zone(zone_file));
+    if (!loaded) {
+        fprintf(stderr, "Cannot read %s\n", source);
+        exit(1);
+    }
+    if (source && !query_count) {
+        fprintf(stderr, "No queries in %s\n", source);
+        exit(1);
+    }
+    if (!query_count && !update_zone && !axfr_zone) print_help(argv);
+
+    bench_thread *workers = query_count ? LDNS_CALLOC(bench_thread, threads) : NULL;
+    bench_result update_result = {0}, axfr_result = {0};
+    pthread_t update_thread, axfr_thread;
+
+    start_ns = now_ns();
+    end_ns = start_ns + duration * 1e9;
+    for (int i = 0; workers && i < threads; i++) {
+        workers[i].index = i;
+        pthread_create(&workers[i].thread, NULL, run_queries, &workers[i]);
+    }
+    if (update_zone) pthread_create(&update_thread, NULL, run_updates, &update_result);
+    if (axfr_zone) pthread_create(&axfr_thread, NULL, run_transfers, &axfr_result);
+
+    bench_result query_result = {0};
+    for (int i = 0; workers && i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        result_merge(&query_result, &workers[i].result);
+    }
+    if (update_zone) pthread_join(update_thread, NULL);
+    if (axfr_zone) pthread_join(axfr_thread, NULL);
+
+    char address[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &server.sin_addr, address, sizeof address);
+    printf("{\n  \"server\": \"%s\", \"port\": %d, \"transport\": \"%s\", \"threads\": %d, ",
+        address, ntohs(server.sin_port), use_tcp ? "tcp" : "udp", threads);
+    printf("\"target_rate\": %.1f, \"window\": %zu, \"duration\": %.1f, \"source\": \"%s\", \"query_count\": %zu",
+        rate, window, duration, source ? source : "", query_count);
+    if (workers) print_result("queries", &query_result, duration, false);
+    if (update_zone) print_result("updates", &update_result, duration, false);
+    if (axfr_zone) print_result("axfr", &axfr_result, duration, true);
+    printf("\n}\n");
+
+    LDNS_FREE(workers);
+    return query_result.errors || update_result.errors ? 2 : 0;
+}
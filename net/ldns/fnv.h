@@ -0,0 +1,46 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+#ifndef FNV_H
+#define FNV_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * FNV-1a. The 64-bit hash is used for the RRL buckets and the checksum of
+ * compiled zones, the 32-bit one for the hash tables of names and of the
+ * response cache. A hash starts at the offset basis and may be continued
+ * over several pieces; callers that compare names in any case fold each
+ * byte before fnv32_byte.
+ */
+
+#define FNV_OFFSET 14695981039346656037ull
+#define FNV_PRIME 1099511628211ull
+#define FNV32_OFFSET 2166136261u
+#define FNV32_PRIME 16777619u
+
+static inline uint64_t fnv_byte(uint64_t hash, uint8_t byte) {
+    return (hash ^ byte) * FNV_PRIME;
+}
+
+static inline uint64_t fnv(uint64_t hash, const uint8_t *data, size_t len) {
+    for (size_t i = 0; i < len; i++) hash = fnv_byte(hash, data[i]);
+    return hash;
+}
+
+static inline uint32_t fnv32_byte(uint32_t hash, uint8_t byte) {
+    return (hash ^ byte) * FNV32_PRIME;
+}
+
+static inline uint32_t fnv32(uint32_t hash, const uint8_t *data, size_t len) {
+    for (size_t i = 0; i < len; i++) hash = fnv32_byte(hash, data[i]);
+    return hash;
+}
+
+#endif
@@ -35,9 +35,16 @@ int lg2_push(git_repository *repo, git_oid* oid) {
 	git_push_options options;
 	git_remote_callbacks callbacks;
 	git_remote* remote = NULL;
-	char *refspec = "+refs/heads/master";
+	git_reference* head = NULL;
+	char buf[256];
+	char *refspec = buf;
 	const git_strarray refspecs = { &refspec, 1 };
 
+	// push the checked out branch, whatever its name
+	if (!check_lg2(git_repository_head(&head, repo), "Unable to resolve HEAD")) goto _0;
+	snprintf(buf, sizeof buf, "+%s", git_reference_name(head));
+	git_reference_free(head);
+
 	if (!check_lg2(git_remote_lookup(&remote, repo, "origin" ), "Unable to lookup remote")) goto _0;
 	
 	if (!check_lg2(git_remote_init_callbacks(&callbacks, GIT_REMOTE_CALLBACKS_VERSION), "Error initializing remote callbacks")) goto _1;
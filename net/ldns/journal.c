@@ -0,0 +1,247 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+#include "journal.h"
+#include "rrset_index.h"
+#include <pthread.h>
+
+#define JOURNAL_DEFAULT_LIMIT 10000
+
+typedef struct journal_event {
+    ldns_rr *rr;
+    size_t seq;
+    bool added;
+} journal_event;
+
+struct journal_diff {
+    // while recording: the removed and added RRs, in order
+    journal_event *events;
+    size_t count;
+    size_t capacity;
+
+    // once committed
+    ldns_rr *old_soa;
+    ldns_rr *new_soa;
+    ldns_rr_list *deleted;
+    ldns_rr_list *added;
+    struct journal_diff *next;
+};
+
+typedef struct journal {
+    ldns_rdf *apex;
+    ldns_rr_class rr_class;
+    journal_diff *first;
+    journal_diff *last;
+    size_t records;
+    struct journal *next;
+} journal;
+
+static pthread_mutex_t journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static journal *journals;
+static size_t journal_limit = JOURNAL_DEFAULT_LIMIT;
+
+static uint32_t soa_serial(const ldns_rr *soa) {
+    return ldns_rdf2native_int32(ldns_rr_rdf(soa, 2));
+}
+
+static size_t diff_records(const journal_diff *diff) {
+    return ldns_rr_list_rr_count(diff->deleted) + ldns_rr_list_rr_count(diff->added);
+}
+
+journal_diff *journal_diff_new(void) {
+    return LDNS_CALLOC(journal_diff, 1);
+}
+
+void journal_diff_record(journal_diff *diff, ldns_rr *rr, bool added) {
+    if (diff->count == diff->capacity) {
+        diff->capacity = diff->capacity ? diff->capacity * 2 : 16;
+        diff->events = LDNS_XREALLOC(diff->events, journal_event, diff->capacity);
+    }
+    diff->events[diff->count] = (journal_event) { rr, diff->count, added };
+    diff->count++;
+}
+
+void journal_diff_free(journal_diff *diff) {
+    if (!diff) return;
+    for (size_t i = 0; i < diff->count; i++) ldns_rr_free(diff->events[i].rr);
+    LDNS_FREE(diff->events);
+    if (diff->old_soa) ldns_rr_free(diff->old_soa);
+    if (diff->new_soa) ldns_rr_free(diff->new_soa);
+    if (diff->deleted) ldns_rr_list_deep_free(diff->deleted);
+    if (diff->added) ldns_rr_list_deep_free(diff->added);
+    LDNS_FREE(diff);
+}
+
+static int event_compare(const void *a, const void *b) {
+    const journal_event *x = a, *y = b;
+    int c = ldns_rr_compare(x->rr, y->rr);
+    if (c) return c;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/*
+ * Reduce a sequence of deletions and additions to its net effect. The
+ * events of each record alternate, so that the record is deleted if the
+ * first and last events are deletions, added if both are additions, and
+ * unchanged otherwise. Deletions keep the first RR, which was in the
+ * zone, and additions keep the last one.
+ *
+ * With owned set, the events own their RRs, which are either moved into
+ * the lists or freed; otherwise the kept RRs are cloned.
+ */
+static void condense(journal_event *events, size_t count, bool owned, ldns_rr_list *deleted, ldns_rr_list *added) {
+    qsort(events, count, sizeof(journal_event), event_compare);
+    for (size_t i = 0, j; i < count; i = j) {
+        for (j = i + 1; j < count && ldns_rr_compare(events[i].rr, events[j].rr) == 0; j++);
+
+        journal_event *keep = NULL;
+        if (events[i].added == events[j - 1].added) {
+            keep = events[i].added ? &events[j - 1] : &events[i];
+            ldns_rr *rr = owned ? keep->rr : ldns_rr_clone(keep->rr);
+            ldns_rr_list_push_rr(keep->added ? added : deleted, rr);
+        }
+        if (owned) {
+            for (size_t k = i; k < j; k++) {
+                if (&events[k] != keep) ldns_rr_free(events[k].rr);
+            }
+        }
+    }
+}
+
+static journal *journal_find(const ldns_rdf *apex, ldns_rr_class rr_class, journal ***link) {
+    for (journal **p = &journals; *p; p = &(*p)->next) {
+        if ((*p)->rr_class == rr_class && dname_equal((*p)->apex, apex)) {
+            if (link) *link = p;
+            return *p;
+        }
+    }
+    return NULL;
+}
+
+static void journal_clear(journal *j) {
+    while (j->first) {
+        journal_diff *diff = j->first;
+        j->first = diff->next;
+        journal_diff_free(diff);
+    }
+    j->last = NULL;
+    j->records = 0;
+}
+
+void journal_commit(const ldns_zone *old_zone, const ldns_zone *zone, journal_diff *diff) {
+    ldns_rr *old_soa = ldns_zone_soa(old_zone);
+    ldns_rr *new_soa = ldns_zone_soa(zone);
+    if (!old_soa || !new_soa) {
+        journal_diff_free(diff);
+        return;
+    }
+
+    // the events are moved into the condensed lists
+    diff->deleted = ldns_rr_list_new();
+    diff->added = ldns_rr_list_new();
+    condense(diff->events, diff->count, true, diff->deleted, diff->added);
+    LDNS_FREE(diff->events);
+    diff->events = NULL;
+    diff->count = 0;
+
+    bool changed = diff_records(diff) > 0;
+    pthread_mutex_lock(&journal_mutex);
+    journal *j = journal_find(ldns_rr_owner(new_soa), ldns_rr_get_class(new_soa), NULL);
+
+    if (soa_serial(old_soa) == soa_serial(new_soa)) {
+        // clients at this serial can no longer be brought up to date
+        if (changed && j) journal_clear(j);
+        pthread_mutex_unlock(&journal_mutex);
+        journal_diff_free(diff);
+        return;
+    }
+
+    if (!j) {
+        j = LDNS_CALLOC(journal, 1);
+        j->apex = ldns_rdf_clone(ldns_rr_owner(new_soa));
+        j->rr_class = ldns_rr_get_class(new_soa);
+        j->next = journals;
+        journals = j;
+    } else if (j->last && soa_serial(j->last->new_soa) != soa_serial(old_soa)) {
+        // the zone was replaced by other means, e.g. reloaded
+        journal_clear(j);
+    }
+
+    diff->old_soa = ldns_rr_clone(old_soa);
+    diff->new_soa = ldns_rr_clone(new_soa);
+    if (j->last) j->last->next = diff; else j->first = diff;
+    j->last = diff;
+    j->records += diff_records(diff);
+
+    while (j->first && j->records > journal_limit) {
+        journal_diff *oldest = j->first;
+        j->first = oldest->next;
+        if (!j->first) j->last = NULL;
+        j->records -= diff_records(oldest);
+        journal_diff_free(oldest);
+    }
+    pthread_mutex_unlock(&journal_mutex);
+}
+
+void journal_drop(const ldns_zone *zone) {
+    ldns_rr *soa = ldns_zone_soa(zone);
+    if (!soa) return;
+
+    pthread_mutex_lock(&journal_mutex);
+    journal **link;
+    journal *j = journal_find(ldns_rr_owner(soa), ldns_rr_get_class(soa), &link);
+    if (j) {
+        *link = j->next;
+        journal_clear(j);
+        ldns_rdf_deep_free(j->apex);
+        LDNS_FREE(j);
+    }
+    pthread_mutex_unlock(&journal_mutex);
+}
+
+bool journal_condense(const ldns_zone *zone, uint32_t serial, ldns_rr **old_soa, ldns_rr_list **deleted, ldns_rr_list **added) {
+    ldns_rr *soa = ldns_zone_soa(zone);
+    if (!soa) return false;
+
+    pthread_mutex_lock(&journal_mutex);
+    journal *j = journal_find(ldns_rr_owner(soa), ldns_rr_get_class(soa), NULL);
+    journal_diff *from = j ? j->first : NULL;
+    while (from && soa_serial(from->old_soa) != serial) from = from->next;
+    if (!from || soa_serial(j->last->new_soa) != soa_serial(soa)) {
+        pthread_mutex_unlock(&journal_mutex);
+        return false;
+    }
+
+    size_t count = 0;
+    for (journal_diff *diff = from; diff; diff = diff->next) count += diff_records(diff);
+    journal_event *events = LDNS_XMALLOC(journal_event, count ? count : 1);
+
+    // within a diff, deletions come before additions
+    size_t n = 0, seq = 0;
+    for (journal_diff *diff = from; diff; diff = diff->next, seq += 2) {
+        for (size_t i = 0; i < ldns_rr_list_rr_count(diff->deleted); i++) {
+            events[n++] = (journal_event) { ldns_rr_list_rr(diff->deleted, i), seq, false };
+        }
+        for (size_t i = 0; i < ldns_rr_list_rr_count(diff->added); i++) {
+            events[n++] = (journal_event) { ldns_rr_list_rr(diff->added, i), seq + 1, true };
+        }
+    }
+
+    *old_soa = ldns_rr_clone(from->old_soa);
+    *deleted = ldns_rr_list_new();
+    *added = ldns_rr_list_new();
+    condense(events, n, false, *deleted, *added);
+    pthread_mutex_unlock(&journal_mutex);
+
+    LDNS_FREE(events);
+    return true;
+}
+
+void journal_set_limit(size_t records) {
+    journal_limit = records;
+}
@@ -0,0 +1,56 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <ldns/ldns.h>
+
+/*
+ * Journal of the changes made by dynamic updates, for IXFR (RFC 1995).
+ * Each update that changes the serial of a zone is recorded as a diff
+ * (old SOA, new SOA, deleted RRs, added RRs), and the journal of each zone
+ * keeps the most recent diffs, up to a limit of records. Older diffs are
+ * discarded, and the clients that are further behind get an AXFR instead.
+ *
+ * Diffs are recorded while the update is applied: journal_diff_record
+ * takes each RR removed from the zone, and a copy of each RR added to it.
+ * A record that is added and deleted within the same update cancels out.
+ *
+ * The journal is written with the update mutex held, and read by the
+ * transfer workers.
+ */
+
+typedef struct journal_diff journal_diff;
+
+journal_diff *journal_diff_new(void);
+void journal_diff_record(journal_diff *diff, ldns_rr *rr, bool added);
+void journal_diff_free(journal_diff *diff);
+
+/*
+ * Append the diff that turns old_zone into zone, taking ownership of it.
+ * A change that does not move the serial cannot be expressed as a diff,
+ * and clears the journal of the zone.
+ */
+void journal_commit(const ldns_zone *old_zone, const ldns_zone *zone, journal_diff *diff);
+void journal_drop(const ldns_zone *zone);
+
+/*
+ * Condense the diffs from the given serial up to the current version of
+ * the zone into a single diff. Returns false if the journal does not
+ * reach back to that serial, or does not end at the serial of zone.
+ * The results are copies, owned by the caller.
+ */
+bool journal_condense(const ldns_zone *zone, uint32_t serial, ldns_rr **old_soa, ldns_rr_list **deleted, ldns_rr_list **added);
+
+#define JOURNAL_MAX_LIMIT 10000000
+
+// maximum number of deleted and added records kept per zone, up to JOURNAL_MAX_LIMIT
+void journal_set_limit(size_t records);
+
+#endif
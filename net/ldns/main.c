@@ -28,34 +28,152 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE
 #include "dns_server.h"
+#include <sched.h>
+#include <poll.h>
+#include <time.h>
+#include <limits.h>
+#include <ctype.h>
+
+#include "zone_table.h"
+#include "rcu.h"
+#include "dns_fast.h"
+#include "query_log.h"
+#include "tcp_server.h"
+#include "journal.h"
+#include "zone_loader.h"
+#include "zone_compiled.h"
+#include "stats.h"
+#include "rrl.h"
+#include "notify.h"
+#include "arena.h"
+#include "uring.h"
+#include "trace.h"
 
 #ifdef MULTI_PRIMARY
 #include "git/common.h"
+#include "replicator.h"
 #endif
 
 #define INBUF_SIZE 4096
+#define OUTBUF_SIZE 4096
+#define MAX_UDP_THREADS 256
+#define MAX_UDP_BATCH 64
+#define MAX_UDP_BATCH_TIMEOUT 1000000  // us
+
+typedef struct udp_worker {
+    int sock;
+    int cpu;
+    pthread_t thread;
+
+    struct mmsghdr msgs[MAX_UDP_BATCH];
+    struct iovec iov[MAX_UDP_BATCH];
+    struct sockaddr_storage addr[MAX_UDP_BATCH];
+    uint8_t inbuf[MAX_UDP_BATCH][INBUF_SIZE];
+
+    struct mmsghdr out[MAX_UDP_BATCH];
+    struct iovec out_iov[MAX_UDP_BATCH];
+    uint8_t fastbuf[MAX_UDP_BATCH][OUTBUF_SIZE];
+} __attribute__((aligned(64))) udp_worker;
+
+// io_uring backend of a UDP worker
+#define URING_BUFFERS 256     // provided receive buffers, a power of two
+#define URING_SENDS 256       // answers being sent
+#define URING_RECV UINT64_MAX // user data of the multishot receive
+
+typedef struct uring_send {
+    struct msghdr msg;
+    struct iovec iov;
+    struct sockaddr_storage addr;
+    uint8_t buf[OUTBUF_SIZE];
+} uring_send;
+
+typedef struct uring_worker {
+    uring ring;
+    uring_buffers bufs;
+    struct msghdr recv_msg;   // only the lengths of the name and control data are used
+    int free_sends[URING_SENDS];
+    int nfree;
+    uring_send sends[URING_SENDS];
+} uring_worker;
 
 opts_struct opts={0};
-ldns_zone **zones;
 
 int udp_sock;
+static int udp_threads = 1;
+static int udp_first_cpu = -1;
+static int udp_batch = 32;
+static long udp_batch_timeout = 0;
+static const char *log_path;
+static int log_level = -1;
+static unsigned log_sample = 1;
+static int load_threads;
+static const char *compiled_dir;
+static bool compile_only;
+static bool use_io_uring;
+#ifdef QUERY_TRACE
+static int trace_slow;
+#endif
+static const char *stats_socket;
+static rrl_options rrl_opts = {
+    .slip = 2,
+    .size = 65536 };
+static unsigned notify_window = NOTIFY_WINDOW_DEFAULT;
+#ifdef MULTI_PRIMARY
+static int replica_delay = 500;
+static int replica_pull = 60;
+static const char *replica_journal;
+#endif
+static tcp_options tcp_opts = {
+    .timeout = 10,
+    .max_connections = 4096,
+    .xfr_threads = 2,
+    .xfr_per_client = 2,
+    .xfr_queue = 64 };
+static udp_worker *workers;
 
 static void start_dns_server(struct in_addr my_address, int port);
 static int bind_port(int sock, int port, in_addr_t maddr);
-static void* listen_udp(void* psock);
-static void* listen_tcp(void* psock);
+static void* listen_udp(void* pworker);
 
 static void print_help(char *argv[]) {
     fprintf(stderr,"Use: %s", argv[0]);
     #ifdef MULTI_PRIMARY
     fprintf(stderr," --repo=<url>");
-    fprintf(stderr," --branch=<name>\n");
+    fprintf(stderr," --branch=<name>");
+    fprintf(stderr," [--replica-delay=<msec>] [--replica-journal=<file>] [--replica-pull=<sec>]\n");
+    #endif
+    fprintf(stderr," [--threads=<n>] [--pin=<cpu>]");
+    fprintf(stderr," [--batch=<n>] [--batch-timeout=<usec>]");
+    fprintf(stderr," [--log=<file>] [--log-level=<0-3>] [--log-sample=<n>]");
+    fprintf(stderr," [--tcp-timeout=<sec>] [--tcp-max=<n>]");
+    fprintf(stderr," [--xfr-threads=<n>] [--xfr-per-client=<n>] [--xfr-queue=<n>]");
+    fprintf(stderr," [--ixfr-journal=<records>] [--load-threads=<n>]");
+    fprintf(stderr," [--compiled-dir=<dir> [--compile]] [--stats-socket=<path>]");
+    fprintf(stderr," [--rrl-rate=<n> [--rrl-nxdomain-rate=<n>] [--rrl-error-rate=<n>] [--rrl-slip=<n>] [--rrl-table=<n>]]");
+    fprintf(stderr," [--minimal-responses] [--udp-payload=<bytes>] [--notify-window=<msec>]");
+    fprintf(stderr," [--io-uring]");
+    #ifdef QUERY_TRACE
+    fprintf(stderr," [--trace-slow=<usec>]");
     #endif
     fprintf(stderr," --dir=<dir>\n");
     exit(1);
 }
 
+/* A decimal number from min to max, or exit */
+static unsigned long parse_unsigned(const char *arg, const char *name, unsigned long min, unsigned long max) {
+    char *end;
+    errno = 0;
+    // strtoul would also take blanks and a minus sign, and negate the result
+    unsigned long value = strtoul(arg, &end, 10);
+    if (!isdigit((unsigned char) *arg) || *end || errno || value < min || value > max) {
+        fprintf(stderr, "Invalid %s %s (%lu to %lu)\n", name, arg, min, max);
+        exit(1);
+    }
+    return value;
+}
+
 static void parse_opts(int argc, char *argv[], opts_struct *opts) {
     opts->branch = "master";
     opts->dir = "/etc/dns";
@@ -66,6 +184,42 @@ static void parse_opts(int argc, char *argv[], opts_struct *opts) {
         { "branch", true, NULL, 2 },
         { "dir", true, NULL, 3 },
         { "address", true, NULL, 4},
+        { "threads", true, NULL, 5},
+        { "pin", true, NULL, 6},
+        { "batch", true, NULL, 7},
+        { "batch-timeout", true, NULL, 8},
+        { "log", true, NULL, 9},
+        { "log-level", true, NULL, 10},
+        { "log-sample", true, NULL, 11},
+        { "tcp-timeout", true, NULL, 12},
+        { "tcp-max", true, NULL, 13},
+        { "xfr-threads", true, NULL, 14},
+        { "xfr-per-client", true, NULL, 15},
+        { "xfr-queue", true, NULL, 16},
+        { "ixfr-journal", true, NULL, 17},
+        #ifdef MULTI_PRIMARY
+        { "replica-delay", true, NULL, 18},
+        { "replica-journal", true, NULL, 19},
+        #endif
+        { "load-threads", true, NULL, 20},
+        { "compiled-dir", true, NULL, 21},
+        { "compile", false, NULL, 22},
+        { "stats-socket", true, NULL, 23},
+        { "rrl-rate", true, NULL, 24},
+        { "rrl-nxdomain-rate", true, NULL, 25},
+        { "rrl-error-rate", true, NULL, 26},
+        { "rrl-slip", true, NULL, 27},
+        { "rrl-table", true, NULL, 28},
+        { "minimal-responses", false, NULL, 29},
+        { "udp-payload", true, NULL, 30},
+        { "notify-window", true, NULL, 31},
+        #ifdef MULTI_PRIMARY
+        { "replica-pull", true, NULL, 32},
+        #endif
+        { "io-uring", false, NULL, 33},
+        #ifdef QUERY_TRACE
+        { "trace-slow", true, NULL, 34},
+        #endif
         { 0, 0, 0, 0}};
 
     while (true) {
@@ -92,7 +246,105 @@ static void parse_opts(int argc, char *argv[], opts_struct *opts) {
                exit(1);
             }
             opts->address=addr.s_addr;
+            break;
           }
+        case 5:
+            udp_threads = parse_unsigned(optarg, "--threads", 1, MAX_UDP_THREADS);
+            break;
+        case 6:
+            udp_first_cpu = parse_unsigned(optarg, "--pin", 0, CPU_SETSIZE - 1);
+            break;
+        case 7:
+            udp_batch = parse_unsigned(optarg, "--batch", 1, MAX_UDP_BATCH);
+            break;
+        case 8:
+            udp_batch_timeout = parse_unsigned(optarg, "--batch-timeout", 0, MAX_UDP_BATCH_TIMEOUT);
+            break;
+        case 9:
+            log_path = optarg;
+            break;
+        case 10:
+            log_level = parse_unsigned(optarg, "--log-level", QLOG_OFF, QLOG_TEXT);
+            break;
+        case 11:
+            log_sample = parse_unsigned(optarg, "--log-sample", 1, UINT_MAX);
+            break;
+        case 12:
+            tcp_opts.timeout = parse_unsigned(optarg, "--tcp-timeout", 1, TCP_MAX_TIMEOUT);
+            break;
+        case 13:
+            tcp_opts.max_connections = parse_unsigned(optarg, "--tcp-max", 1, TCP_MAX_CONNECTIONS);
+            break;
+        case 14:
+            tcp_opts.xfr_threads = parse_unsigned(optarg, "--xfr-threads", 1, TCP_MAX_XFR_THREADS);
+            break;
+        case 15:
+            tcp_opts.xfr_per_client = parse_unsigned(optarg, "--xfr-per-client", 1, TCP_MAX_XFR_QUEUE);
+            break;
+        case 16:
+            tcp_opts.xfr_queue = parse_unsigned(optarg, "--xfr-queue", 1, TCP_MAX_XFR_QUEUE);
+            break;
+        case 17:
+            journal_set_limit(parse_unsigned(optarg, "--ixfr-journal", 0, JOURNAL_MAX_LIMIT));
+            break;
+        #ifdef MULTI_PRIMARY
+        case 18:
+            replica_delay = parse_unsigned(optarg, "--replica-delay", 0, REPLICA_MAX_DELAY);
+            break;
+        case 19:
+            replica_journal = optarg;
+            break;
+        #endif
+        case 20:
+            load_threads = parse_unsigned(optarg, "--load-threads", 1, ZONE_LOAD_MAX_THREADS);
+            break;
+        case 21:
+            compiled_dir = optarg;
+            break;
+        case 22:
+            compile_only = true;
+            break;
+        case 23:
+            stats_socket = optarg;
+            break;
+        case 24:
+            rrl_opts.rate = parse_unsigned(optarg, "--rrl-rate", 0, RRL_MAX_RATE);
+            break;
+        case 25:
+            rrl_opts.nxdomain_rate = parse_unsigned(optarg, "--rrl-nxdomain-rate", 0, RRL_MAX_RATE);
+            break;
+        case 26:
+            rrl_opts.error_rate = parse_unsigned(optarg, "--rrl-error-rate", 0, RRL_MAX_RATE);
+            break;
+        case 27:
+            rrl_opts.slip = parse_unsigned(optarg, "--rrl-slip", 0, UINT_MAX);
+            break;
+        case 28:
+            rrl_opts.size = parse_unsigned(optarg, "--rrl-table", 1, RRL_MAX_TABLE);
+            break;
+        case 29:
+            minimal_responses = true;
+            break;
+        case 30:
+            udp_payload = parse_unsigned(optarg, "--udp-payload", UDP_PAYLOAD_MIN, OUTBUF_SIZE);
+            break;
+        case 31:
+            notify_window = parse_unsigned(optarg, "--notify-window", 0, NOTIFY_WINDOW_MAX);
+            break;
+        #ifdef MULTI_PRIMARY
+        case 32:
+            replica_pull = parse_unsigned(optarg, "--replica-pull", 0, REPLICA_MAX_PULL);
+            break;
+        #endif
+        case 33:
+            use_io_uring = true;
+            tcp_opts.io_uring = true;
+            break;
+        #ifdef QUERY_TRACE
+        case 34:
+            trace_slow = parse_unsigned(optarg, "--trace-slow", 1, TRACE_MAX_THRESHOLD);
+            break;
+        #endif
         }
     }
 
@@ -103,6 +355,14 @@ static void parse_opts(int argc, char *argv[], opts_struct *opts) {
     }
     closedir(d);
 
+    if (compile_only && !compiled_dir) {
+       fprintf(stderr, "--compile requires --compiled-dir\n");
+       exit(1);
+    }
+
+    // queries are logged by default once a log file is given
+    if (log_level < 0) log_level = log_path ? QLOG_QUERIES : QLOG_OFF;
+
     #ifdef MULTI_PRIMARY
     if (!opts->address) {
        fprintf(stderr, "No --address specified\n", optarg);
@@ -112,44 +372,89 @@ static void parse_opts(int argc, char *argv[], opts_struct *opts) {
 }
 
 #include <signal.h>
-extern pthread_rwlock_t lock;
-void  INThandler(int sig)  {
-    pthread_rwlock_wrlock(&lock);
-    for (ldns_zone** z = zones; *z; ++z) {
-        ldns_zone_deep_free(*z);
-    *z = NULL;
-    }   
-    pthread_rwlock_unlock(&lock);
+extern pthread_mutex_t update_mutex;
+static void zone_remove(ldns_zone* zone, void* arg) {
+    zone_del(zone);
+}
+
+static void shutdown_server() {
+    pthread_mutex_lock(&update_mutex);
+    zone_table_foreach(zone_remove, NULL);
+    rcu_synchronize();
+    pthread_mutex_unlock(&update_mutex);
+    query_log_close();
     exit(0);
 }
 
+// blocked in every thread, and taken by signal_loop
+static sigset_t handled_signals;
+
+/*
+ * The signals are handled on a thread of their own rather than in a signal
+ * handler, where taking locks, allocating or writing with stdio could
+ * deadlock against the interrupted thread.
+ */
+static void *signal_loop(void *arg) {
+    while (1) {
+        int sig;
+        if (sigwait(&handled_signals, &sig)) continue;
+        if (sig == SIGINT) shutdown_server();
+        if (sig == SIGUSR1) {
+            stats_dump(stderr);
+            trace_dump(stderr);
+        }
+    }
+    return NULL;
+}
+
 void main(int argc, char* argv[]) {
-    signal(SIGINT, INThandler);
-    zones = LDNS_CALLOC(ldns_zone*,1);
+    // before any other thread is created, so that they inherit the mask
+    sigemptyset(&handled_signals);
+    sigaddset(&handled_signals, SIGINT);
+    sigaddset(&handled_signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &handled_signals, NULL);
+    pthread_t signal_thread;
+    pthread_create(&signal_thread, NULL, signal_loop, NULL);
 
     #ifdef MULTI_PRIMARY
     git_libgit2_init();
     #endif
 
     parse_opts(argc, argv, &opts);
+    if (!query_log_open(log_path, log_level, log_sample)) exit(1);
 
     struct in_addr dns_address = {0};
     int dns_port = 53;
 
+    if (compiled_dir) zone_compiled_init(compiled_dir);
+
     #ifdef MULTI_PRIMARY
     zone_pull();
+    char journal_path[PATH_MAX];
+    if (!replica_journal) {
+        // next to the working tree, not in it
+        int len = strlen(opts.dir);
+        while (len > 1 && opts.dir[len-1] == '/') len--;
+        snprintf(journal_path, sizeof journal_path, "%.*s.journal", len, opts.dir);
+        replica_journal = journal_path;
+    }
+    if (!replicator_start(opts.dir, replica_journal, replica_delay, replica_pull)) exit(1);
     #else 
-    DIR *d = opendir(opts.dir);
-    struct dirent *dir;
-    while ((dir = readdir(d)) != NULL) {
-        const char* name = dir->d_name;
-        if (!is_zone_file(name)) continue;
-        printf("%s\n", dir->d_name);
-        filename_t filename;
-        set_filename(filename, opts.dir, dir->d_name);
-        zone_add(zone_read(filename));
+    if (!load_threads) load_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    zone_load_dir(opts.dir, load_threads > 0 ? load_threads : 1);
+    #endif
+
+    if (compile_only) {
+        // the snapshots of the zones parsed from text are being written
+        zone_compiled_flush();
+        exit(0);
     }
-    closedir(d);
+
+    if (stats_socket && !stats_listen(stats_socket)) exit(1);
+    if (!rrl_init(&rrl_opts)) exit(1);
+    if (!notify_init(opts.address, notify_window)) exit(1);
+    #ifdef QUERY_TRACE
+    if (trace_slow) trace_init(trace_slow);
     #endif
 
     start_dns_server(dns_address, dns_port); 
@@ -160,11 +465,31 @@ static void start_dns_server(struct in_addr my_address, int port) {
 
     printf("Listening on port %d\n", port);
 
-    udp_sock =  socket(AF_INET, SOCK_DGRAM, 0);
-    if (udp_sock < 0) {
-        fprintf(stderr, "socket(): %s\n", strerror(errno));
-        exit(1);
+    workers = aligned_alloc(64, sizeof(udp_worker) * udp_threads);
+    memset(workers, 0, sizeof(udp_worker) * udp_threads);
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 0; i < udp_threads; i++) {
+        int sock = socket(AF_INET, SOCK_DGRAM, 0);
+        if (sock < 0) {
+            fprintf(stderr, "socket(): %s\n", strerror(errno));
+            exit(1);
+        }
+
+        // each worker has its own socket, the kernel spreads the datagrams among them
+        if (udp_threads > 1 && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) <0) {
+            fprintf(stderr, "setsockopt(SO_REUSEPORT): %s\n", strerror(errno));
+            exit(1);
+        }
+
+        if (bind_port(sock, port, my_address.s_addr)) {
+            fprintf(stderr, "cannot bind(): %s\n", strerror(errno));
+            exit(errno);
+        }
+
+        workers[i].sock = sock;
+        workers[i].cpu = udp_first_cpu < 0 ? -1 : (udp_first_cpu + i) % ncpus;
     }
+    udp_sock = workers[0].sock;
 
     int tcp_sock =  socket(AF_INET, SOCK_STREAM, 0);
     if (tcp_sock < 0) {
@@ -177,24 +502,23 @@ static void start_dns_server(struct in_addr my_address, int port) {
         exit(1);
     }
 
-    if (bind_port(udp_sock, port, my_address.s_addr)) {
-        fprintf(stderr, "cannot bind(): %s\n", strerror(errno));
-        exit(errno);
-    }
-
     if (bind_port(tcp_sock, port, my_address.s_addr)) {
         fprintf(stderr, "cannot bind(): %s\n", strerror(errno));
         exit(errno);
     }
 
-    if (listen(tcp_sock, 5) < 0) {
+    if (listen(tcp_sock, SOMAXCONN) < 0) {
         fprintf(stderr, "listen(): %s\n", strerror(errno));
         exit(1);
     }
 
-    pthread_t tcp_thread;
-    pthread_create(&tcp_thread, NULL, listen_tcp, &tcp_sock);
-    listen_udp(&udp_sock);
+    tcp_server_start(tcp_sock, &tcp_opts);
+
+    for (int i = 1; i < udp_threads; i++) {
+        pthread_create(&workers[i].thread, NULL, listen_udp, &workers[i]);
+    }
+    workers[0].thread = pthread_self();
+    listen_udp(&workers[0]);
 }
 
 static int bind_port(int sock, int port, in_addr_t maddr) {
@@ -205,60 +529,275 @@ static int bind_port(int sock, int port, in_addr_t maddr) {
     return bind(sock, (struct sockaddr *)&addr, (socklen_t) sizeof(addr));
 }
 
-static void* listen_udp(void* psock) {
-    int sock = *(int*)psock;
-    while (1) {
-        uint8_t inbuf[INBUF_SIZE];
+static int recv_batch(udp_worker *worker) {
+    // block for the first datagram, then take whatever else is already queued
+    int n = recvmmsg(worker->sock, worker->msgs, udp_batch, MSG_WAITFORONE, NULL);
+    if (n < 0) return n;
+
+    if (udp_batch_timeout && n < udp_batch) {
+        // the timeout is in microseconds, poll would round it down to milliseconds
+        uint64_t deadline = stats_now() + udp_batch_timeout * 1000;
+        while (n < udp_batch) {
+            uint64_t now = stats_now();
+            if (now >= deadline) break;
+            struct timespec wait = { (deadline - now) / 1000000000, (deadline - now) % 1000000000 };
+            struct pollfd pfd = {worker->sock, POLLIN};
+            if (ppoll(&pfd, 1, &wait, NULL) < 1) break;
+            int m = recvmmsg(worker->sock, worker->msgs + n, udp_batch - n, MSG_DONTWAIT, NULL);
+            if (m < 1) break;
+            n += m;
+        }
+    }
+
+    stats_batch(n);
+    return n;
+}
+
+/*
+ * Answer a datagram, shared by the recvmmsg and io_uring loops. The answer
+ * is written in fastbuf (OUTBUF_SIZE bytes) or allocated from the arena of
+ * the thread. Returns NULL if nothing is to be sent.
+ */
+static uint8_t *answer_datagram(uint8_t *query, size_t size, const struct sockaddr_storage *addr, uint8_t *fastbuf, size_t *answer_size) {
+    query_log_query(query, size);
+    stats_query(query, size, STATS_UDP);
+    trace_begin(query, size);
+
+    // plain queries are answered in place, the rest through ldns
+    // (which also prints them at QLOG_TEXT)
+    uint8_t *outbuf=NULL;
+    uint8_t *answer=fastbuf;
+    *answer_size = 0;
+    if (query_log_level < QLOG_TEXT) {
+        *answer_size = handle_dns_fast(query,size,answer,OUTBUF_SIZE,false);
+    }
+    if (!*answer_size) {
+        handle_dns_wire(query,size,&outbuf,answer_size,0);
+        answer = outbuf;
+    }
+    trace_end();
+
+    if (answer && rrl_enabled) {
+        int action = rrl_check(addr, answer, *answer_size);
+        if (action == RRL_SLIP) *answer_size = rrl_truncate(answer, *answer_size);
+        if (action == RRL_DROP) answer = NULL;
+    }
+
+    if (answer) {
+        query_log_answer(answer, *answer_size);
+        stats_answer(answer, *answer_size, STATS_UDP);
+    }
+    return answer;
+}
 
-        struct sockaddr addr_him;
-        socklen_t hislen = (socklen_t) sizeof(addr_him);
+static struct io_uring_sqe *uring_worker_sqe(uring_worker *uw) {
+    struct io_uring_sqe *sqe = uring_sqe(&uw->ring);
+    if (!sqe) {
+        // the kernel takes the whole queue on submission
+        uring_submit(&uw->ring, 0);
+        sqe = uring_sqe(&uw->ring);
+    }
+    return sqe;
+}
 
-        ssize_t nb = recvfrom(sock, (void*)inbuf, INBUF_SIZE, 0, &addr_him, &hislen);
+static void uring_recv(uring_worker *uw, int sock) {
+    struct io_uring_sqe *sqe = uring_worker_sqe(uw);
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = sock;
+    sqe->addr = (uintptr_t) &uw->recv_msg;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = uw->bufs.group;
+    sqe->user_data = URING_RECV;
+}
 
-        if (nb < 1) {
-            fprintf(stderr, "recvfrom(): %s\n", strerror(errno));
+/*
+ * Serve the socket of the worker through io_uring: a multishot recvmsg
+ * takes the datagrams into provided buffers, and the answers of all the
+ * datagrams found on each wakeup are submitted together, with the receive
+ * when it has to be rearmed. Answers are copied into a send slot, so the
+ * receive buffers and the arena are released right away.
+ *
+ * Returns, before anything is received, only if io_uring or multishot
+ * receives are not available (Linux 6.0).
+ */
+static void listen_udp_uring(udp_worker *worker) {
+    uring_worker *uw = LDNS_MALLOC(uring_worker);
+    if (!uw) return;
+    if (!uring_init(&uw->ring, URING_SENDS * 2, URING_BUFFERS * 4)) {
+        LDNS_FREE(uw);
+        return;
+    }
+    unsigned bufsize = sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_storage) + INBUF_SIZE;
+    if (!uring_buffers_init(&uw->ring, &uw->bufs, 0, URING_BUFFERS, bufsize)) {
+        uring_free(&uw->ring);
+        LDNS_FREE(uw);
+        return;
+    }
+    uw->recv_msg = (struct msghdr) { .msg_namelen = sizeof(struct sockaddr_storage) };
+    for (int i = 0; i < URING_SENDS; i++) uw->free_sends[i] = i;
+    uw->nfree = URING_SENDS;
+
+    int sock = worker->sock;
+    bool serving = false;
+    uring_recv(uw, sock);
+    while (1) {
+        int r = uring_submit(&uw->ring, 1);
+        if (r < 0 && r != -EBUSY && r != -EAGAIN) {
+            fprintf(stderr, "io_uring_enter(): %s\n", strerror(-r));
             exit(1);
         }
 
-        uint8_t *outbuf=NULL;
-        size_t answer_size;
-        handle_dns_wire(inbuf,nb,&outbuf,&answer_size,0);
+        int n = 0;
+        bool rearm = false;
+        struct io_uring_cqe *cqe;
+        trace_batch();
+        while ((cqe = uring_cqe(&uw->ring))) {
+            uint64_t tag = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            uring_cqe_seen(&uw->ring);
+
+            if (tag != URING_RECV) {
+                // a datagram that cannot be sent is dropped
+                uw->free_sends[uw->nfree++] = (int) tag;
+                continue;
+            }
+            if (!(flags & IORING_CQE_F_MORE)) rearm = true;
+            if (res < 0) {
+                if (!serving && (res == -EINVAL || res == -EOPNOTSUPP)) {
+                    fprintf(stderr, "io_uring multishot recvmsg not supported\n");
+                    uring_buffers_free(&uw->ring, &uw->bufs);
+                    uring_free(&uw->ring);
+                    LDNS_FREE(uw);
+                    return;
+                }
+                // ENOBUFS: all the buffers are taken, the receive is rearmed when they come back
+                if (res != -ENOBUFS && res != -EINTR) fprintf(stderr, "io_uring recvmsg(): %s\n", strerror(-res));
+                continue;
+            }
+            serving = true;
+            if (!(flags & IORING_CQE_F_BUFFER)) continue;
+
+            unsigned id = flags >> IORING_CQE_BUFFER_SHIFT;
+            uint8_t *buf = uring_buffer(&uw->bufs, id);
+            struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out*) buf;
+            struct sockaddr_storage *addr = (struct sockaddr_storage*) (out + 1);
+            uint8_t *query = (uint8_t*) (addr + 1);
+            n++;
+
+            // the sends submitted so far usually complete inline, and free their slots
+            if (!uw->nfree) uring_submit(&uw->ring, 0);
+            if (out->payloadlen < 1 || (out->flags & MSG_TRUNC) || !uw->nfree) {
+                uring_buffer_recycle(&uw->bufs, id);
+                continue;
+            }
 
-        if (outbuf) {
-            (void) sendto(sock, (void*)outbuf, answer_size, 0, &addr_him, hislen);
-            LDNS_FREE(outbuf);
+            int slot = uw->free_sends[uw->nfree - 1];
+            uring_send *send = &uw->sends[slot];
+            size_t answer_size;
+            uint8_t *answer = answer_datagram(query, out->payloadlen, addr, send->buf, &answer_size);
+            if (answer && answer != send->buf) {
+                if (answer_size <= OUTBUF_SIZE) memcpy(send->buf, answer, answer_size);
+                else answer = NULL;
+            }
+            if (answer) {
+                uw->nfree--;
+                memcpy(&send->addr, addr, out->namelen);
+                send->iov = (struct iovec) {send->buf, answer_size};
+                send->msg = (struct msghdr) {
+                    .msg_name = &send->addr,
+                    .msg_namelen = out->namelen,
+                    .msg_iov = &send->iov,
+                    .msg_iovlen = 1 };
+                struct io_uring_sqe *sqe = uring_worker_sqe(uw);
+                sqe->opcode = IORING_OP_SENDMSG;
+                sqe->fd = sock;
+                sqe->addr = (uintptr_t) &send->msg;
+                sqe->user_data = slot;
+            }
+            uring_buffer_recycle(&uw->bufs, id);
         }
+
+        // --batch does not apply here, n is the datagrams received per wakeup
+        if (n) stats_batch(n);
+        // queued, they are submitted with the next wait; the queries are
+        // still in the buffers until these are given back
+        trace_sent();
+        uring_buffers_commit(&uw->bufs);
+        arena_reset();
+        if (rearm) uring_recv(uw, sock);
     }
 }
 
-static void* listen_tcp(void* psock) {
-    int sock = *(int*)psock;
+static void* listen_udp(void* pworker) {
+    udp_worker *worker = pworker;
+    int sock = worker->sock;
+
+    if (worker->cpu >= 0) {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(worker->cpu, &cpuset);
+        int error = pthread_setaffinity_np(pthread_self(), sizeof cpuset, &cpuset);
+        if (error) fprintf(stderr, "pthread_setaffinity_np(%d): %s\n", worker->cpu, strerror(error));
+    }
+
+    if (use_io_uring) {
+        listen_udp_uring(worker);
+        fprintf(stderr, "UDP worker %d falls back to recvmmsg\n", (int) (worker - workers));
+    }
+
+    for (int i = 0; i < udp_batch; i++) {
+        worker->iov[i].iov_base = worker->inbuf[i];
+        worker->iov[i].iov_len = INBUF_SIZE;
+        worker->msgs[i].msg_hdr = (struct msghdr) {
+            .msg_name = &worker->addr[i],
+            .msg_iov = &worker->iov[i],
+            .msg_iovlen = 1 };
+    }
+
     while (1) {
-        int fd = accept(sock, NULL,NULL);
-        if (fd < 0) {
-            fprintf(stderr, "accept(): %s\n", strerror(errno));
+        for (int i = 0; i < udp_batch; i++) {
+            worker->msgs[i].msg_hdr.msg_namelen = sizeof(worker->addr[i]);
+        }
+
+        int n = recv_batch(worker);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "recvmmsg(): %s\n", strerror(errno));
             exit(1);
         }
+        trace_batch();
+
+        int nout = 0;
+        for (int i = 0; i < n; i++) {
+            if (worker->msgs[i].msg_len < 1) continue;
+
+            size_t answer_size;
+            uint8_t *answer = answer_datagram(worker->inbuf[i], worker->msgs[i].msg_len, &worker->addr[i], worker->fastbuf[nout], &answer_size);
+            if (answer) {
+                worker->out_iov[nout] = (struct iovec) {answer, answer_size};
+                worker->out[nout].msg_hdr = (struct msghdr) {
+                    .msg_name = &worker->addr[i],
+                    .msg_namelen = worker->msgs[i].msg_hdr.msg_namelen,
+                    .msg_iov = &worker->out_iov[nout],
+                    .msg_iovlen = 1 };
+                nout++;
+            }
+        }
 
-        while (1) {
-          size_t nb; 
-          struct timeval timeout = {1};
-          uint8_t *inbuf = ldns_tcp_read_wire_timeout(fd, &nb, timeout);
-          if (!inbuf) break; 
-          uint8_t *outbuf=NULL;
-          size_t answer_size;
-          handle_dns_wire(inbuf,nb,&outbuf,&answer_size,fd);
-
-          LDNS_FREE(inbuf);
-          if (outbuf) {
-              uint16_t size = htons(answer_size);
-              struct iovec iov[2] = {{&size,2}, {outbuf, answer_size}};
-              writev(fd, iov, 2);
-              LDNS_FREE(outbuf);
-          }
+        for (int sent = 0; sent < nout;) {
+            int m = sendmmsg(sock, worker->out + sent, nout - sent, 0);
+            if (m < 0) {
+                if (errno == EINTR) continue;
+                // the datagram at the head of the batch cannot be sent, drop it
+                m = 1;
+            }
+            sent += m;
         }
+        trace_sent();
 
-        close(fd);
+        // the answers of the batch were allocated from the arena of the worker
+        arena_reset();
     }
 }
-
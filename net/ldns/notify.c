@@ -0,0 +1,356 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+#define _GNU_SOURCE
+#include "dns_server.h"
+#include "notify.h"
+#include "rcu.h"
+#include "rrset_index.h"
+#include "stats.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#define NOTIFY_BUCKETS 1021
+#define NOTIFY_BATCH 64
+#define NOTIFY_TIMEOUT 1000  // ms, doubled after every try
+
+typedef struct notify_target {
+    struct sockaddr_in addr;
+    uint16_t id;
+    uint8_t tries;
+    bool done;      // acknowledged, or given up
+    uint64_t next;  // ms, time of the next try
+} notify_target;
+
+/* Zone that has been notified, keyed by apex and class */
+typedef struct notify_zone {
+    ldns_rdf *apex;
+    ldns_rr_class rr_class;
+    struct notify_zone *next;  // in the bucket
+
+    // under notify_mutex
+    bool pending;
+    uint64_t due;  // ms
+    struct notify_zone *next_pending;
+
+    // owned by the notify thread
+    uint8_t *wire;
+    size_t wire_size;
+    bool resolved;
+    uint32_t serial;  // the targets were looked up for
+    notify_target *targets;
+    size_t count;
+    bool active;
+    struct notify_zone *next_active;
+    struct notify_zone *next_ready;
+} notify_zone;
+
+static int notify_sock = -1;
+static int wake_fd;
+static unsigned window;
+static uint32_t own_address;
+
+static pthread_mutex_t notify_mutex = PTHREAD_MUTEX_INITIALIZER;
+static notify_zone *zones[NOTIFY_BUCKETS];
+static notify_zone *pending;
+
+// zones with targets that have not answered yet
+static notify_zone *active;
+
+void notify_schedule(const ldns_zone *zone) {
+    ldns_rr *soa = ldns_zone_soa(zone);
+    if (notify_sock < 0 || !soa) return;
+
+    const ldns_rdf *apex = ldns_rr_owner(soa);
+    ldns_rr_class rr_class = ldns_rr_get_class(soa);
+    bool wake = false;
+
+    pthread_mutex_lock(&notify_mutex);
+    notify_zone **p = &zones[dname_hash(apex) % NOTIFY_BUCKETS];
+    while (*p && ((*p)->rr_class != rr_class || !dname_equal((*p)->apex, apex))) p = &(*p)->next;
+    if (!*p) {
+        *p = LDNS_CALLOC(notify_zone, 1);
+        (*p)->apex = ldns_rdf_clone(apex);
+        (*p)->rr_class = rr_class;
+    }
+    notify_zone *z = *p;
+    if (!z->pending) {
+        // the changes made within the window go out in the same NOTIFY
+        z->pending = true;
+        z->due = stats_now() / 1000000 + window;
+        z->next_pending = pending;
+        pending = z;
+        wake = true;
+    }
+    pthread_mutex_unlock(&notify_mutex);
+
+    if (wake) eventfd_write(wake_fd, 1);
+}
+
+static bool notify_wire(notify_zone *z) {
+    ldns_pkt *notify = ldns_pkt_new();
+    ldns_rr *question = ldns_rr_new();
+
+    ldns_rr_set_class(question, z->rr_class);
+    ldns_rr_set_owner(question, ldns_rdf_clone(z->apex));
+    ldns_rr_set_type(question, LDNS_RR_TYPE_SOA);
+    ldns_rr_set_question(question, true);
+    ldns_pkt_set_opcode(notify, LDNS_PACKET_NOTIFY);
+    ldns_pkt_push_rr(notify, LDNS_SECTION_QUESTION, question);
+    ldns_pkt_set_aa(notify, true);
+
+    ldns_status status = ldns_pkt2wire(&z->wire, notify, &z->wire_size);
+    ldns_pkt_free(notify);
+    if (status) {
+        fprintf(stderr, "Error converting notify packet to wire: %s\n", ldns_get_errorstr_by_id(status));
+        z->wire = NULL;
+        return false;
+    }
+    return true;
+}
+
+/* Secondaries of the published version of the zone, under rcu_read_lock */
+static void resolve_targets(notify_zone *z, const ldns_zone *zone) {
+    notify_target *targets = NULL;
+    size_t count = 0, capacity = 0;
+
+    ldns_rr_list *rrlist_ns = get_rrset(zone, z->apex, LDNS_RR_TYPE_NS, z->rr_class, 0);
+    for (size_t i = 0; i < ldns_rr_list_rr_count(rrlist_ns); i++) {
+        ldns_rdf *nsdname = ldns_rr_ns_nsdname(ldns_rr_list_rr(rrlist_ns, i));
+        ldns_rr_list *rrs = get_rrset(zone_find(nsdname, LDNS_RR_CLASS_IN), nsdname, LDNS_RR_TYPE_A, LDNS_RR_CLASS_IN, 0);
+        for (size_t j = 0; j < ldns_rr_list_rr_count(rrs); j++) {
+            ldns_rdf *address = ldns_rr_a_address(ldns_rr_list_rr(rrs, j));
+            if (!address || ldns_rdf_size(address) != 4 || ldns_rdf_get_type(address) != LDNS_RDF_TYPE_A) continue;
+
+            uint32_t s_addr;
+            memcpy(&s_addr, ldns_rdf_data(address), 4);
+            if (s_addr == own_address) continue;
+            size_t k = 0;
+            while (k < count && targets[k].addr.sin_addr.s_addr != s_addr) k++;
+            if (k < count) continue;
+
+            if (count == capacity) {
+                capacity = capacity ? capacity * 2 : 4;
+                targets = LDNS_XREALLOC(targets, notify_target, capacity);
+            }
+            memset(&targets[count], 0, sizeof *targets);
+            targets[count].addr.sin_family = AF_INET;
+            targets[count].addr.sin_port = htons(53);
+            targets[count].addr.sin_addr.s_addr = s_addr;
+            count++;
+        }
+        ldns_rr_list_free(rrs);
+    }
+    ldns_rr_list_free(rrlist_ns);
+
+    LDNS_FREE(z->targets);
+    z->targets = targets;
+    z->count = count;
+}
+
+static void start_round(notify_zone *z, uint64_t now) {
+    if (!z->wire && !notify_wire(z)) return;
+
+    rcu_read_lock();
+    ldns_zone *zone = zone_find(z->apex, z->rr_class);
+    ldns_rr *soa = zone ? ldns_zone_soa(zone) : NULL;
+    if (soa && !dname_equal(ldns_rr_owner(soa), z->apex)) soa = NULL;
+    if (!soa) {
+        // deleted in the meantime
+        rcu_read_unlock();
+        return;
+    }
+    uint32_t serial = ldns_rdf2native_int32(ldns_rr_rdf(soa, 2));
+    if (!z->resolved || serial != z->serial) {
+        resolve_targets(z, zone);
+        z->serial = serial;
+        z->resolved = true;
+    }
+    rcu_read_unlock();
+
+    for (size_t i = 0; i < z->count; i++) {
+        notify_target *t = &z->targets[i];
+        t->id = ldns_get_random();
+        t->tries = 0;
+        t->done = false;
+        t->next = now;
+    }
+    if (z->count && !z->active) {
+        z->active = true;
+        z->next_active = active;
+        active = z;
+    }
+}
+
+static void send_batch(struct mmsghdr *msgs, int n) {
+    for (int sent = 0; sent < n;) {
+        int m = sendmmsg(notify_sock, msgs + sent, n - sent, 0);
+        if (m < 0) {
+            if (errno == EINTR) continue;
+            // the datagram at the head of the batch is tried again after the timeout
+            m = 1;
+        }
+        sent += m;
+    }
+}
+
+/* Sends the NOTIFY that are due, and returns the time of the next try */
+static uint64_t send_due(uint64_t now) {
+    struct mmsghdr msgs[NOTIFY_BATCH];
+    struct iovec iov[NOTIFY_BATCH][2];
+    uint8_t ids[NOTIFY_BATCH][2];
+    int n = 0;
+    uint64_t next = UINT64_MAX;
+
+    for (notify_zone **p = &active; *p;) {
+        notify_zone *z = *p;
+        bool waiting = false;
+        for (size_t i = 0; i < z->count; i++) {
+            notify_target *t = &z->targets[i];
+            if (t->done) continue;
+            if (t->next > now) {
+                waiting = true;
+                if (t->next < next) next = t->next;
+                continue;
+            }
+            if (t->tries == NOTIFY_TRIES) {
+                char *name = ldns_rdf2str(z->apex);
+                fprintf(stderr, "NOTIFY of %s not acknowledged by %s\n", name, inet_ntoa(t->addr.sin_addr));
+                LDNS_FREE(name);
+                t->done = true;
+                stats_notify(NOTIFY_FAILED);
+                continue;
+            }
+
+            if (n == NOTIFY_BATCH) {
+                send_batch(msgs, n);
+                n = 0;
+            }
+            // the message differs in the id only
+            ldns_write_uint16(ids[n], t->id);
+            iov[n][0] = (struct iovec) { ids[n], 2 };
+            iov[n][1] = (struct iovec) { z->wire + 2, z->wire_size - 2 };
+            msgs[n].msg_hdr = (struct msghdr) {
+                .msg_name = &t->addr,
+                .msg_namelen = sizeof t->addr,
+                .msg_iov = iov[n],
+                .msg_iovlen = 2 };
+            n++;
+            stats_notify(NOTIFY_SENT);
+
+            t->next = now + ((uint64_t) NOTIFY_TIMEOUT << t->tries);
+            t->tries++;
+            waiting = true;
+            if (t->next < next) next = t->next;
+        }
+
+        if (waiting) {
+            p = &z->next_active;
+        } else {
+            z->active = false;
+            *p = z->next_active;
+        }
+    }
+    if (n) send_batch(msgs, n);
+    return next;
+}
+
+static void receive_acks() {
+    uint8_t buf[512];
+    struct sockaddr_in from;
+    while (true) {
+        socklen_t len = sizeof from;
+        ssize_t n = recvfrom(notify_sock, buf, sizeof buf, MSG_DONTWAIT, (struct sockaddr*) &from, &len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        if (n < LDNS_HEADER_SIZE || !LDNS_QR_WIRE(buf) || LDNS_OPCODE_WIRE(buf) != LDNS_PACKET_NOTIFY) continue;
+
+        uint16_t id = ldns_read_uint16(buf);
+        for (notify_zone *z = active; z; z = z->next_active) {
+            for (size_t i = 0; i < z->count; i++) {
+                notify_target *t = &z->targets[i];
+                if (t->done || t->id != id || t->addr.sin_addr.s_addr != from.sin_addr.s_addr) continue;
+                t->done = true;
+                stats_notify(NOTIFY_ACKED);
+            }
+        }
+    }
+}
+
+static void *notify_loop(void *arg) {
+    struct pollfd fds[2] = { { notify_sock, POLLIN }, { wake_fd, POLLIN } };
+    while (true) {
+        uint64_t now = stats_now() / 1000000;
+        uint64_t next = UINT64_MAX;
+        notify_zone *ready = NULL;
+
+        pthread_mutex_lock(&notify_mutex);
+        for (notify_zone **p = &pending; *p;) {
+            notify_zone *z = *p;
+            if (z->due > now) {
+                if (z->due < next) next = z->due;
+                p = &z->next_pending;
+                continue;
+            }
+            *p = z->next_pending;
+            z->pending = false;
+            z->next_ready = ready;
+            ready = z;
+        }
+        pthread_mutex_unlock(&notify_mutex);
+
+        for (; ready; ready = ready->next_ready) start_round(ready, now);
+        uint64_t retry = send_due(now);
+        if (retry < next) next = retry;
+
+        int timeout = next == UINT64_MAX ? -1 : (int) (next - now);
+        if (poll(fds, 2, timeout) > 0) {
+            eventfd_t value;
+            if (fds[1].revents & POLLIN) eventfd_read(wake_fd, &value);
+            if (fds[0].revents & POLLIN) receive_acks();
+        }
+    }
+    return NULL;
+}
+
+bool notify_init(uint32_t address, unsigned window_ms) {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        fprintf(stderr, "socket(): %s\n", strerror(errno));
+        return false;
+    }
+
+    // from our address and a port of its own, where the answers come back
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = address };
+    if (bind(sock, (struct sockaddr*) &addr, sizeof addr) < 0) {
+        fprintf(stderr, "cannot bind() the notify socket: %s\n", strerror(errno));
+        close(sock);
+        return false;
+    }
+
+    wake_fd = eventfd(0, EFD_NONBLOCK);
+    if (wake_fd < 0) {
+        fprintf(stderr, "eventfd(): %s\n", strerror(errno));
+        close(sock);
+        return false;
+    }
+
+    own_address = address;
+    window = window_ms;
+    notify_sock = sock;
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, notify_loop, NULL);
+    pthread_detach(thread);
+    return true;
+}
@@ -0,0 +1,48 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+#ifndef NOTIFY_H
+#define NOTIFY_H
+
+#include <ldns/ldns.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * NOTIFY of zone changes to the secondaries (RFC 1996), sent by a
+ * background thread from its own UDP socket.
+ *
+ * notify_schedule only marks the zone as changed, and returns. The NOTIFY
+ * goes out once the window has passed, so that a burst of updates to the
+ * same zone is announced once, with its latest version.
+ *
+ * The secondaries are the IPv4 addresses of the NS of the zone apex, less
+ * our own address. They are looked up once per serial of the zone, and
+ * kept with the zone until the serial changes.
+ *
+ * Every secondary is sent the NOTIFY until it answers with the same id,
+ * after 1, 2, 4... seconds, at most NOTIFY_TRIES times. A new version of
+ * the zone restarts the count with new ids. The NOTIFY of all the zones
+ * due at the same time are sent with a single sendmmsg.
+ *
+ * Everything is a no-op until notify_init is called.
+ */
+
+#define NOTIFY_TRIES 5
+#define NOTIFY_WINDOW_DEFAULT 500  // ms
+#define NOTIFY_WINDOW_MAX 3600000  // ms
+
+// outcomes, as counted by stats_notify
+#define NOTIFY_SENT 0
+#define NOTIFY_ACKED 1
+#define NOTIFY_FAILED 2  // no answer after NOTIFY_TRIES
+
+bool notify_init(uint32_t address, unsigned window_ms);
+void notify_schedule(const ldns_zone *zone);
+
+#endif
@@ -0,0 +1,72 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+/*
+ * Print a binary query log (see query_log.h) as text.
+ * The log must be read on a host with the byte order of the server.
+ *
+ * Use: qlogdump [file]
+ */
+
+#include "query_log.h"
+#include <ldns/ldns.h>
+#include <time.h>
+
+static void print_record(const query_log_record *record, const uint8_t *wire) {
+    time_t seconds = record->time / 1000000000ull;
+    struct tm tm;
+    char date[32];
+    strftime(date, sizeof date, "%Y-%m-%dT%H:%M:%S", gmtime_r(&seconds, &tm));
+
+    printf(";; %s.%09lluZ thread %u %s, %u bytes\n", date,
+           (unsigned long long) (record->time % 1000000000ull), record->thread,
+           record->kind == QLOG_KIND_QUERY ? "query" : "answer", record->length);
+
+    ldns_pkt *pkt;
+    if (record->size == record->length && ldns_wire2pkt(&pkt, wire, record->size) == LDNS_STATUS_OK) {
+        ldns_pkt_print(stdout, pkt);
+        ldns_pkt_free(pkt);
+    } else {
+        // truncated or malformed, print the header and the raw bytes
+        if (record->size >= LDNS_HEADER_SIZE) {
+            printf(";; id %u, flags %02x%02x, qd %u, an %u, ns %u, ar %u\n",
+                   ldns_read_uint16(wire), wire[2], wire[3],
+                   ldns_read_uint16(wire + 4), ldns_read_uint16(wire + 6),
+                   ldns_read_uint16(wire + 8), ldns_read_uint16(wire + 10));
+        }
+        for (size_t i = 0; i < record->size; i++) {
+            printf("%02x%s", wire[i], (i % 32 == 31 || i + 1 == record->size) ? "\n" : " ");
+        }
+    }
+    printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+    FILE *file = argc > 1 ? fopen(argv[1], "rb") : stdin;
+    if (!file) {
+        fprintf(stderr, "Cannot open %s\n", argv[1]);
+        return 1;
+    }
+
+    char magic[sizeof QLOG_MAGIC - 1];
+    if (fread(magic, 1, sizeof magic, file) != sizeof magic || memcmp(magic, QLOG_MAGIC, sizeof magic)) {
+        fprintf(stderr, "Not a query log\n");
+        return 1;
+    }
+
+    query_log_record record;
+    uint8_t wire[QLOG_MAX_WIRE];
+    while (fread(&record, sizeof record, 1, file) == 1) {
+        if (record.size > QLOG_MAX_WIRE || fread(wire, 1, record.size, file) != record.size) {
+            fprintf(stderr, "Truncated log\n");
+            return 1;
+        }
+        print_record(&record, wire);
+    }
+    return 0;
+}
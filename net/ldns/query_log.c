@@ -0,0 +1,169 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+#include "query_log.h"
+#include <ldns/ldns.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+
+#define RING_SIZE (1 << 20)
+
+/* Single-producer single-consumer ring, positions increase monotonically */
+typedef struct log_ring {
+    _Atomic uint64_t head __attribute__((aligned(64)));  // written by the owner thread
+    _Atomic uint64_t dropped;
+    _Atomic uint64_t tail __attribute__((aligned(64)));  // written by the log writer
+    uint8_t thread;
+    struct log_ring *next;
+    uint8_t data[RING_SIZE];
+} log_ring;
+
+int query_log_level = QLOG_OFF;
+
+static unsigned sample_rate = 1;
+static FILE *file;
+static pthread_t writer;
+static atomic_bool running;
+
+static _Atomic(log_ring*) rings;
+static _Atomic uint8_t ring_count;
+static __thread log_ring *self;
+static __thread unsigned sample_count;
+static __thread bool sampled;
+
+static log_ring *ring_register() {
+    // rings are never unregistered, threads live as long as the server
+    log_ring *ring = aligned_alloc(64, sizeof(log_ring));
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->dropped, 0);
+    atomic_init(&ring->tail, 0);
+    ring->thread = atomic_fetch_add(&ring_count, 1);
+    ring->next = atomic_load(&rings);
+    while (!atomic_compare_exchange_weak(&rings, &ring->next, ring));
+    return self = ring;
+}
+
+static void ring_copy(log_ring *ring, uint64_t pos, const void *data, size_t size) {
+    size_t offset = pos % RING_SIZE;
+    size_t first = size < RING_SIZE - offset ? size : RING_SIZE - offset;
+    memcpy(ring->data + offset, data, first);
+    memcpy(ring->data, (const uint8_t*) data + first, size - first);
+}
+
+static void query_log_write(uint8_t kind, const uint8_t *wire, size_t size) {
+    log_ring *ring = self ? self : ring_register();
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    query_log_record record = {
+        .time = now.tv_sec * 1000000000ull + now.tv_nsec,
+        .size = size < QLOG_MAX_WIRE ? size : QLOG_MAX_WIRE,
+        .length = size,
+        .kind = kind,
+        .thread = ring->thread };
+
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head + sizeof record + record.size - tail > RING_SIZE) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    ring_copy(ring, head, &record, sizeof record);
+    ring_copy(ring, head + sizeof record, wire, record.size);
+    atomic_store_explicit(&ring->head, head + sizeof record + record.size, memory_order_release);
+}
+
+void query_log_query(const uint8_t *wire, size_t size) {
+    sampled = false;
+    if (query_log_level < QLOG_QUERIES || !atomic_load_explicit(&running, memory_order_relaxed)) return;
+    if (++sample_count < sample_rate) return;
+    sample_count = 0;
+    sampled = true;
+    query_log_write(QLOG_KIND_QUERY, wire, size);
+}
+
+void query_log_answer(const uint8_t *wire, size_t size) {
+    if (!sampled || query_log_level < QLOG_ANSWERS) return;
+    query_log_write(QLOG_KIND_ANSWER, wire, size);
+}
+
+/* Write what the producers have published so far, returns the bytes written */
+static size_t drain() {
+    size_t total = 0;
+    for (log_ring *ring = atomic_load(&rings); ring; ring = ring->next) {
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        if (head == tail) continue;
+
+        size_t offset = tail % RING_SIZE;
+        size_t size = head - tail;
+        size_t first = size < RING_SIZE - offset ? size : RING_SIZE - offset;
+        fwrite(ring->data + offset, 1, first, file);
+        fwrite(ring->data, 1, size - first, file);
+        atomic_store_explicit(&ring->tail, head, memory_order_release);
+        total += size;
+    }
+    if (total) fflush(file);
+    return total;
+}
+
+static void* write_log(void *arg) {
+    while (atomic_load(&running)) {
+        if (!drain()) {
+            struct timespec delay = { 0, 50 * 1000000 };
+            nanosleep(&delay, NULL);
+        }
+    }
+    return NULL;
+}
+
+bool query_log_open(const char *path, int level, unsigned sample) {
+    query_log_level = level;
+    sample_rate = sample ? sample : 1;
+    if (!path || level < QLOG_QUERIES) return true;
+
+    file = fopen(path, "ab");
+    if (!file) {
+        fprintf(stderr, "Cannot open query log %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    fseek(file, 0, SEEK_END);
+    if (!ftell(file)) fwrite(QLOG_MAGIC, 1, strlen(QLOG_MAGIC), file);
+
+    atomic_store(&running, true);
+    int error = pthread_create(&writer, NULL, write_log, NULL);
+    if (error) {
+        fprintf(stderr, "pthread_create(): %s\n", strerror(error));
+        atomic_store(&running, false);
+        fclose(file);
+        file = NULL;
+        return false;
+    }
+    return true;
+}
+
+void query_log_close() {
+    if (!file) return;
+    atomic_store(&running, false);
+    pthread_join(writer, NULL);
+    drain();
+    fclose(file);
+    file = NULL;
+}
+
+uint64_t query_log_dropped() {
+    uint64_t dropped = 0;
+    for (log_ring *ring = atomic_load(&rings); ring; ring = ring->next) {
+        dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+    }
+    return dropped;
+}
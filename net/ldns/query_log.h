@@ -0,0 +1,65 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+#ifndef QUERY_LOG_H
+#define QUERY_LOG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Binary log of the messages seen by the server. Each thread appends
+ * records to its own ring buffer without locking; a background thread
+ * drains the rings into the log file. When a ring is full the record is
+ * dropped (and counted) instead of blocking the thread answering queries.
+ *
+ * One query in every query_log_sample is logged. query_log_answer logs
+ * the answer only if the last query seen by the thread was logged.
+ *
+ * At QLOG_TEXT every message is also printed to stdout with
+ * ldns_pkt_print, as the server used to do. That is meant for debugging
+ * and serializes all threads on stdout.
+ *
+ * The file starts with QLOG_MAGIC, followed by records made of a
+ * query_log_record header and `size` bytes of wire data (in host byte
+ * order, see qlogdump.c).
+ */
+
+#define QLOG_OFF 0
+#define QLOG_QUERIES 1
+#define QLOG_ANSWERS 2
+#define QLOG_TEXT 3
+
+#define QLOG_MAGIC "QLOG0001"
+
+#define QLOG_KIND_QUERY 1
+#define QLOG_KIND_ANSWER 2
+
+// longer messages are truncated to this many bytes
+#define QLOG_MAX_WIRE 1024
+
+typedef struct __attribute__((packed)) query_log_record {
+    uint64_t time;    // nanoseconds since the epoch
+    uint16_t size;    // bytes of wire data that follow
+    uint16_t length;  // length of the message
+    uint8_t kind;
+    uint8_t thread;
+} query_log_record;
+
+extern int query_log_level;
+
+bool query_log_open(const char *path, int level, unsigned sample);
+void query_log_close();
+
+void query_log_query(const uint8_t *wire, size_t size);
+void query_log_answer(const uint8_t *wire, size_t size);
+
+uint64_t query_log_dropped();
+
+#endif
@@ -0,0 +1,97 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+#include "rcu.h"
+#include "stats.h"
+#include <ldns/ldns.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+
+typedef struct rcu_reader {
+    _Atomic uint64_t epoch; // 0 outside of a read-side section
+    struct rcu_reader *next;
+} __attribute__((aligned(64))) rcu_reader;
+
+typedef struct rcu_callback {
+    void (*callback)(void *ptr);
+    void *ptr;
+    struct rcu_callback *next;
+} rcu_callback;
+
+static _Atomic uint64_t global_epoch = 1;
+static _Atomic(rcu_reader*) readers;
+static __thread rcu_reader *self;
+
+static pthread_mutex_t retire_mutex = PTHREAD_MUTEX_INITIALIZER;
+static rcu_callback *retired;
+
+static rcu_reader *rcu_register() {
+    // readers are never unregistered, threads live as long as the server
+    rcu_reader *reader = aligned_alloc(64, sizeof(rcu_reader));
+    atomic_init(&reader->epoch, 0);
+    reader->next = atomic_load(&readers);
+    while (!atomic_compare_exchange_weak(&readers, &reader->next, reader));
+    return self = reader;
+}
+
+void rcu_read_lock() {
+    rcu_reader *reader = self ? self : rcu_register();
+    // seq_cst store: the pointers published by writers are loaded after the epoch is visible
+    atomic_store(&reader->epoch, atomic_load_explicit(&global_epoch, memory_order_relaxed));
+}
+
+void rcu_read_unlock() {
+    atomic_store_explicit(&self->epoch, 0, memory_order_release);
+}
+
+void rcu_retire(void (*callback)(void *ptr), void *ptr) {
+    rcu_callback *cb = LDNS_MALLOC(rcu_callback);
+    cb->callback = callback;
+    cb->ptr = ptr;
+    pthread_mutex_lock(&retire_mutex);
+    cb->next = retired;
+    retired = cb;
+    pthread_mutex_unlock(&retire_mutex);
+}
+
+static void rcu_wait() {
+    uint64_t epoch = atomic_fetch_add(&global_epoch, 1) + 1;
+    for (rcu_reader *reader = atomic_load(&readers); reader; reader = reader->next) {
+        // the calling thread cannot be inside a read-side section it is waiting for
+        if (reader == self) continue;
+        uint64_t e;
+        while ((e = atomic_load(&reader->epoch)) && e < epoch) sched_yield();
+    }
+}
+
+void rcu_synchronize() {
+    bool pending = true;
+    while (pending) {
+        pthread_mutex_lock(&retire_mutex);
+        rcu_callback *cb = retired;
+        retired = NULL;
+        pthread_mutex_unlock(&retire_mutex);
+
+        uint64_t start = stats_now();
+        rcu_wait();
+        stats_time(STATS_RCU_GRACE, stats_now() - start);
+
+        while (cb) {
+            rcu_callback *next = cb->next;
+            cb->callback(cb->ptr);
+            LDNS_FREE(cb);
+            cb = next;
+        }
+
+        // callbacks may retire more data, which needs another grace period
+        pthread_mutex_lock(&retire_mutex);
+        pending = retired != NULL;
+        pthread_mutex_unlock(&retire_mutex);
+    }
+}
@@ -0,0 +1,31 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+#ifndef RCU_H
+#define RCU_H
+
+/*
+ * Epoch-based reclamation for the data published to the query threads.
+ *
+ * Readers bracket each access with rcu_read_lock/rcu_read_unlock, which
+ * only write to a per-thread slot and never block. Writers (serialized by
+ * update_mutex) publish new data with an atomic store, hand the old data to
+ * rcu_retire, and call rcu_synchronize, which waits until every reader that
+ * could still see the old data has left its read-side section and then
+ * runs the retired callbacks.
+ *
+ * Read-side sections must not be nested.
+ */
+
+void rcu_read_lock();
+void rcu_read_unlock();
+
+void rcu_retire(void (*callback)(void *ptr), void *ptr);
+void rcu_synchronize();
+
+#endif
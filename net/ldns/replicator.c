@@ -0,0 +1,429 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+#include "dns_server.h"
+#include "replicator.h"
+#include "rcu.h"
+#include "rrset_index.h"
+#include "zone_snapshot.h"
+#include "stats.h"
+#include "zone_sync.h"
+#include "git/common.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_RETRY_DELAY_MS 60000
+
+typedef struct dirty_zone {
+    ldns_rdf *apex;
+    ldns_rr_class rr_class;
+    ldns_zone *zone;  // snapshot being replicated, NULL if it was deleted
+    struct dirty_zone *next;
+} dirty_zone;
+
+static git_repository *repo;
+static const char *work_dir;
+static int debounce;
+static int pull_interval;  // s
+
+// the journal is appended and truncated with update_mutex held
+static const char *journal_path;
+static int journal_fd = -1;
+static off_t journal_size;
+
+static pthread_mutex_t replica_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t replica_cond;  // timed on CLOCK_MONOTONIC, as stats_now
+static dirty_zone *dirty;
+static uint64_t pending;
+static uint64_t oldest_pending;  // monotonic ns
+static replicator_stats stats;
+
+// with replica_mutex held
+static void mark_dirty(const ldns_rdf *apex, ldns_rr_class rr_class, uint64_t changes, uint64_t since) {
+    if (!pending || since < oldest_pending) oldest_pending = since;
+    pending += changes;
+
+    for (dirty_zone *d = dirty; d; d = d->next) {
+        if (d->rr_class == rr_class && dname_equal(d->apex, apex)) return;
+    }
+    dirty_zone *d = LDNS_CALLOC(dirty_zone, 1);
+    d->apex = ldns_rdf_clone(apex);
+    d->rr_class = rr_class;
+    d->next = dirty;
+    dirty = d;
+    pthread_cond_signal(&replica_cond);
+}
+
+static bool write_all(int fd, const uint8_t *data, size_t size) {
+    while (size) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool replicator_log(const ldns_pkt *update) {
+    ldns_rr *zone_rr = ldns_rr_list_rr(ldns_pkt_question(update), 0);
+    uint8_t *wire;
+    size_t size;
+    if (!zone_rr || ldns_pkt2wire(&wire, update, &size) != LDNS_STATUS_OK) return false;
+
+    uint8_t length[2];
+    ldns_write_uint16(length, size);
+    bool ok = size <= UINT16_MAX
+        && write_all(journal_fd, length, 2)
+        && write_all(journal_fd, wire, size)
+        && fdatasync(journal_fd) == 0;
+    LDNS_FREE(wire);
+
+    if (!ok) {
+        fprintf(stderr, "Cannot write replication journal %s: %s\n", journal_path, strerror(errno));
+        // drop a partial record, so that the next one starts at a record boundary
+        if (ftruncate(journal_fd, journal_size)) {}
+        return false;
+    }
+    journal_size += 2 + size;
+
+    pthread_mutex_lock(&replica_mutex);
+    mark_dirty(ldns_rr_owner(zone_rr), ldns_rr_get_class(zone_rr), 1, stats_now());
+    pthread_mutex_unlock(&replica_mutex);
+    return true;
+}
+
+// Remove the records up to position, keeping those appended since
+static bool journal_truncate(off_t position) {
+    size_t size = journal_size - position;
+    uint8_t *tail = LDNS_XMALLOC(uint8_t, size ? size : 1);
+    if (pread(journal_fd, tail, size, position) != (ssize_t) size) {
+        LDNS_FREE(tail);
+        return false;
+    }
+
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof tmp, "%s.tmp", journal_path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+    bool ok = fd >= 0 && write_all(fd, tail, size) && fsync(fd) == 0 && rename(tmp, journal_path) == 0;
+    LDNS_FREE(tail);
+    if (!ok) {
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    close(journal_fd);
+    journal_fd = fd;
+    journal_size = size;
+    return true;
+}
+
+/*
+ * Apply the journaled updates again, those of the zones with the given SOA
+ * records, or all of them if soas is NULL; with update_mutex held. Returns
+ * the offset past the last complete record.
+ */
+static off_t journal_apply(const ldns_rr_list *soas) {
+    off_t offset = 0;
+    uint8_t length[2];
+    while (pread(journal_fd, length, 2, offset) == 2) {
+        size_t size = ldns_read_uint16(length);
+        uint8_t *wire = LDNS_XMALLOC(uint8_t, size ? size : 1);
+        ldns_pkt *update = NULL;
+        bool ok = pread(journal_fd, wire, size, offset + 2) == (ssize_t) size
+            && ldns_wire2pkt(&update, wire, size) == LDNS_STATUS_OK;
+        LDNS_FREE(wire);
+        if (!ok) break;  // a torn record at the end
+
+        ldns_rr *zone_rr = ldns_rr_list_rr(ldns_pkt_question(update), 0);
+        bool selected = !soas;
+        for (size_t i = 0; zone_rr && !selected && i < ldns_rr_list_rr_count(soas); i++) {
+            ldns_rr *soa = ldns_rr_list_rr(soas, i);
+            selected = ldns_rr_get_class(soa) == ldns_rr_get_class(zone_rr) && dname_equal(ldns_rr_owner(soa), ldns_rr_owner(zone_rr));
+        }
+        if (selected) {
+            ldns_pkt *answer = ldns_pkt_new();
+            ldns_pkt_rcode rcode = handle_dns_update(update, answer);
+            ldns_pkt_free(answer);
+            if (rcode == LDNS_RCODE_NOERROR && zone_rr && !soas) {
+                pthread_mutex_lock(&replica_mutex);
+                mark_dirty(ldns_rr_owner(zone_rr), ldns_rr_get_class(zone_rr), 1, stats_now());
+                pthread_mutex_unlock(&replica_mutex);
+            }
+            if (rcode != LDNS_RCODE_NOERROR && soas) {
+                // its prerequisites no longer hold on the version of the other primaries
+                char *zone = ldns_rdf2str(ldns_rr_owner(zone_rr));
+                char *reason = ldns_pkt_rcode2str(rcode);
+                fprintf(stderr, "Journaled update of %s dropped on reload: %s\n", zone, reason);
+                LDNS_FREE(zone);
+                LDNS_FREE(reason);
+            }
+        }
+        ldns_pkt_free(update);
+        offset += 2 + size;
+    }
+    return offset;
+}
+
+static void journal_reapply(const ldns_rr_list *soas) {
+    journal_apply(soas);
+}
+
+static bool print_rr(const ldns_rr *rr, void *fp) {
+    ldns_rr_print(fp, rr);
+    return true;
+}
+
+static bool write_zone(const ldns_zone *zone, const char *path) {
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof tmp, "%s.tmp", path);
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) return false;
+
+    rrset_index *index = zone_snapshot_index(zone);
+
+    ldns_rr_print(fp, ldns_zone_soa(zone));
+    if (index) {
+        rrset_index_foreach(index, print_rr, fp);
+    } else {
+        for (size_t i = 0; i < ldns_zone_rr_count(zone); i++) print_rr(ldns_rr_list_rr(ldns_zone_rrs(zone), i), fp);
+    }
+
+    bool ok = fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    ok = fclose(fp) == 0 && ok;
+    return ok && rename(tmp, path) == 0;
+}
+
+static bool replicate_batch(dirty_zone *batch, uint64_t changes) {
+    git_index *index;
+    if (!check_lg2(git_repository_index(&index, repo), "Could not open repository index")) return false;
+
+    bool ok = true;
+    for (dirty_zone *d = batch; ok && d; d = d->next) {
+        char *apex = ldns_rdf2str(d->apex);
+        char name[PATH_MAX];
+        filename_t path;
+        snprintf(name, sizeof name, "%szone", apex);
+        set_filename(path, work_dir, name);
+        LDNS_FREE(apex);
+
+        if (d->zone) {
+            ok = write_zone(d->zone, path);
+            if (!ok) fprintf(stderr, "Cannot write %s: %s\n", path, strerror(errno));
+            ok = ok && check_lg2_extra(git_index_add_bypath(index, name), "Could not add to index", name);
+        } else if (unlink(path) == 0 || errno == ENOENT) {
+            git_index_remove_bypath(index, name);
+        }
+    }
+    ok = ok && check_lg2(git_index_write(index), "Could not write index");
+    git_index_free(index);
+    if (!ok) return false;
+
+    char message[64];
+    git_oid lease;
+    snprintf(message, sizeof message, "DNS update (%llu changes)", (unsigned long long) changes);
+    if (lg2_commit(repo, message, &lease) != GIT_OK) return false;
+    if (lg2_push(repo, &lease) == GIT_OK) return true;
+
+    // HEAD goes back to the commit the remote was expected at, otherwise the
+    // next commit would take this unpushed one as its lease
+    git_object *base;
+    if (check_lg2(git_object_lookup(&base, repo, &lease, GIT_OBJECT_COMMIT), "Cannot find the leased commit")) {
+        check_lg2(git_reset(repo, base, GIT_RESET_SOFT, NULL), "Cannot reset to the leased commit");
+        git_object_free(base);
+    }
+    return false;
+}
+
+static bool replicate() {
+    // take the pending changes and the zones they produced, consistently with the journal
+    update_mutex_lock();
+    pthread_mutex_lock(&replica_mutex);
+    dirty_zone *batch = dirty;
+    uint64_t changes = pending;
+    uint64_t since = oldest_pending;
+    dirty = NULL;
+    pending = 0;
+    pthread_mutex_unlock(&replica_mutex);
+
+    off_t position = journal_size;
+    rcu_read_lock();
+    for (dirty_zone *d = batch; d; d = d->next) {
+        ldns_zone *zone = zone_find(d->apex, d->rr_class);
+        // zone_find returns the closest enclosing zone
+        if (zone && dname_equal(ldns_rr_owner(ldns_zone_soa(zone)), d->apex)) d->zone = zone_snapshot_get(zone);
+    }
+    rcu_read_unlock();
+    update_mutex_unlock();
+
+    uint64_t start = stats_now();
+    bool ok = replicate_batch(batch, changes);
+    uint64_t end = stats_now();
+
+    if (ok) {
+        update_mutex_lock();
+        if (!journal_truncate(position)) {
+            // they would be replayed on restart, which only bumps the serials again
+            fprintf(stderr, "Cannot truncate replication journal %s: %s\n", journal_path, strerror(errno));
+        }
+        update_mutex_unlock();
+    }
+
+    pthread_mutex_lock(&replica_mutex);
+    if (ok) {
+        stats.batches++;
+        stats.changes += changes;
+        stats.last_batch = changes;
+        if (changes > stats.max_batch) stats.max_batch = changes;
+        stats.last_lag_ms = (end - since) / 1000000;
+        if (stats.last_lag_ms > stats.max_lag_ms) stats.max_lag_ms = stats.last_lag_ms;
+        stats.last_push_ms = (end - start) / 1000000;
+    } else {
+        stats.failures++;
+    }
+    while (batch) {
+        dirty_zone *d = batch;
+        batch = d->next;
+        if (!ok) {
+            mark_dirty(d->apex, d->rr_class, changes, since);
+            changes = 0;
+        }
+        if (d->zone) zone_snapshot_put(d->zone);
+        ldns_rdf_deep_free(d->apex);
+        LDNS_FREE(d);
+    }
+    pthread_mutex_unlock(&replica_mutex);
+    return ok;
+}
+
+static void wait_until(uint64_t due) {
+    struct timespec ts = { .tv_sec = due / 1000000000, .tv_nsec = due % 1000000000 };
+    pthread_cond_timedwait(&replica_cond, &replica_mutex, &ts);
+}
+
+static void *replicator_loop(void *arg) {
+    uint64_t backoff = 0, retry_at = 0;
+    uint64_t pull_at = stats_now() + (uint64_t) pull_interval * 1000000000;
+    pthread_mutex_lock(&replica_mutex);
+    while (true) {
+        if (!dirty && !pull_interval) {
+            pthread_cond_wait(&replica_cond, &replica_mutex);
+            continue;
+        }
+        if (!dirty) {
+            // the working tree is only reset when there is nothing to commit
+            if (stats_now() < pull_at) {
+                wait_until(pull_at);
+                continue;
+            }
+            pthread_mutex_unlock(&replica_mutex);
+            zone_sync(repo, work_dir, journal_reapply);
+            pthread_mutex_lock(&replica_mutex);
+            pull_at = stats_now() + (uint64_t) pull_interval * 1000000000;
+            continue;
+        }
+
+        // wait for the window to close, changes arriving meanwhile join the batch
+        uint64_t due = oldest_pending + (uint64_t) debounce * 1000000;
+        if (due < retry_at) due = retry_at;
+        if (stats_now() < due) {
+            wait_until(due);
+            continue;
+        }
+
+        // after a failed push, another primary may have pushed first: its
+        // changes are loaded, with ours applied again on top, before retrying
+        pthread_mutex_unlock(&replica_mutex);
+        bool ok = (!backoff || zone_sync(repo, work_dir, journal_reapply)) && replicate();
+        pthread_mutex_lock(&replica_mutex);
+
+        if (ok) {
+            backoff = 0;
+            retry_at = 0;
+        } else {
+            backoff = backoff ? backoff * 2 : debounce > 0 ? debounce : 1;
+            if (backoff > MAX_RETRY_DELAY_MS) backoff = MAX_RETRY_DELAY_MS;
+            retry_at = stats_now() + backoff * 1000000;
+        }
+    }
+    return NULL;
+}
+
+static bool journal_replay() {
+    update_mutex_lock();
+    off_t offset = journal_apply(NULL);
+    update_mutex_unlock();
+
+    if (offset) fprintf(stderr, "Replayed %lld bytes of replication journal\n", (long long) offset);
+    journal_size = offset;
+    return ftruncate(journal_fd, offset) == 0;
+}
+
+static void render_stats(FILE *out) {
+    replicator_stats rs;
+    replicator_get_stats(&rs);
+    fprintf(out, "# TYPE dns_replication_pending_changes gauge\n");
+    fprintf(out, "dns_replication_pending_changes %llu\n", (unsigned long long) rs.pending);
+    fprintf(out, "# TYPE dns_replication_lag_seconds gauge\n");
+    fprintf(out, "dns_replication_lag_seconds %.3f\n", rs.lag_ms / 1e3);
+    fprintf(out, "# TYPE dns_replication_pushes_total counter\n");
+    fprintf(out, "dns_replication_pushes_total %llu\n", (unsigned long long) rs.batches);
+    fprintf(out, "# TYPE dns_replication_changes_total counter\n");
+    fprintf(out, "dns_replication_changes_total %llu\n", (unsigned long long) rs.changes);
+    fprintf(out, "# TYPE dns_replication_failures_total counter\n");
+    fprintf(out, "dns_replication_failures_total %llu\n", (unsigned long long) rs.failures);
+    fprintf(out, "# TYPE dns_replication_batch_changes gauge\n");
+    fprintf(out, "dns_replication_batch_changes{batch=\"last\"} %llu\n", (unsigned long long) rs.last_batch);
+    fprintf(out, "dns_replication_batch_changes{batch=\"max\"} %llu\n", (unsigned long long) rs.max_batch);
+    fprintf(out, "# TYPE dns_replication_batch_lag_seconds gauge\n");
+    fprintf(out, "dns_replication_batch_lag_seconds{batch=\"last\"} %.3f\n", rs.last_lag_ms / 1e3);
+    fprintf(out, "dns_replication_batch_lag_seconds{batch=\"max\"} %.3f\n", rs.max_lag_ms / 1e3);
+    fprintf(out, "# TYPE dns_replication_push_seconds gauge\n");
+    fprintf(out, "dns_replication_push_seconds %.3f\n", rs.last_push_ms / 1e3);
+}
+
+bool replicator_start(const char *dir, const char *journal, int delay, int pull) {
+    work_dir = dir;
+    journal_path = journal;
+    debounce = delay;
+    pull_interval = pull;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&replica_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (!check_lg2_extra(git_repository_open(&repo, dir), "Could not open repository", dir)) return false;
+
+    journal_fd = open(journal, O_RDWR | O_CREAT | O_APPEND, 0600);
+    if (journal_fd < 0) {
+        fprintf(stderr, "Cannot open replication journal %s: %s\n", journal, strerror(errno));
+        return false;
+    }
+    if (!journal_replay()) {
+        fprintf(stderr, "Cannot replay replication journal %s: %s\n", journal, strerror(errno));
+        return false;
+    }
+
+    stats_add_source(render_stats);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, replicator_loop, NULL)) return false;
+    pthread_detach(thread);
+    return true;
+}
+
+void replicator_get_stats(replicator_stats *out) {
+    pthread_mutex_lock(&replica_mutex);
+    *out = stats;
+    out->pending = pending;
+    out->lag_ms = pending ? (stats_now() - oldest_pending) / 1000000 : 0;
+    pthread_mutex_unlock(&replica_mutex);
+}
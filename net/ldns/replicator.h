@@ -0,0 +1,64 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+#ifndef REPLICATOR_H
+#define REPLICATOR_H
+
+#include <ldns/ldns.h>
+#include <stdint.h>
+
+/*
+ * Asynchronous replication of dynamic updates to the git repository, in
+ * MULTI_PRIMARY mode.
+ *
+ * An update is acknowledged once it is applied in memory and its message
+ * is appended to a local journal file and synced (replicator_log, called
+ * with update_mutex held). A background thread waits `delay` milliseconds
+ * after the oldest pending change, so that the changes arriving meanwhile
+ * are coalesced, then writes the changed zones into the working tree and
+ * makes a single commit and push for all of them. After a successful push
+ * the replicated records are dropped from the journal; after a failure the
+ * changes stay pending and the push is retried with backoff. Before each
+ * retry, HEAD is put back on the commit the remote was expected at and the
+ * repository is synced, as below, so that the commits of another primary
+ * that pushed first are loaded, with the pending updates applied again on
+ * top, and the retry takes the new upstream commit as its lease.
+ *
+ * Every `pull` seconds, while no change is pending, the same thread fetches
+ * the repository and reloads the zones changed by the other primaries (see
+ * zone_sync.h); the updates acknowledged meanwhile to those zones are
+ * applied again from the journal. A pull of 0 disables it.
+ *
+ * replicator_start replays the journal on top of the zones already loaded,
+ * so updates acknowledged but not pushed before a restart are not lost.
+ * Zones are written to <dir>/<apex>zone, e.g. example.com.zone.
+ *
+ * The statistics are also served by the stats socket (dns_replication_*).
+ */
+
+typedef struct replicator_stats {
+    uint64_t pending;       // changes not pushed yet
+    uint64_t lag_ms;        // age of the oldest pending change
+    uint64_t batches;       // successful pushes
+    uint64_t changes;       // changes pushed
+    uint64_t last_batch;
+    uint64_t max_batch;
+    uint64_t last_lag_ms;   // age of the oldest change of the last push
+    uint64_t max_lag_ms;
+    uint64_t last_push_ms;  // time spent writing, committing and pushing
+    uint64_t failures;
+} replicator_stats;
+
+#define REPLICA_MAX_DELAY 60000  // ms
+#define REPLICA_MAX_PULL 86400   // s
+
+bool replicator_start(const char *dir, const char *journal, int delay, int pull);
+bool replicator_log(const ldns_pkt *update);
+void replicator_get_stats(replicator_stats *stats);
+
+#endif
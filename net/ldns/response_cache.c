@@ -0,0 +1,190 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+#include "response_cache.h"
+#include "rrset_index.h"
+#include "zone_table.h"
+#include "rcu.h"
+#include "fnv.h"
+#include "dns_fast.h"
+#include "arena.h"
+#include <ctype.h>
+#include <stdatomic.h>
+
+#define CACHE_ENTRIES 4096
+#define ZONE_SLOTS 4096
+
+typedef struct cache_entry {
+    uint8_t key[LDNS_MAX_DOMAINLEN + 10];
+    size_t keylen;
+    uint32_t slot;
+    uint32_t slot_gen;
+    uint32_t table_gen;
+    uint8_t *answer;
+    size_t answer_size;
+    size_t capacity;
+} cache_entry;
+
+static __thread cache_entry *cache;
+
+// slot 0 is used by answers that were not rendered from any zone
+static _Atomic uint32_t zone_gens[ZONE_SLOTS];
+static _Atomic uint32_t table_gen;
+
+static uint32_t zone_slot(const ldns_zone *zone) {
+    if (!zone) return 0;
+    return 1 + dname_hash(ldns_rr_owner(ldns_zone_soa(zone))) % (ZONE_SLOTS - 1);
+}
+
+bool response_cache_parse(const uint8_t *wire, size_t size, bool tcp, cache_query *query) {
+    if (size < LDNS_HEADER_SIZE) return false;
+
+    // QR=0, opcode QUERY, one question, no answer and authority records
+    if (wire[2] & 0xF8) return false;
+    if (ldns_read_uint16(wire + 4) != 1) return false;
+    if (ldns_read_uint16(wire + 6) || ldns_read_uint16(wire + 8)) return false;
+    uint16_t arcount = ldns_read_uint16(wire + 10);
+    if (arcount > 1) return false;
+
+    size_t pos = LDNS_HEADER_SIZE;
+    size_t len = 0;
+    while (pos < size && wire[pos]) {
+        uint8_t label = wire[pos];
+        if (label > 63 || pos + label + 1 >= size || len + label + 1 >= LDNS_MAX_DOMAINLEN) return false;
+        query->key[len++] = label;
+        for (uint8_t i = 1; i <= label; i++) {
+            query->key[len++] = tolower(wire[pos + i]);
+        }
+        pos += label + 1;
+    }
+    if (pos + 5 > size) return false;
+    query->key[len++] = 0;
+    pos++;
+
+    query->qname_len = len;
+    query->qtype = ldns_read_uint16(wire + pos);
+    query->qclass = ldns_read_uint16(wire + pos + 2);
+    pos += 4;
+
+    // zone transfers are streamed over TCP
+    if (query->qtype == LDNS_RR_TYPE_AXFR || query->qtype == LDNS_RR_TYPE_IXFR) return false;
+
+    uint8_t edns = 0;
+    uint16_t payload = UDP_PAYLOAD_MIN;
+    if (arcount) {
+        // OPT record with root owner name, and nothing after it
+        if (pos + 11 > size || wire[pos] || ldns_read_uint16(wire + pos + 1) != LDNS_RR_TYPE_OPT) return false;
+        uint8_t version = wire[pos + 6];
+        uint16_t flags = ldns_read_uint16(wire + pos + 7);
+        uint16_t rdlen = ldns_read_uint16(wire + pos + 9);
+        if (pos + 11 + rdlen != size) return false;
+        edns = EDNS_PRESENT | (flags & 0x8000 ? EDNS_DO : 0) | (version ? EDNS_VERSION : 0);
+        payload = ldns_read_uint16(wire + pos + 3);
+        if (payload < UDP_PAYLOAD_MIN) payload = UDP_PAYLOAD_MIN;
+        if (payload > udp_payload) payload = udp_payload;
+    } else if (pos != size) {
+        return false;
+    }
+
+    memcpy(query->key + len, wire + LDNS_HEADER_SIZE + query->qname_len, 4);
+    query->key[len + 4] = query->edns = edns;
+    query->max_size = tcp ? UINT16_MAX : payload;
+    ldns_write_uint16(query->key + len + 5, query->max_size);
+    query->keylen = len + 7;
+
+    query->hash = fnv32(FNV32_OFFSET, query->key, query->keylen);
+    return true;
+}
+
+static cache_entry *cache_lookup(const cache_query *query) {
+    if (!cache) cache = LDNS_CALLOC(cache_entry, CACHE_ENTRIES);
+    return &cache[query->hash % CACHE_ENTRIES];
+}
+
+static void patch_answer(const cache_query *query, const uint8_t *wire, uint8_t *answer) {
+    // message ID and the question name as sent by the client
+    memcpy(answer, wire, 2);
+    memcpy(answer + LDNS_HEADER_SIZE, wire + LDNS_HEADER_SIZE, query->qname_len);
+}
+
+static const cache_entry *cache_hit(const cache_query *query) {
+    cache_entry *entry = cache_lookup(query);
+    if (!entry->answer || entry->keylen != query->keylen || memcmp(entry->key, query->key, query->keylen)) {
+        return NULL;
+    }
+
+    if (entry->table_gen != atomic_load_explicit(&table_gen, memory_order_acquire)
+     || entry->slot_gen != atomic_load_explicit(&zone_gens[entry->slot], memory_order_acquire)) {
+        return NULL;
+    }
+    return entry;
+}
+
+bool response_cache_get(const cache_query *query, const uint8_t *wire, uint8_t **outbuf, size_t *answer_size) {
+    const cache_entry *entry = cache_hit(query);
+    if (!entry) return false;
+
+    *outbuf = arena_alloc(entry->answer_size);
+    memcpy(*outbuf, entry->answer, entry->answer_size);
+    *answer_size = entry->answer_size;
+    patch_answer(query, wire, *outbuf);
+    return true;
+}
+
+size_t response_cache_copy(const cache_query *query, const uint8_t *wire, uint8_t *buf, size_t size) {
+    const cache_entry *entry = cache_hit(query);
+    if (!entry || entry->answer_size > size) return 0;
+
+    memcpy(buf, entry->answer, entry->answer_size);
+    patch_answer(query, wire, buf);
+    return entry->answer_size;
+}
+
+void response_cache_prepare(cache_query *query) {
+    // generations are read before answering, so that an answer rendered
+    // from a zone that is replaced meanwhile is never seen as current
+    query->table_gen = atomic_load_explicit(&table_gen, memory_order_acquire);
+
+    ldns_rdf qname = { ._size = query->qname_len, ._type = LDNS_RDF_TYPE_DNAME, ._data = query->key };
+    rcu_read_lock();
+    query->slot = zone_slot(zone_table_find(&qname, query->qclass));
+    rcu_read_unlock();
+    query->slot_gen = atomic_load_explicit(&zone_gens[query->slot], memory_order_acquire);
+}
+
+void response_cache_put(const cache_query *query, const uint8_t *wire, uint8_t *answer, size_t answer_size) {
+    // the question must have been rendered uncompressed right after the header
+    if (answer_size < LDNS_HEADER_SIZE + query->qname_len + 4) return;
+    if (ldns_read_uint16(answer + 4) != 1) return;
+    for (size_t i = 0; i < query->qname_len; i++) {
+        if (tolower(answer[LDNS_HEADER_SIZE + i]) != query->key[i]) return;
+    }
+
+    patch_answer(query, wire, answer);
+
+    cache_entry *entry = cache_lookup(query);
+    if (entry->capacity < answer_size) {
+        entry->answer = LDNS_XREALLOC(entry->answer, uint8_t, answer_size);
+        entry->capacity = answer_size;
+    }
+    memcpy(entry->answer, answer, answer_size);
+    entry->answer_size = answer_size;
+    memcpy(entry->key, query->key, query->keylen);
+    entry->keylen = query->keylen;
+    entry->slot = query->slot;
+    entry->slot_gen = query->slot_gen;
+    entry->table_gen = query->table_gen;
+}
+
+void response_cache_invalidate_zone(const ldns_zone *zone) {
+    atomic_fetch_add_explicit(&zone_gens[zone_slot(zone)], 1, memory_order_release);
+}
+
+void response_cache_invalidate_all() {
+    atomic_fetch_add_explicit(&table_gen, 1, memory_order_release);
+}
@@ -0,0 +1,68 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include <ldns/ldns.h>
+
+/*
+ * Cache of rendered responses, keyed by the normalized question (lowercase
+ * qname, qtype, qclass) and the EDNS parameters of the query. A hit copies
+ * the cached wire answer, patches the message ID and copies the question
+ * name from the query, so that its case is preserved. response_cache_copy
+ * does the same into a buffer provided by the caller, and returns the size
+ * of the answer, or 0 on a miss or if the answer does not fit.
+ *
+ * Each thread has its own cache. Entries record the generation of the zone
+ * they were rendered from; zone_replace bumps the generation of that zone,
+ * and zone_add/zone_del invalidate everything.
+ *
+ * response_cache_put also patches the question name of the answer it is
+ * given, which ldns renders in canonical (lowercase) form.
+ *
+ * Only plain queries are cached: opcode QUERY, one question, no answer or
+ * authority records, and at most an OPT record in the additional section.
+ *
+ * response_cache_parse also sets the largest answer the client accepts:
+ * over UDP, its EDNS payload size (512 without EDNS) capped at udp_payload,
+ * and 64 KB over TCP. It is part of the key, since answers are truncated
+ * to it.
+ */
+
+#define EDNS_PRESENT 1
+#define EDNS_DO 2
+#define EDNS_VERSION 4
+
+typedef struct cache_query {
+    uint8_t key[LDNS_MAX_DOMAINLEN + 10];
+    size_t keylen;
+    size_t qname_len;
+    uint16_t qtype;
+    uint16_t qclass;
+    uint8_t edns;
+    uint16_t max_size;
+    uint32_t hash;
+
+    // captured by response_cache_prepare before the query is answered
+    uint32_t slot;
+    uint32_t slot_gen;
+    uint32_t table_gen;
+} cache_query;
+
+bool response_cache_parse(const uint8_t *wire, size_t size, bool tcp, cache_query *query);
+// the copy is allocated from the arena of the calling thread
+bool response_cache_get(const cache_query *query, const uint8_t *wire, uint8_t **outbuf, size_t *answer_size);
+size_t response_cache_copy(const cache_query *query, const uint8_t *wire, uint8_t *buf, size_t size);
+void response_cache_prepare(cache_query *query);
+void response_cache_put(const cache_query *query, const uint8_t *wire, uint8_t *answer, size_t answer_size);
+
+void response_cache_invalidate_zone(const ldns_zone *zone);
+void response_cache_invalidate_all();
+
+#endif
@@ -0,0 +1,126 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+#include "rrl.h"
+#include "fnv.h"
+#include "stats.h"
+#include <ldns/ldns.h>
+#include <netinet/in.h>
+#include <stdatomic.h>
+
+#define CLASS_ANSWER 0
+#define CLASS_NXDOMAIN 1
+#define CLASS_ERROR 2
+
+// tokens are kept in thousandths of an answer
+#define TOKEN 1000
+
+typedef struct rrl_bucket {
+    _Atomic uint32_t tag;     // 0 for an unused bucket
+    _Atomic uint32_t stamp;   // ms
+    _Atomic int32_t tokens;
+    _Atomic uint32_t limited;
+} rrl_bucket;
+
+bool rrl_enabled;
+
+static rrl_bucket *table;
+static size_t mask;
+static int32_t rates[3];
+static unsigned slip;
+
+bool rrl_init(const rrl_options *options) {
+    if (!options->rate) return true;
+    size_t size = 1;
+    while (size < options->size && size < RRL_MAX_TABLE) size <<= 1;
+    table = aligned_alloc(64, size * sizeof(rrl_bucket));
+    if (!table) {
+        fprintf(stderr, "Cannot allocate the rate limiting table (%zu buckets)\n", size);
+        return false;
+    }
+    memset(table, 0, size * sizeof(rrl_bucket));
+    mask = size - 1;
+    rates[CLASS_ANSWER] = options->rate;
+    rates[CLASS_NXDOMAIN] = options->nxdomain_rate ? options->nxdomain_rate : options->rate;
+    rates[CLASS_ERROR] = options->error_rate ? options->error_rate : options->rate;
+    slip = options->slip;
+    rrl_enabled = true;
+    return true;
+}
+
+/* End of the question, which is never compressed, or 0 if malformed */
+static size_t question_end(const uint8_t *wire, size_t size) {
+    size_t pos = LDNS_HEADER_SIZE;
+    while (pos < size && wire[pos] && wire[pos] < 64) pos += wire[pos] + 1;
+    return pos + 5 <= size && !wire[pos] ? pos + 5 : 0;
+}
+
+int rrl_check(const struct sockaddr_storage *addr, const uint8_t *answer, size_t size) {
+    if (size < LDNS_HEADER_SIZE) return RRL_SEND;
+
+    uint64_t hash = FNV_OFFSET;
+    if (addr->ss_family == AF_INET) {
+        uint32_t net = ((const struct sockaddr_in*) addr)->sin_addr.s_addr & htonl(0xffffff00);
+        hash = fnv(hash, (const uint8_t*) &net, 4);
+    } else if (addr->ss_family == AF_INET6) {
+        hash = fnv(hash, ((const struct sockaddr_in6*) addr)->sin6_addr.s6_addr, 7);
+    }
+
+    int rcode = LDNS_RCODE_WIRE(answer);
+    uint8_t class = rcode == LDNS_RCODE_NOERROR ? CLASS_ANSWER : rcode == LDNS_RCODE_NXDOMAIN ? CLASS_NXDOMAIN : CLASS_ERROR;
+    hash = fnv(hash, &class, 1);
+    size_t qend;
+    if (class == CLASS_ANSWER && (qend = question_end(answer, size))) {
+        // qname (in any case) and qtype
+        for (size_t i = LDNS_HEADER_SIZE; i < qend - 2; i++) {
+            hash = fnv_byte(hash, answer[i] | (answer[i] >= 'A' && answer[i] <= 'Z' ? 0x20 : 0));
+        }
+    }
+
+    rrl_bucket *b = &table[hash & mask];
+    uint32_t tag = (hash >> 32) | 1;
+    uint32_t now = stats_now_coarse() / 1000000;
+    int32_t rate = rates[class];
+    int32_t full = rate * TOKEN;
+
+    if (atomic_load_explicit(&b->tag, memory_order_relaxed) != tag) {
+        atomic_store_explicit(&b->tag, tag, memory_order_relaxed);
+        atomic_store_explicit(&b->stamp, now, memory_order_relaxed);
+        atomic_store_explicit(&b->tokens, full - TOKEN, memory_order_relaxed);
+        atomic_store_explicit(&b->limited, 0, memory_order_relaxed);
+        stats_rrl(RRL_SEND);
+        return RRL_SEND;
+    }
+
+    uint32_t elapsed = now - atomic_load_explicit(&b->stamp, memory_order_relaxed);
+    int64_t tokens = atomic_load_explicit(&b->tokens, memory_order_relaxed) + (int64_t) elapsed * rate;
+    if (tokens > full) tokens = full;
+    tokens -= TOKEN;
+    // the debt is capped, so that a client that stops gets answers again within a second
+    if (tokens < -full) tokens = -full;
+    atomic_store_explicit(&b->stamp, now, memory_order_relaxed);
+    atomic_store_explicit(&b->tokens, tokens, memory_order_relaxed);
+
+    int action = RRL_SEND;
+    if (tokens < 0) {
+        uint32_t limited = atomic_load_explicit(&b->limited, memory_order_relaxed) + 1;
+        atomic_store_explicit(&b->limited, limited, memory_order_relaxed);
+        action = slip && limited % slip == 0 ? RRL_SLIP : RRL_DROP;
+    }
+    stats_rrl(action);
+    return action;
+}
+
+size_t rrl_truncate(uint8_t *answer, size_t size) {
+    size_t qend = question_end(answer, size);
+    if (!qend) qend = LDNS_HEADER_SIZE;
+    answer[2] |= 0x02;  // TC
+    memset(answer + 6, 0, 6);
+    if (qend == LDNS_HEADER_SIZE) memset(answer + 4, 0, 2);
+    return qend;
+}
@@ -0,0 +1,58 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+#ifndef RRL_H
+#define RRL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/socket.h>
+
+/*
+ * Response rate limiting for UDP, against reflection and floods. TCP is
+ * not limited, since its source addresses cannot be spoofed.
+ *
+ * Answers are accounted in token buckets keyed by the client network (/24
+ * for IPv4, /56 for IPv6) and the class of the response: positive answers
+ * per qname and qtype, NXDOMAIN, and errors. Each bucket is refilled at
+ * the rate of its class and holds at most one second worth of answers.
+ * An answer that finds its bucket empty is dropped, except that one in
+ * every `slip` of them is replaced with an empty truncated answer (TC=1),
+ * so that legitimate clients behind the same network retry over TCP.
+ *
+ * The buckets live in a fixed-size open table, four to a cache line; a
+ * bucket is reclaimed by the next network and class that hash to it.
+ * Threads update the buckets without locking: concurrent answers to the
+ * same bucket may lose an update, which only makes the limit lenient.
+ */
+
+// so that a second worth of tokens fits in a bucket
+#define RRL_MAX_RATE 1000000
+#define RRL_MAX_TABLE (1 << 26)
+
+#define RRL_SEND 0
+#define RRL_DROP 1
+#define RRL_SLIP 2
+
+typedef struct rrl_options {
+    unsigned rate;           // answers per second up to RRL_MAX_RATE, 0 disables rate limiting
+    unsigned nxdomain_rate;  // 0 for the same as rate
+    unsigned error_rate;     // 0 for the same as rate
+    unsigned slip;           // 0 never slips, 1 always slips
+    size_t size;             // buckets, rounded up to a power of two, up to RRL_MAX_TABLE
+} rrl_options;
+
+extern bool rrl_enabled;
+
+/* Returns false, with a message, if the table cannot be allocated */
+bool rrl_init(const rrl_options *options);
+int rrl_check(const struct sockaddr_storage *addr, const uint8_t *answer, size_t size);
+size_t rrl_truncate(uint8_t *answer, size_t size);
+
+#endif
@@ -0,0 +1,418 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+#include "rrset_index.h"
+#include "rcu.h"
+#include "fnv.h"
+#include <ctype.h>
+#include <pthread.h>
+
+#define PAGE_BUCKETS 64
+
+typedef struct rrset_page {
+    _Atomic int refs;
+    rrset_node *buckets[PAGE_BUCKETS];
+} rrset_page;
+
+struct rrset_index {
+    size_t mask;
+    size_t size;
+    // buckets in pages of PAGE_BUCKETS, which copies share until they change
+    rrset_page **pages;
+};
+
+#define INITIAL_BUCKETS PAGE_BUCKETS
+
+uint32_t dname_hash(const ldns_rdf *dname) {
+    // FNV-1a over the lowercased wire format. Label lengths are < 64,
+    // so they are not affected by tolower.
+    uint32_t hash = FNV32_OFFSET;
+    const uint8_t *data = ldns_rdf_data(dname);
+    for (size_t i = 0; i < ldns_rdf_size(dname); i++) hash = fnv32_byte(hash, tolower(data[i]));
+    return hash;
+}
+
+bool dname_equal(const ldns_rdf *a, const ldns_rdf *b) {
+    size_t size = ldns_rdf_size(a);
+    if (size != ldns_rdf_size(b)) return false;
+    const uint8_t *da = ldns_rdf_data(a);
+    const uint8_t *db = ldns_rdf_data(b);
+    for (size_t i = 0; i < size; i++) {
+        if (da[i] != db[i] && tolower(da[i]) != tolower(db[i])) return false;
+    }
+    return true;
+}
+
+static void rrset_decref(rrset *set) {
+    if (atomic_fetch_sub(&set->refs, 1) == 1) {
+        ldns_rr_list_deep_free(set->rrs);
+        LDNS_FREE(set);
+    }
+}
+
+static void node_decref(rrset_node *node) {
+    // the next node is referenced by this one, release the chain iteratively
+    while (node && atomic_fetch_sub(&node->refs, 1) == 1) {
+        rrset_node *next = node->next;
+        for (size_t i = 0; i < node->count; i++) rrset_decref(node->rrsets[i]);
+        LDNS_FREE(node->rrsets);
+        ldns_rdf_deep_free(node->owner);
+        LDNS_FREE(node);
+        node = next;
+    }
+}
+
+static void page_decref(rrset_page *page) {
+    if (atomic_fetch_sub(&page->refs, 1) == 1) {
+        for (size_t i = 0; i < PAGE_BUCKETS; i++) node_decref(page->buckets[i]);
+        LDNS_FREE(page);
+    }
+}
+
+static rrset_page *page_new(void) {
+    rrset_page *page = LDNS_CALLOC(rrset_page, 1);
+    atomic_init(&page->refs, 1);
+    return page;
+}
+
+// copies of shared parts, which take a reference to everything they point to
+
+static rrset_page *page_copy(const rrset_page *page) {
+    rrset_page *copy = page_new();
+    for (size_t i = 0; i < PAGE_BUCKETS; i++) {
+        copy->buckets[i] = page->buckets[i];
+        if (copy->buckets[i]) atomic_fetch_add(&copy->buckets[i]->refs, 1);
+    }
+    return copy;
+}
+
+static rrset_node *node_copy(const rrset_node *node, rrset_node *next) {
+    rrset_node *copy = LDNS_MALLOC(rrset_node);
+    copy->owner = ldns_rdf_clone(node->owner);
+    copy->hash = node->hash;
+    copy->count = node->count;
+    copy->rrsets = LDNS_XMALLOC(rrset*, node->count ? node->count : 1);
+    for (size_t i = 0; i < node->count; i++) {
+        copy->rrsets[i] = node->rrsets[i];
+        atomic_fetch_add(&copy->rrsets[i]->refs, 1);
+    }
+    copy->next = next;
+    if (next) atomic_fetch_add(&next->refs, 1);
+    atomic_init(&copy->refs, 1);
+    return copy;
+}
+
+static rrset *rrset_new(ldns_rr_type type, ldns_rr_class rr_class, ldns_rr_list *rrs) {
+    rrset *set = LDNS_MALLOC(rrset);
+    set->type = type;
+    set->rr_class = rr_class;
+    set->rrs = rrs;
+    atomic_init(&set->refs, 1);
+    return set;
+}
+
+/*
+ * Make the bucket of hash private to this index, and the nodes of its
+ * chain up to the one of owner. Returns the link to that node, or to the
+ * end of the chain. Everything reachable from a shared part is shared as
+ * well, and is reached with a reference count above 1 once the part that
+ * leads to it has been copied.
+ */
+static rrset_node **chain_writable(rrset_index *index, const ldns_rdf *owner, uint32_t hash) {
+    size_t bucket = hash & index->mask;
+    rrset_page **ppage = &index->pages[bucket / PAGE_BUCKETS];
+    if (atomic_load(&(*ppage)->refs) > 1) {
+        rrset_page *page = *ppage;
+        *ppage = page_copy(page);
+        page_decref(page);
+    }
+
+    rrset_node **pnode = &(*ppage)->buckets[bucket % PAGE_BUCKETS];
+    while (*pnode) {
+        rrset_node *node = *pnode;
+        if (atomic_load(&node->refs) > 1) {
+            *pnode = node_copy(node, node->next);
+            node_decref(node);
+        }
+        node = *pnode;
+        if (node->hash == hash && dname_equal(node->owner, owner)) break;
+        pnode = &node->next;
+    }
+    return pnode;
+}
+
+static rrset *rrset_writable(rrset_node *node, size_t i) {
+    rrset *set = node->rrsets[i];
+    if (atomic_load(&set->refs) > 1) {
+        node->rrsets[i] = rrset_new(set->type, set->rr_class, ldns_rr_list_clone(set->rrs));
+        rrset_decref(set);
+    }
+    return node->rrsets[i];
+}
+
+static void rrset_index_grow(rrset_index *index) {
+    size_t mask = index->mask * 2 + 1;
+    size_t npages = (index->mask + 1) / PAGE_BUCKETS;
+    rrset_page **pages = LDNS_XMALLOC(rrset_page*, (mask + 1) / PAGE_BUCKETS);
+    for (size_t i = 0; i < (mask + 1) / PAGE_BUCKETS; i++) pages[i] = page_new();
+
+    for (size_t p = 0; p < npages; p++) {
+        rrset_page *page = index->pages[p];
+        bool page_shared = atomic_load(&page->refs) > 1;
+        for (size_t b = 0; b < PAGE_BUCKETS; b++) {
+            // private nodes are relinked, shared ones (and whatever follows them) are copied
+            bool shared = page_shared;
+            rrset_node *node = page->buckets[b];
+            rrset_node *first_shared = NULL;
+            while (node) {
+                rrset_node *next = node->next;
+                if (!shared && atomic_load(&node->refs) > 1) {
+                    shared = true;
+                    first_shared = node;
+                }
+                rrset_node *moved = shared ? node_copy(node, NULL) : node;
+                rrset_node **pbucket = &pages[(node->hash & mask) / PAGE_BUCKETS]->buckets[(node->hash & mask) % PAGE_BUCKETS];
+                moved->next = *pbucket;
+                *pbucket = moved;
+                node = next;
+            }
+            if (first_shared) node_decref(first_shared);
+            if (!page_shared) page->buckets[b] = NULL;
+        }
+        if (page_shared) page_decref(page); else LDNS_FREE(page);
+    }
+
+    LDNS_FREE(index->pages);
+    index->pages = pages;
+    index->mask = mask;
+}
+
+rrset_index *rrset_index_new(ldns_zone *zone) {
+    rrset_index *index = LDNS_MALLOC(rrset_index);
+    index->mask = INITIAL_BUCKETS - 1;
+    index->size = 0;
+    index->pages = LDNS_XMALLOC(rrset_page*, 1);
+    index->pages[0] = page_new();
+
+    if (zone) {
+        ldns_rr_list *rrs = ldns_zone_rrs(zone);
+        for (size_t i = 0; i < ldns_rr_list_rr_count(rrs); i++) {
+            rrset_index_add(index, ldns_rr_list_rr(rrs, i));
+        }
+        ldns_rr_list_set_rr_count(rrs, 0);
+    }
+    return index;
+}
+
+rrset_index *rrset_index_copy(const rrset_index *index) {
+    size_t npages = (index->mask + 1) / PAGE_BUCKETS;
+    rrset_index *copy = LDNS_MALLOC(rrset_index);
+    copy->mask = index->mask;
+    copy->size = index->size;
+    copy->pages = LDNS_XMALLOC(rrset_page*, npages);
+    for (size_t i = 0; i < npages; i++) {
+        copy->pages[i] = index->pages[i];
+        atomic_fetch_add(&copy->pages[i]->refs, 1);
+    }
+    return copy;
+}
+
+void rrset_index_free(rrset_index *index) {
+    if (!index) return;
+    for (size_t i = 0; i < (index->mask + 1) / PAGE_BUCKETS; i++) {
+        page_decref(index->pages[i]);
+    }
+    LDNS_FREE(index->pages);
+    LDNS_FREE(index);
+}
+
+const rrset_node *rrset_index_find(const rrset_index *index, const ldns_rdf *owner) {
+    uint32_t hash = dname_hash(owner);
+    size_t bucket = hash & index->mask;
+    const rrset_node *node = index->pages[bucket / PAGE_BUCKETS]->buckets[bucket % PAGE_BUCKETS];
+    while (node && (node->hash != hash || !dname_equal(node->owner, owner))) {
+        node = node->next;
+    }
+    return node;
+}
+
+const ldns_rr_list *rrset_node_get(const rrset_node *node, ldns_rr_type type, ldns_rr_class rr_class) {
+    if (!node) return NULL;
+    for (size_t i = 0; i < node->count; i++) {
+        if (node->rrsets[i]->type == type && node->rrsets[i]->rr_class == rr_class) {
+            return node->rrsets[i]->rrs;
+        }
+    }
+    return NULL;
+}
+
+void rrset_index_add(rrset_index *index, ldns_rr *rr) {
+    ldns_rdf *owner = ldns_rr_owner(rr);
+    uint32_t hash = dname_hash(owner);
+    rrset_node **pnode = chain_writable(index, owner, hash);
+    rrset_node *node = *pnode;
+
+    if (!node) {
+        node = LDNS_MALLOC(rrset_node);
+        node->owner = ldns_rdf_clone(owner);
+        ldns_dname2canonical(node->owner);
+        node->hash = hash;
+        node->count = 0;
+        node->rrsets = NULL;
+        node->next = NULL;
+        atomic_init(&node->refs, 1);
+        *pnode = node;
+        if (++index->size > index->mask) rrset_index_grow(index);
+    }
+
+    for (size_t i = 0; i < node->count; i++) {
+        if (node->rrsets[i]->type == ldns_rr_get_type(rr) && node->rrsets[i]->rr_class == ldns_rr_get_class(rr)) {
+            ldns_rr_list_push_rr(rrset_writable(node, i)->rrs, rr);
+            return;
+        }
+    }
+
+    node->rrsets = LDNS_XREALLOC(node->rrsets, rrset*, node->count + 1);
+    node->rrsets[node->count] = rrset_new(ldns_rr_get_type(rr), ldns_rr_get_class(rr), ldns_rr_list_new());
+    ldns_rr_list_push_rr(node->rrsets[node->count]->rrs, rr);
+    node->count++;
+}
+
+static void node_unlink(rrset_index *index, rrset_node **pnode) {
+    rrset_node *node = *pnode;
+    *pnode = node->next;
+    node->next = NULL;
+    node_decref(node);
+    index->size--;
+}
+
+ldns_rr *rrset_index_remove(rrset_index *index, const ldns_rr *rr) {
+    ldns_rdf *owner = ldns_rr_owner(rr);
+    rrset_node **pnode = chain_writable(index, owner, dname_hash(owner));
+    rrset_node *node = *pnode;
+    if (!node) return NULL;
+
+    for (size_t i = 0; i < node->count; i++) {
+        if (node->rrsets[i]->type != ldns_rr_get_type(rr) || node->rrsets[i]->rr_class != ldns_rr_get_class(rr)) continue;
+
+        ldns_rr_list *rrs = node->rrsets[i]->rrs;
+        size_t count = ldns_rr_list_rr_count(rrs);
+        for (size_t j = 0; j < count; j++) {
+            if (ldns_rr_compare(rr, ldns_rr_list_rr(rrs, j)) != 0) continue;
+
+            rrs = rrset_writable(node, i)->rrs;
+            ldns_rr *removed = ldns_rr_list_rr(rrs, j);
+            ldns_rr_list_set_rr(rrs, ldns_rr_list_rr(rrs, count-1), j);
+            ldns_rr_list_set_rr_count(rrs, count-1);
+            if (count == 1) {
+                rrset_decref(node->rrsets[i]);
+                node->rrsets[i] = node->rrsets[--node->count];
+            }
+            if (!node->count) node_unlink(index, pnode);
+            return removed;
+        }
+        return NULL;
+    }
+    return NULL;
+}
+
+ldns_rr_list *rrset_index_remove_rrsets(rrset_index *index, const ldns_rdf *owner, ldns_rr_type type) {
+    rrset_node **pnode = chain_writable(index, owner, dname_hash(owner));
+    rrset_node *node = *pnode;
+    if (!node) return NULL;
+
+    ldns_rr_list *removed = NULL;
+    for (size_t i = node->count; i-- > 0;) {
+        rrset *set = node->rrsets[i];
+        if (type != LDNS_RR_TYPE_ANY && set->type != type) continue;
+
+        if (!removed) removed = ldns_rr_list_new();
+        if (atomic_load(&set->refs) > 1) {
+            // still used by other versions, which keep their RRs
+            ldns_rr_list *rrs = ldns_rr_list_clone(set->rrs);
+            ldns_rr_list_push_rr_list(removed, rrs);
+            ldns_rr_list_free(rrs);
+            rrset_decref(set);
+        } else {
+            ldns_rr_list_push_rr_list(removed, set->rrs);
+            ldns_rr_list_free(set->rrs);
+            LDNS_FREE(set);
+        }
+        node->rrsets[i] = node->rrsets[--node->count];
+    }
+    if (!node->count) node_unlink(index, pnode);
+    return removed;
+}
+
+bool rrset_index_foreach(const rrset_index *index, bool (*fn)(const ldns_rr *rr, void *arg), void *arg) {
+    for (size_t b = 0; b <= index->mask; b++) {
+        const rrset_node *node = index->pages[b / PAGE_BUCKETS]->buckets[b % PAGE_BUCKETS];
+        for (; node; node = node->next) {
+            for (size_t i = 0; i < node->count; i++) {
+                const ldns_rr_list *rrs = node->rrsets[i]->rrs;
+                for (size_t j = 0; j < ldns_rr_list_rr_count(rrs); j++) {
+                    if (!fn(ldns_rr_list_rr(rrs, j), arg)) return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+/* Registry of the index built for each zone, keyed by zone pointer */
+
+typedef struct zone_index_entry {
+    const ldns_zone *zone;
+    _Atomic(rrset_index*) index;
+    _Atomic(struct zone_index_entry*) next;
+} zone_index_entry;
+
+#define REGISTRY_BUCKETS 1021
+
+static _Atomic(zone_index_entry*) registry[REGISTRY_BUCKETS];
+// writers only: zones retired during a transfer drop their index from a transfer worker
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static _Atomic(zone_index_entry*) *zone_index_lookup(const ldns_zone *zone) {
+    _Atomic(zone_index_entry*) *pentry = &registry[((uintptr_t) zone >> 4) % REGISTRY_BUCKETS];
+    zone_index_entry *entry;
+    while ((entry = atomic_load_explicit(pentry, memory_order_acquire)) && entry->zone != zone) {
+        pentry = &entry->next;
+    }
+    return pentry;
+}
+
+rrset_index *zone_index(const ldns_zone *zone) {
+    zone_index_entry *entry = atomic_load_explicit(zone_index_lookup(zone), memory_order_acquire);
+    return entry ? atomic_load_explicit(&entry->index, memory_order_acquire) : NULL;
+}
+
+rrset_index *zone_index_put(const ldns_zone *zone, rrset_index *index) {
+    pthread_mutex_lock(&registry_mutex);
+    _Atomic(zone_index_entry*) *pentry = zone_index_lookup(zone);
+    zone_index_entry *entry = atomic_load_explicit(pentry, memory_order_relaxed);
+    rrset_index *previous = entry ? atomic_load_explicit(&entry->index, memory_order_relaxed) : NULL;
+
+    if (index) {
+        if (entry) {
+            atomic_store_explicit(&entry->index, index, memory_order_release);
+        } else {
+            // the entry is linked at the end of the chain, after it is fully built
+            entry = LDNS_MALLOC(zone_index_entry);
+            entry->zone = zone;
+            atomic_init(&entry->index, index);
+            atomic_init(&entry->next, NULL);
+            atomic_store_explicit(pentry, entry, memory_order_release);
+        }
+    } else if (entry) {
+        atomic_store_explicit(pentry, atomic_load_explicit(&entry->next, memory_order_relaxed), memory_order_release);
+        rcu_retire(free, entry);
+    }
+    pthread_mutex_unlock(&registry_mutex);
+    return previous;
+}
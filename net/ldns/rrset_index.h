@@ -0,0 +1,83 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+#ifndef RRSET_INDEX_H
+#define RRSET_INDEX_H
+
+#include <ldns/ldns.h>
+#include <stdatomic.h>
+
+/*
+ * Hash index of the RRsets of a zone, keyed by canonical owner name.
+ * Each owner node groups the RRs of that name by (type, class), so that
+ * a lookup costs one hash probe regardless of the zone size.
+ *
+ * The index owns the RRs of the zone: rrset_index_new moves them out of
+ * ldns_zone_rrs(zone), which is left empty, and they are added and removed
+ * through the index afterwards.
+ *
+ * Indexes are persistent. rrset_index_copy returns a copy-on-write copy
+ * that shares everything with the original, and changes to the copy only
+ * copy the RRsets they touch and their path: the owner node, the nodes
+ * before it in its bucket, and the page of buckets that holds it. Shared
+ * parts are reference counted and freed with the last index that uses
+ * them, so each version of a zone can be freed independently. An index
+ * must not be changed once it is visible to readers.
+ */
+
+typedef struct rrset {
+    ldns_rr_type type;
+    ldns_rr_class rr_class;
+    ldns_rr_list *rrs;
+    _Atomic int refs;
+} rrset;
+
+typedef struct rrset_node {
+    ldns_rdf *owner;
+    uint32_t hash;
+    size_t count;
+    rrset **rrsets;
+    struct rrset_node *next;
+    _Atomic int refs;
+} rrset_node;
+
+typedef struct rrset_index rrset_index;
+
+rrset_index *rrset_index_new(ldns_zone *zone);
+rrset_index *rrset_index_copy(const rrset_index *index);
+void rrset_index_free(rrset_index *index);
+
+/*
+ * rrset_index_add takes ownership of rr. rrset_index_remove removes the RR
+ * equal to rr, and rrset_index_remove_rrsets the RRsets of owner with the
+ * given type (or all of them, for LDNS_RR_TYPE_ANY); the removed RRs are
+ * returned to the caller, or NULL if there were none.
+ */
+void rrset_index_add(rrset_index *index, ldns_rr *rr);
+ldns_rr *rrset_index_remove(rrset_index *index, const ldns_rr *rr);
+ldns_rr_list *rrset_index_remove_rrsets(rrset_index *index, const ldns_rdf *owner, ldns_rr_type type);
+
+const rrset_node *rrset_index_find(const rrset_index *index, const ldns_rdf *owner);
+const ldns_rr_list *rrset_node_get(const rrset_node *node, ldns_rr_type type, ldns_rr_class rr_class);
+
+// calls fn for each RR, grouped by owner, until it returns false
+bool rrset_index_foreach(const rrset_index *index, bool (*fn)(const ldns_rr *rr, void *arg), void *arg);
+
+uint32_t dname_hash(const ldns_rdf *dname);
+bool dname_equal(const ldns_rdf *a, const ldns_rdf *b);
+
+/*
+ * Index registered for each zone. Lookups are lock-free and must be done
+ * inside an RCU read-side section. Registering or dropping an index returns
+ * the previous one, and it is up to the caller to free it once no reader
+ * can be using it.
+ */
+rrset_index *zone_index(const ldns_zone *zone);
+rrset_index *zone_index_put(const ldns_zone *zone, rrset_index *index);
+
+#endif
@@ -0,0 +1,376 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+#include "stats.h"
+#include "query_log.h"
+#include "rrl.h"
+#include "trace.h"
+#include <ldns/ldns.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+// qtypes above 255 are counted together
+#define QTYPE_OTHER 256
+
+typedef struct stats_histogram {
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t buckets[HIST_BUCKETS];
+} stats_histogram;
+
+typedef struct thread_stats {
+    _Atomic uint64_t opcodes[16];
+    _Atomic uint64_t qtypes[QTYPE_OTHER + 1];
+    _Atomic uint64_t rcodes[16];
+    _Atomic uint64_t queries[2];
+    _Atomic uint64_t answers[2];
+    _Atomic uint64_t bytes_in[2];
+    _Atomic uint64_t bytes_out[2];
+    _Atomic uint64_t transfers[2];       // AXFR, IXFR
+    _Atomic uint64_t transfer_bytes[2];
+    _Atomic uint64_t updates[16];
+    _Atomic uint64_t rrl[3];             // by rrl_check action
+    _Atomic uint64_t notify[3];          // sent, acknowledged, failed
+    _Atomic uint64_t batches[STATS_MAX_BATCH + 1];  // UDP receives by datagrams taken
+    stats_histogram histograms[STATS_HISTOGRAMS];
+    struct thread_stats *next;
+} __attribute__((aligned(64))) thread_stats;
+
+extern pthread_mutex_t update_mutex;
+
+static _Atomic(thread_stats*) threads;
+static __thread thread_stats *self;
+
+// written with update_mutex held
+static uint64_t update_locked;
+
+#define MAX_SOURCES 4
+static stats_source *sources[MAX_SOURCES];
+static int source_count;
+
+static const char *histogram_names[STATS_HISTOGRAMS] = {
+    "dns_wire_latency_seconds",
+    "dns_transfer_duration_seconds",
+    "dns_update_mutex_wait_seconds",
+    "dns_update_mutex_hold_seconds",
+    "dns_rcu_grace_period_seconds" };
+
+static const char *transport_names[2] = { "udp", "tcp" };
+
+static thread_stats *stats_register() {
+    // slots are never unregistered, threads live as long as the server
+    thread_stats *ts = aligned_alloc(64, sizeof(thread_stats));
+    memset(ts, 0, sizeof(thread_stats));
+    ts->next = atomic_load(&threads);
+    while (!atomic_compare_exchange_weak(&threads, &ts->next, ts));
+    return self = ts;
+}
+
+static inline thread_stats *stats_self() {
+    return self ? self : stats_register();
+}
+
+/* Only the owner thread writes its counters, no read-modify-write needed */
+static inline void bump(_Atomic uint64_t *counter, uint64_t n) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static size_t hist_index(uint64_t value) {
+    if (value < HIST_SUB) return value;
+    int msb = 63 - __builtin_clzll(value);
+    return (msb - HIST_SUB_BITS + 1) * HIST_SUB + ((value >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Largest value counted in a bucket */
+static uint64_t hist_upper(size_t index) {
+    size_t exponent = index / HIST_SUB;
+    if (!exponent) return index;
+    int shift = exponent - 1;
+    uint64_t lower = (uint64_t) (HIST_SUB + index % HIST_SUB) << shift;
+    return lower + ((uint64_t) 1 << shift) - 1;
+}
+
+uint64_t stats_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+uint64_t stats_now_coarse() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void stats_time(int histogram, uint64_t ns) {
+    stats_histogram *h = &stats_self()->histograms[histogram];
+    bump(&h->count, 1);
+    bump(&h->sum, ns);
+    bump(&h->buckets[hist_index(ns)], 1);
+}
+
+void stats_query(const uint8_t *wire, size_t size, int transport) {
+    thread_stats *ts = stats_self();
+    bump(&ts->queries[transport], 1);
+    bump(&ts->bytes_in[transport], size);
+    if (size < LDNS_HEADER_SIZE) return;
+
+    bump(&ts->opcodes[LDNS_OPCODE_WIRE(wire)], 1);
+    if (!LDNS_QDCOUNT(wire)) return;
+
+    size_t pos = LDNS_HEADER_SIZE;
+    while (pos < size && wire[pos] && wire[pos] < 64) pos += wire[pos] + 1;
+    if (pos + 3 > size || wire[pos]) return;
+    uint16_t qtype = ldns_read_uint16(wire + pos + 1);
+    bump(&ts->qtypes[qtype < QTYPE_OTHER ? qtype : QTYPE_OTHER], 1);
+}
+
+void stats_answer(const uint8_t *wire, size_t size, int transport) {
+    thread_stats *ts = stats_self();
+    bump(&ts->answers[transport], 1);
+    bump(&ts->bytes_out[transport], size);
+    if (size >= LDNS_HEADER_SIZE) bump(&ts->rcodes[LDNS_RCODE_WIRE(wire)], 1);
+}
+
+void stats_transfer(bool incremental, size_t size, uint64_t ns) {
+    thread_stats *ts = stats_self();
+    bump(&ts->transfers[incremental], 1);
+    bump(&ts->transfer_bytes[incremental], size);
+    stats_time(STATS_TRANSFER, ns);
+}
+
+void stats_update(int rcode) {
+    bump(&stats_self()->updates[rcode & 15], 1);
+}
+
+void stats_rrl(int action) {
+    bump(&stats_self()->rrl[action], 1);
+}
+
+void stats_notify(int result) {
+    bump(&stats_self()->notify[result], 1);
+}
+
+void stats_batch(int size) {
+    bump(&stats_self()->batches[size < STATS_MAX_BATCH ? size : STATS_MAX_BATCH], 1);
+}
+
+void update_mutex_lock() {
+    uint64_t start = stats_now();
+    trace_lap(TRACE_OTHER);
+    pthread_mutex_lock(&update_mutex);
+    trace_lap(TRACE_LOCK);
+    update_locked = stats_now();
+    stats_time(STATS_UPDATE_WAIT, update_locked - start);
+}
+
+void update_mutex_unlock() {
+    stats_time(STATS_UPDATE_HOLD, stats_now() - update_locked);
+    pthread_mutex_unlock(&update_mutex);
+}
+
+/* Sum of a counter over all threads */
+#define STATS_SUM(field) ({ \
+    uint64_t sum = 0; \
+    for (thread_stats *ts = atomic_load(&threads); ts; ts = ts->next) \
+        sum += atomic_load_explicit(&ts->field, memory_order_relaxed); \
+    sum; })
+
+static void render_histogram(FILE *out, int histogram) {
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    uint64_t *buckets = LDNS_CALLOC(uint64_t, HIST_BUCKETS);
+    uint64_t count = 0, sum = 0;
+    for (thread_stats *ts = atomic_load(&threads); ts; ts = ts->next) {
+        stats_histogram *h = &ts->histograms[histogram];
+        for (size_t i = 0; i < HIST_BUCKETS; i++) {
+            uint64_t n = atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+            buckets[i] += n;
+            count += n;
+        }
+        sum += atomic_load_explicit(&h->sum, memory_order_relaxed);
+    }
+
+    const char *name = histogram_names[histogram];
+    fprintf(out, "# TYPE %s summary\n", name);
+    size_t i = 0;
+    uint64_t seen = 0;
+    for (size_t q = 0; q < sizeof quantiles / sizeof *quantiles; q++) {
+        uint64_t rank = quantiles[q] * count;
+        if (rank < 1) rank = 1;
+        while (i < HIST_BUCKETS && seen + buckets[i] < rank) seen += buckets[i++];
+        double value = count ? hist_upper(i < HIST_BUCKETS ? i : HIST_BUCKETS - 1) / 1e9 : 0;
+        fprintf(out, "%s{quantile=\"%g\"} %.9f\n", name, quantiles[q], value);
+    }
+    size_t last = HIST_BUCKETS;
+    while (last && !buckets[last - 1]) last--;
+    fprintf(out, "%s{quantile=\"1\"} %.9f\n", name, last ? hist_upper(last - 1) / 1e9 : 0);
+    fprintf(out, "%s_sum %.9f\n", name, sum / 1e9);
+    fprintf(out, "%s_count %llu\n", name, (unsigned long long) count);
+    LDNS_FREE(buckets);
+}
+
+static void render(FILE *out) {
+    fprintf(out, "# TYPE dns_queries_total counter\n");
+    for (int t = 0; t < 2; t++) {
+        fprintf(out, "dns_queries_total{transport=\"%s\"} %llu\n", transport_names[t], (unsigned long long) STATS_SUM(queries[t]));
+    }
+    fprintf(out, "# TYPE dns_responses_total counter\n");
+    for (int t = 0; t < 2; t++) {
+        fprintf(out, "dns_responses_total{transport=\"%s\"} %llu\n", transport_names[t], (unsigned long long) STATS_SUM(answers[t]));
+    }
+    fprintf(out, "# TYPE dns_received_bytes_total counter\n");
+    for (int t = 0; t < 2; t++) {
+        fprintf(out, "dns_received_bytes_total{transport=\"%s\"} %llu\n", transport_names[t], (unsigned long long) STATS_SUM(bytes_in[t]));
+    }
+    fprintf(out, "# TYPE dns_sent_bytes_total counter\n");
+    for (int t = 0; t < 2; t++) {
+        fprintf(out, "dns_sent_bytes_total{transport=\"%s\"} %llu\n", transport_names[t], (unsigned long long) STATS_SUM(bytes_out[t]));
+    }
+
+    fprintf(out, "# TYPE dns_queries_by_opcode_total counter\n");
+    for (int i = 0; i < 16; i++) {
+        uint64_t n = STATS_SUM(opcodes[i]);
+        if (!n) continue;
+        char *name = ldns_pkt_opcode2str(i);
+        fprintf(out, "dns_queries_by_opcode_total{opcode=\"%s\"} %llu\n", name, (unsigned long long) n);
+        LDNS_FREE(name);
+    }
+    fprintf(out, "# TYPE dns_queries_by_qtype_total counter\n");
+    for (int i = 0; i <= QTYPE_OTHER; i++) {
+        uint64_t n = STATS_SUM(qtypes[i]);
+        if (!n) continue;
+        if (i == QTYPE_OTHER) {
+            fprintf(out, "dns_queries_by_qtype_total{qtype=\"other\"} %llu\n", (unsigned long long) n);
+            continue;
+        }
+        char *name = ldns_rr_type2str(i);
+        fprintf(out, "dns_queries_by_qtype_total{qtype=\"%s\"} %llu\n", name, (unsigned long long) n);
+        LDNS_FREE(name);
+    }
+    fprintf(out, "# TYPE dns_responses_by_rcode_total counter\n");
+    for (int i = 0; i < 16; i++) {
+        uint64_t n = STATS_SUM(rcodes[i]);
+        if (!n) continue;
+        char *name = ldns_pkt_rcode2str(i);
+        fprintf(out, "dns_responses_by_rcode_total{rcode=\"%s\"} %llu\n", name, (unsigned long long) n);
+        LDNS_FREE(name);
+    }
+
+    fprintf(out, "# TYPE dns_transfers_total counter\n");
+    fprintf(out, "dns_transfers_total{type=\"AXFR\"} %llu\n", (unsigned long long) STATS_SUM(transfers[0]));
+    fprintf(out, "dns_transfers_total{type=\"IXFR\"} %llu\n", (unsigned long long) STATS_SUM(transfers[1]));
+    fprintf(out, "# TYPE dns_transfer_bytes_total counter\n");
+    fprintf(out, "dns_transfer_bytes_total{type=\"AXFR\"} %llu\n", (unsigned long long) STATS_SUM(transfer_bytes[0]));
+    fprintf(out, "dns_transfer_bytes_total{type=\"IXFR\"} %llu\n", (unsigned long long) STATS_SUM(transfer_bytes[1]));
+
+    fprintf(out, "# TYPE dns_updates_total counter\n");
+    for (int i = 0; i < 16; i++) {
+        uint64_t n = STATS_SUM(updates[i]);
+        if (!n) continue;
+        char *name = ldns_pkt_rcode2str(i);
+        fprintf(out, "dns_updates_total{rcode=\"%s\"} %llu\n", name, (unsigned long long) n);
+        LDNS_FREE(name);
+    }
+
+    if (rrl_enabled) {
+        static const char *actions[3] = { "sent", "dropped", "slipped" };
+        fprintf(out, "# TYPE dns_rrl_responses_total counter\n");
+        for (int i = 0; i < 3; i++) {
+            fprintf(out, "dns_rrl_responses_total{action=\"%s\"} %llu\n", actions[i], (unsigned long long) STATS_SUM(rrl[i]));
+        }
+    }
+
+    static const char *results[3] = { "sent", "acknowledged", "failed" };
+    fprintf(out, "# TYPE dns_notify_total counter\n");
+    for (int i = 0; i < 3; i++) {
+        fprintf(out, "dns_notify_total{result=\"%s\"} %llu\n", results[i], (unsigned long long) STATS_SUM(notify[i]));
+    }
+
+    fprintf(out, "# TYPE dns_udp_receive_batches_total counter\n");
+    for (int i = 0; i <= STATS_MAX_BATCH; i++) {
+        uint64_t n = STATS_SUM(batches[i]);
+        if (n) fprintf(out, "dns_udp_receive_batches_total{size=\"%d\"} %llu\n", i, (unsigned long long) n);
+    }
+
+    fprintf(out, "# TYPE dns_query_log_dropped_total counter\n");
+    fprintf(out, "dns_query_log_dropped_total %llu\n", (unsigned long long) query_log_dropped());
+
+    for (int i = 0; i < STATS_HISTOGRAMS; i++) render_histogram(out, i);
+    for (int i = 0; i < source_count; i++) sources[i](out);
+}
+
+void stats_add_source(stats_source *source) {
+    if (source_count < MAX_SOURCES) sources[source_count++] = source;
+}
+
+void stats_dump(FILE *out) {
+    render(out);
+}
+
+static void *stats_server(void *arg) {
+    int sock = (intptr_t) arg;
+    while (1) {
+        int fd = accept(sock, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR) fprintf(stderr, "stats accept(): %s\n", strerror(errno));
+            continue;
+        }
+
+        char *text = NULL;
+        size_t size = 0;
+        FILE *out = open_memstream(&text, &size);
+        render(out);
+        fclose(out);
+
+        for (size_t sent = 0; sent < size;) {
+            ssize_t n = send(fd, text + sent, size - sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            sent += n;
+        }
+        free(text);
+        close(fd);
+    }
+    return NULL;
+}
+
+bool stats_listen(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof addr.sun_path) {
+        fprintf(stderr, "Stats socket path too long: %s\n", path);
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        fprintf(stderr, "socket(): %s\n", strerror(errno));
+        return false;
+    }
+    // a socket left behind by a previous run
+    unlink(path);
+    if (bind(sock, (struct sockaddr*) &addr, sizeof addr) || listen(sock, 16)) {
+        fprintf(stderr, "Cannot listen on %s: %s\n", path, strerror(errno));
+        close(sock);
+        return false;
+    }
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, stats_server, (void*) (intptr_t) sock);
+    pthread_detach(thread);
+    return true;
+}
@@ -0,0 +1,81 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * Server metrics. Each thread counts into its own slot, registered on
+ * first use, with plain relaxed stores: nothing is shared on the query
+ * path. Readers add up the slots of all threads, so a reading may be a
+ * few events behind but counters never go backwards.
+ *
+ * Counters are kept per opcode, qtype and rcode, per transport (bytes and
+ * messages in and out), for zone transfers (count, bytes and duration),
+ * per UPDATE outcome, and per response rate limiting outcome (sent,
+ * dropped, slipped) and NOTIFY outcome. Times are recorded in log-linear histograms (8
+ * sub-buckets per power of two, about 12% precision) of nanoseconds.
+ *
+ * Transfers are not counted as responses, since they are sent as a stream
+ * of messages; their first message answers the query. The UDP workers
+ * count the number of datagrams taken by each receive (stats_batch):
+ * with recvmmsg, by each call; with io_uring, by each wakeup, as many as
+ * the receive completions found, so not bounded by --batch. Sizes from
+ * STATS_MAX_BATCH up are counted together.
+ *
+ * stats_listen serves the metrics in the Prometheus text format on a Unix
+ * socket: each connection gets a full dump, then the socket is closed.
+ * stats_dump writes the same text. Modules with metrics of their own add
+ * a source at startup, which is called to append them to each dump.
+ */
+
+#define STATS_UDP 0
+#define STATS_TCP 1
+
+// histograms
+#define STATS_WIRE 0         // handle_dns_wire, for queries answered with a message
+#define STATS_TRANSFER 1     // rendering and queuing of AXFR and IXFR
+#define STATS_UPDATE_WAIT 2  // waiting to acquire update_mutex
+#define STATS_UPDATE_HOLD 3  // update_mutex held
+#define STATS_RCU_GRACE 4    // rcu_synchronize waiting for readers
+#define STATS_HISTOGRAMS 5
+
+#define STATS_MAX_BATCH 64
+
+// monotonic time in ns; the coarse clock is read from the vDSO without a
+// system call, and only advances with the timer tick
+uint64_t stats_now();
+uint64_t stats_now_coarse();
+
+void stats_query(const uint8_t *wire, size_t size, int transport);
+void stats_answer(const uint8_t *wire, size_t size, int transport);
+void stats_transfer(bool incremental, size_t size, uint64_t ns);
+void stats_update(int rcode);
+void stats_time(int histogram, uint64_t ns);
+void stats_rrl(int action);
+void stats_notify(int result);
+void stats_batch(int size);
+
+/* update_mutex, timing the wait and the time it is held */
+void update_mutex_lock();
+void update_mutex_unlock();
+
+typedef void stats_source(FILE *out);
+
+/* Before stats_listen */
+void stats_add_source(stats_source *source);
+
+bool stats_listen(const char *path);
+void stats_dump(FILE *out);
+
+#endif
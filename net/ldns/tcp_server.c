@@ -0,0 +1,691 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+#define _GNU_SOURCE
+#include "dns_server.h"
+#include "tcp_server.h"
+#include "dns_fast.h"
+#include "arena.h"
+#include "query_log.h"
+#include "stats.h"
+#include "uring.h"
+#include "trace.h"
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <time.h>
+
+#define TCP_EVENTS 256
+#define TCP_WHEEL_SLOTS 64
+#define TCP_MAX_MESSAGE 65535
+#define TCP_READ_SIZE 16384
+#define TCP_HIGH_WATER (256 * 1024)
+#define TCP_LOW_WATER (64 * 1024)
+
+typedef struct tcp_conn {
+    int fd;
+    struct sockaddr_storage peer;
+
+    // input, only used by the event loop
+    uint8_t *in;
+    size_t in_len;
+    size_t in_cap;
+
+    // timer wheel, only used by the event loop
+    time_t deadline;
+    int slot;   // -1 when not in the wheel
+    struct tcp_conn *wheel_next;
+    struct tcp_conn *wheel_prev;
+
+    // output and state shared with the transfer workers
+    pthread_mutex_t lock;
+    pthread_cond_t drained;
+    uint8_t *out;
+    size_t out_start;
+    size_t out_len;
+    size_t out_cap;
+    uint32_t events;
+    bool paused;
+    bool error;
+    bool closing;
+    int transfers;
+} tcp_conn;
+
+// a message answered by a transfer worker: a transfer, or an UPDATE or NOTIFY
+typedef struct tcp_transfer {
+    tcp_conn *conn;
+    size_t size;
+    bool update;   // not a QUERY, applied in order
+    struct tcp_transfer *next;
+    uint8_t query[];
+} tcp_transfer;
+
+static int epfd;
+static int listen_sock;
+static uring accept_ring;  // with io_uring, instead of accept4
+static tcp_options options;
+static int connections;
+static pthread_t loop_thread;
+
+static tcp_conn **conns;
+static size_t conns_size;
+
+static tcp_conn *wheel[TCP_WHEEL_SLOTS];
+static time_t wheel_now;
+
+static pthread_mutex_t transfer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t transfer_cond = PTHREAD_COND_INITIALIZER;
+static tcp_transfer *transfer_head;
+static tcp_transfer *transfer_tail;
+static int transfers_queued;
+static tcp_transfer **transfers_running;  // one slot per transfer worker
+static bool update_running;
+
+static uint8_t answer_buf[TCP_MAX_MESSAGE];
+
+static time_t now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static void wheel_insert(tcp_conn *conn) {
+    conn->slot = conn->deadline % TCP_WHEEL_SLOTS;
+    tcp_conn **slot = &wheel[conn->slot];
+    conn->wheel_prev = NULL;
+    conn->wheel_next = *slot;
+    if (*slot) (*slot)->wheel_prev = conn;
+    *slot = conn;
+}
+
+static void wheel_remove(tcp_conn *conn) {
+    if (conn->slot < 0) return;
+    if (conn->wheel_prev) {
+        conn->wheel_prev->wheel_next = conn->wheel_next;
+    } else {
+        wheel[conn->slot] = conn->wheel_next;
+    }
+    if (conn->wheel_next) conn->wheel_next->wheel_prev = conn->wheel_prev;
+    conn->slot = -1;
+}
+
+/* The connection stays in its slot, expire_slot moves it when the slot comes up */
+static void conn_touch(tcp_conn *conn) {
+    conn->deadline = now() + options.timeout;
+}
+
+static void conn_free(tcp_conn *conn) {
+    conns[conn->fd] = NULL;
+    close(conn->fd);
+    pthread_mutex_destroy(&conn->lock);
+    pthread_cond_destroy(&conn->drained);
+    LDNS_FREE(conn->in);
+    LDNS_FREE(conn->out);
+    LDNS_FREE(conn);
+}
+
+static void conn_close(tcp_conn *conn) {
+    wheel_remove(conn);
+    connections--;
+
+    pthread_mutex_lock(&conn->lock);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    conn->closing = true;
+    bool busy = conn->transfers > 0;
+    pthread_cond_broadcast(&conn->drained);
+    pthread_mutex_unlock(&conn->lock);
+
+    if (busy) {
+        // the last transfer worker using it frees it
+        shutdown(conn->fd, SHUT_RDWR);
+    } else {
+        conn_free(conn);
+    }
+}
+
+/* Register the events the connection is waiting for, with conn->lock held */
+static void conn_update(tcp_conn *conn) {
+    if (conn->closing) return;
+
+    bool resumed = false;
+    if (conn->out_len > TCP_HIGH_WATER) {
+        conn->paused = true;
+    } else if (conn->paused && conn->out_len < TCP_LOW_WATER) {
+        conn->paused = false;
+        resumed = true;
+    }
+
+    // a connection resumed outside the event loop is woken up with EPOLLOUT,
+    // so that the loop processes the queries it has already read
+    bool kick = resumed && !pthread_equal(pthread_self(), loop_thread);
+    uint32_t events = (conn->paused ? 0 : EPOLLIN) | (conn->out_len || kick ? EPOLLOUT : 0);
+    if (events != conn->events) {
+        struct epoll_event ev = { .events = events, .data.ptr = conn };
+        epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+        conn->events = events;
+    }
+}
+
+/* Write as much of the queued output as the socket takes, with conn->lock held */
+static void conn_flush(tcp_conn *conn) {
+    while (conn->out_len && !conn->error) {
+        ssize_t n = write(conn->fd, conn->out + conn->out_start, conn->out_len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) conn->error = true;
+            break;
+        }
+        conn->out_start += n;
+        conn->out_len -= n;
+    }
+    if (!conn->out_len) conn->out_start = 0;
+    if (conn->out_len <= TCP_HIGH_WATER || conn->error) pthread_cond_broadcast(&conn->drained);
+    conn_update(conn);
+}
+
+/* Make room for size bytes of output, returns with conn->lock held or NULL if the connection is gone */
+static uint8_t *conn_reserve(tcp_conn *conn, size_t size, bool wait) {
+    pthread_mutex_lock(&conn->lock);
+    while (wait && conn->out_len > TCP_HIGH_WATER && !conn->closing && !conn->error) {
+        pthread_cond_wait(&conn->drained, &conn->lock);
+    }
+    if (conn->closing || conn->error) {
+        pthread_mutex_unlock(&conn->lock);
+        return NULL;
+    }
+
+    if (conn->out_start + conn->out_len + size > conn->out_cap) {
+        memmove(conn->out, conn->out + conn->out_start, conn->out_len);
+        conn->out_start = 0;
+        if (conn->out_len + size > conn->out_cap) {
+            conn->out_cap = conn->out_len + size + TCP_READ_SIZE;
+            conn->out = LDNS_XREALLOC(conn->out, uint8_t, conn->out_cap);
+        }
+    }
+    return conn->out + conn->out_start + conn->out_len;
+}
+
+/* Queue the bytes written after conn_reserve, and release conn->lock */
+static void conn_commit(tcp_conn *conn, size_t size) {
+    bool idle = !conn->out_len;
+    conn->out_len += size;
+
+    // try to write it right away, the loop takes over if the socket is full
+    if (idle) {
+        conn_flush(conn);
+    } else {
+        conn_update(conn);
+    }
+    pthread_mutex_unlock(&conn->lock);
+}
+
+static bool conn_send(tcp_conn *conn, const uint8_t *wire, size_t size, bool wait) {
+    uint8_t *p = conn_reserve(conn, size + 2, wait);
+    if (!p) return false;
+    ldns_write_uint16(p, size);
+    memcpy(p + 2, wire, size);
+    conn_commit(conn, size + 2);
+    return true;
+}
+
+bool tcp_send(int fd, const uint8_t *wire, size_t size) {
+    if (fd < 0 || fd >= conns_size || !conns[fd]) return false;
+    tcp_conn *conn = conns[fd];
+    // the event loop must never block on its own connections
+    return conn_send(conn, wire, size, !pthread_equal(pthread_self(), loop_thread));
+}
+
+bool tcp_send_stream(int fd, const uint8_t *stream, size_t size, uint16_t id) {
+    if (fd < 0 || fd >= conns_size || !conns[fd]) return false;
+    tcp_conn *conn = conns[fd];
+    bool wait = !pthread_equal(pthread_self(), loop_thread);
+
+    // messages are queued in chunks of up to TCP_LOW_WATER bytes, each one under a single lock
+    for (size_t pos = 0; pos < size;) {
+        size_t end = pos;
+        do {
+            end += 2 + ldns_read_uint16(stream + end);
+        } while (end < size && end - pos < TCP_LOW_WATER);
+
+        uint8_t *p = conn_reserve(conn, end - pos, wait);
+        if (!p) return false;
+        memcpy(p, stream + pos, end - pos);
+        for (size_t m = 0; m < end - pos; m += 2 + ldns_read_uint16(p + m)) {
+            ldns_write_uint16(p + m + 2, id);
+        }
+        conn_commit(conn, end - pos);
+        pos = end;
+    }
+    return true;
+}
+
+/*
+ * If the message is left to a transfer worker, returns the offset of the
+ * end of its question, otherwise 0. These are the AXFR and IXFR queries,
+ * which are streamed, and the other opcodes (UPDATE, NOTIFY), which may
+ * wait for update_mutex, for RCU readers and for the journal to be synced.
+ */
+static size_t transfer_question(const uint8_t *wire, size_t size) {
+    if (size < LDNS_HEADER_SIZE) return 0;
+    bool query = LDNS_OPCODE_WIRE(wire) == LDNS_PACKET_QUERY;
+    if (ldns_read_uint16(wire + 4) != 1) return query ? 0 : LDNS_HEADER_SIZE;
+    size_t pos = LDNS_HEADER_SIZE;
+    while (pos < size && wire[pos]) {
+        if ((wire[pos] & 0xC0) == 0xC0) {
+            pos++;
+            break;
+        }
+        pos += wire[pos] + 1;
+    }
+    pos++;
+    if (pos + 4 > size) return query ? 0 : LDNS_HEADER_SIZE;
+    if (!query) return pos + 4;
+    uint16_t qtype = ldns_read_uint16(wire + pos);
+    return qtype == LDNS_RR_TYPE_AXFR || qtype == LDNS_RR_TYPE_IXFR ? pos + 4 : 0;
+}
+
+static bool same_client(const tcp_conn *a, const tcp_conn *b) {
+    if (a->peer.ss_family != b->peer.ss_family) return false;
+    if (a->peer.ss_family == AF_INET) {
+        return ((struct sockaddr_in*) &a->peer)->sin_addr.s_addr == ((struct sockaddr_in*) &b->peer)->sin_addr.s_addr;
+    }
+    if (a->peer.ss_family == AF_INET6) {
+        return !memcmp(&((struct sockaddr_in6*) &a->peer)->sin6_addr, &((struct sockaddr_in6*) &b->peer)->sin6_addr, sizeof(struct in6_addr));
+    }
+    return true;
+}
+
+/* Transfers queued or running for the client of a connection, with transfer_mutex held */
+static int client_transfers(const tcp_conn *conn) {
+    int count = 0;
+    for (tcp_transfer *t = transfer_head; t; t = t->next) {
+        if (!t->update && same_client(t->conn, conn)) count++;
+    }
+    for (int i = 0; i < options.xfr_threads; i++) {
+        tcp_transfer *t = transfers_running[i];
+        if (t && !t->update && same_client(t->conn, conn)) count++;
+    }
+    return count;
+}
+
+/* Answer REFUSED, echoing the question */
+static void refuse(tcp_conn *conn, const uint8_t *wire, size_t qend) {
+    uint8_t answer[LDNS_HEADER_SIZE + LDNS_MAX_DOMAINLEN + 4];
+    if (qend > sizeof answer) return;
+    memcpy(answer, wire, qend);
+    answer[2] = (wire[2] & 0x79) | 0x80;  // QR, keeping opcode and RD
+    answer[3] = LDNS_RCODE_REFUSED;
+    memset(answer + 6, 0, 6);
+    if (qend == LDNS_HEADER_SIZE) memset(answer + 4, 0, 2);
+    query_log_answer(answer, qend);
+    stats_answer(answer, qend, STATS_TCP);
+    conn_send(conn, answer, qend, false);
+}
+
+/* Queue a transfer or update, unless the queue or the client is at its limit */
+static bool transfer_queue(tcp_conn *conn, const uint8_t *wire, size_t size) {
+    // updates only count against the queue
+    bool update = LDNS_OPCODE_WIRE(wire) != LDNS_PACKET_QUERY;
+    pthread_mutex_lock(&transfer_mutex);
+    bool full = transfers_queued >= options.xfr_queue || (!update && client_transfers(conn) >= options.xfr_per_client);
+    pthread_mutex_unlock(&transfer_mutex);
+    if (full) return false;
+
+    tcp_transfer *transfer = malloc(sizeof(tcp_transfer) + size);
+    transfer->conn = conn;
+    transfer->size = size;
+    transfer->update = update;
+    transfer->next = NULL;
+    memcpy(transfer->query, wire, size);
+
+    pthread_mutex_lock(&conn->lock);
+    conn->transfers++;
+    pthread_mutex_unlock(&conn->lock);
+
+    pthread_mutex_lock(&transfer_mutex);
+    if (transfer_tail) {
+        transfer_tail->next = transfer;
+    } else {
+        transfer_head = transfer;
+    }
+    transfer_tail = transfer;
+    transfers_queued++;
+    pthread_cond_signal(&transfer_cond);
+    pthread_mutex_unlock(&transfer_mutex);
+    return true;
+}
+
+static void* run_transfers(void *arg) {
+    int worker = (intptr_t) arg;
+    while (1) {
+        pthread_mutex_lock(&transfer_mutex);
+        tcp_transfer *transfer, *prev;
+        while (1) {
+            // updates are applied one at a time, in the order they arrived
+            prev = NULL;
+            for (transfer = transfer_head; transfer && transfer->update && update_running; transfer = transfer->next) prev = transfer;
+            if (transfer) break;
+            pthread_cond_wait(&transfer_cond, &transfer_mutex);
+        }
+        if (prev) {
+            prev->next = transfer->next;
+        } else {
+            transfer_head = transfer->next;
+        }
+        if (transfer_tail == transfer) transfer_tail = prev;
+        if (transfer->update) update_running = true;
+        transfers_queued--;
+        transfers_running[worker] = transfer;
+        pthread_mutex_unlock(&transfer_mutex);
+
+        tcp_conn *conn = transfer->conn;
+        pthread_mutex_lock(&conn->lock);
+        bool closing = conn->closing;
+        pthread_mutex_unlock(&conn->lock);
+
+        if (!closing) {
+            uint8_t *outbuf = NULL;
+            size_t answer_size;
+            query_log_query(transfer->query, transfer->size);
+            stats_query(transfer->query, transfer->size, STATS_TCP);
+            handle_dns_wire(transfer->query, transfer->size, &outbuf, &answer_size, conn->fd);
+            if (outbuf) {
+                query_log_answer(outbuf, answer_size);
+                stats_answer(outbuf, answer_size, STATS_TCP);
+                conn_send(conn, outbuf, answer_size, true);
+                arena_reset();
+            }
+        }
+
+        pthread_mutex_lock(&transfer_mutex);
+        transfers_running[worker] = NULL;
+        if (transfer->update) {
+            update_running = false;
+            // the next update may be waiting for another worker
+            pthread_cond_broadcast(&transfer_cond);
+        }
+        pthread_mutex_unlock(&transfer_mutex);
+
+        pthread_mutex_lock(&conn->lock);
+        bool done = --conn->transfers == 0 && conn->closing;
+        pthread_mutex_unlock(&conn->lock);
+        if (done) conn_free(conn);
+        LDNS_FREE(transfer);
+    }
+    return NULL;
+}
+
+static void handle_message(tcp_conn *conn, const uint8_t *wire, size_t size) {
+    size_t qend = transfer_question(wire, size);
+    if (qend) {
+        if (!transfer_queue(conn, wire, size)) {
+            query_log_query(wire, size);
+            stats_query(wire, size, STATS_TCP);
+            refuse(conn, wire, qend);
+        }
+        return;
+    }
+
+    query_log_query(wire, size);
+    stats_query(wire, size, STATS_TCP);
+    trace_batch();
+    trace_begin(wire, size);
+
+    size_t answer_size = 0;
+    if (query_log_level < QLOG_TEXT) answer_size = handle_dns_fast(wire, size, answer_buf, sizeof answer_buf, true);
+    if (answer_size) {
+        trace_end();
+        query_log_answer(answer_buf, answer_size);
+        stats_answer(answer_buf, answer_size, STATS_TCP);
+        conn_send(conn, answer_buf, answer_size, false);
+        trace_sent();
+        return;
+    }
+
+    uint8_t *outbuf = NULL;
+    handle_dns_wire((void*) wire, size, &outbuf, &answer_size, conn->fd);
+    trace_end();
+    if (outbuf) {
+        query_log_answer(outbuf, answer_size);
+        stats_answer(outbuf, answer_size, STATS_TCP);
+        conn_send(conn, outbuf, answer_size, false);
+        arena_reset();
+    }
+    trace_sent();
+}
+
+/* Answer the complete messages read so far, until the connection is paused */
+static void conn_process(tcp_conn *conn) {
+    size_t pos = 0;
+    while (conn->in_len - pos >= 2) {
+        pthread_mutex_lock(&conn->lock);
+        bool paused = conn->paused;
+        pthread_mutex_unlock(&conn->lock);
+        if (paused) break;
+
+        size_t size = ldns_read_uint16(conn->in + pos);
+        if (conn->in_len - pos < size + 2) break;
+        handle_message(conn, conn->in + pos + 2, size);
+        pos += size + 2;
+    }
+    memmove(conn->in, conn->in + pos, conn->in_len - pos);
+    conn->in_len -= pos;
+}
+
+static void conn_read(tcp_conn *conn) {
+    if (conn->in_cap - conn->in_len < TCP_READ_SIZE) {
+        conn->in_cap = conn->in_len + TCP_READ_SIZE;
+        conn->in = LDNS_XREALLOC(conn->in, uint8_t, conn->in_cap);
+    }
+
+    ssize_t n = read(conn->fd, conn->in + conn->in_len, conn->in_cap - conn->in_len);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+    if (n <= 0) {
+        conn_close(conn);
+        return;
+    }
+
+    conn->in_len += n;
+    conn_touch(conn);
+    conn_process(conn);
+}
+
+/* Returns false if the connection was closed */
+static bool conn_writable(tcp_conn *conn) {
+    pthread_mutex_lock(&conn->lock);
+    conn_flush(conn);
+    bool error = conn->error;
+    bool paused = conn->paused;
+    pthread_mutex_unlock(&conn->lock);
+
+    if (error) {
+        conn_close(conn);
+        return false;
+    }
+    conn_touch(conn);
+    if (!paused) conn_process(conn);
+    return true;
+}
+
+static void conn_open(int fd, const struct sockaddr_storage *peer) {
+    if (connections >= options.max_connections || fd >= conns_size) {
+        close(fd);
+        return;
+    }
+
+    tcp_conn *conn = LDNS_CALLOC(tcp_conn, 1);
+    conn->fd = fd;
+    conn->peer = *peer;
+    pthread_mutex_init(&conn->lock, NULL);
+    pthread_cond_init(&conn->drained, NULL);
+    conn->events = EPOLLIN;
+    conn->deadline = now() + options.timeout;
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = conn };
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        fprintf(stderr, "epoll_ctl(): %s\n", strerror(errno));
+        pthread_mutex_destroy(&conn->lock);
+        pthread_cond_destroy(&conn->drained);
+        LDNS_FREE(conn);
+        close(fd);
+        return;
+    }
+
+    conns[fd] = conn;
+    wheel_insert(conn);
+    connections++;
+}
+
+static void accept_connections() {
+    while (1) {
+        struct sockaddr_storage peer;
+        socklen_t peer_len = sizeof peer;
+        int fd = accept4(listen_sock, (struct sockaddr*) &peer, &peer_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+                fprintf(stderr, "accept(): %s\n", strerror(errno));
+            }
+            return;
+        }
+        conn_open(fd, &peer);
+    }
+}
+
+static bool accept_arm() {
+    struct io_uring_sqe *sqe = uring_sqe(&accept_ring);
+    if (!sqe) return false;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_sock;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    return uring_submit(&accept_ring, 0) == 1;
+}
+
+static void accept_fallback() {
+    uring_free(&accept_ring);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listen_sock, &ev);
+}
+
+/* The connections accepted by the multishot accept */
+static void accept_completions() {
+    bool rearm = false;
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_cqe(&accept_ring))) {
+        int fd = cqe->res;
+        if (!(cqe->flags & IORING_CQE_F_MORE)) rearm = true;
+        uring_cqe_seen(&accept_ring);
+
+        if (fd == -EINVAL && !connections) {
+            // no multishot accept before Linux 5.19
+            fprintf(stderr, "io_uring multishot accept not supported, using accept4\n");
+            accept_fallback();
+            return;
+        }
+        if (fd < 0) {
+            if (fd != -EAGAIN && fd != -EINTR && fd != -ECONNABORTED) fprintf(stderr, "accept(): %s\n", strerror(-fd));
+            continue;
+        }
+
+        // a multishot accept shares one address buffer among its completions
+        struct sockaddr_storage peer = {0};
+        getpeername(fd, (struct sockaddr*) &peer, &(socklen_t){sizeof peer});
+        conn_open(fd, &peer);
+    }
+    if (rearm && !accept_arm()) {
+        fprintf(stderr, "Cannot rearm the io_uring accept, using accept4\n");
+        accept_fallback();
+    }
+}
+
+static void expire_slot(time_t tick) {
+    tcp_conn *conn = wheel[tick % TCP_WHEEL_SLOTS];
+    wheel[tick % TCP_WHEEL_SLOTS] = NULL;
+    while (conn) {
+        tcp_conn *next = conn->wheel_next;
+        pthread_mutex_lock(&conn->lock);
+        bool busy = conn->transfers > 0;
+        pthread_mutex_unlock(&conn->lock);
+
+        if (conn->deadline <= tick && !busy) {
+            // already unlinked from the wheel
+            conn->slot = -1;
+            conn_close(conn);
+        } else {
+            if (conn->deadline <= tick) conn->deadline = tick + options.timeout;
+            wheel_insert(conn);
+        }
+        conn = next;
+    }
+}
+
+static void* tcp_loop(void *arg) {
+    struct epoll_event events[TCP_EVENTS];
+    wheel_now = now();
+
+    while (1) {
+        int n = epoll_wait(epfd, events, TCP_EVENTS, 1000);
+        if (n < 0 && errno != EINTR) {
+            fprintf(stderr, "epoll_wait(): %s\n", strerror(errno));
+            exit(1);
+        }
+
+        for (int i = 0; i < n; i++) {
+            tcp_conn *conn = events[i].data.ptr;
+            if (!conn) {
+                accept_connections();
+            } else if (conn == (tcp_conn*) &accept_ring) {
+                accept_completions();
+            } else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                conn_close(conn);
+            } else if (events[i].events & EPOLLOUT) {
+                if (conn_writable(conn) && (events[i].events & EPOLLIN)) conn_read(conn);
+            } else if (events[i].events & EPOLLIN) {
+                conn_read(conn);
+            }
+        }
+
+        for (time_t t = now(); wheel_now < t;) {
+            expire_slot(++wheel_now);
+        }
+    }
+    return NULL;
+}
+
+void tcp_server_start(int sock, const tcp_options *opts) {
+    listen_sock = sock;
+    options = *opts;
+
+    struct rlimit limit;
+    conns_size = getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY ? limit.rlim_cur : 65536;
+    conns = LDNS_CALLOC(tcp_conn*, conns_size);
+
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        fprintf(stderr, "epoll_create1(): %s\n", strerror(errno));
+        exit(1);
+    }
+    // the completion queue of the ring is polled by epoll in place of the listening socket
+    bool ring = opts->io_uring && uring_init(&accept_ring, 8, 256);
+    if (ring && !accept_arm()) {
+        uring_free(&accept_ring);
+        ring = false;
+    }
+    if (opts->io_uring && !ring) fprintf(stderr, "TCP falls back to accept4\n");
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = ring ? (tcp_conn*) &accept_ring : NULL };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, ring ? accept_ring.fd : sock, &ev);
+
+    transfers_running = LDNS_CALLOC(tcp_transfer*, options.xfr_threads);
+    for (int i = 0; i < options.xfr_threads; i++) {
+        pthread_t transfer_thread;
+        pthread_create(&transfer_thread, NULL, run_transfers, (void*) (intptr_t) i);
+    }
+    pthread_create(&loop_thread, NULL, tcp_loop, NULL);
+}
@@ -0,0 +1,70 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+#ifndef TCP_SERVER_H
+#define TCP_SERVER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Event-driven TCP front end. One thread multiplexes all the connections
+ * with epoll on non-blocking sockets. Pipelined queries are answered as
+ * soon as each one is read, and zone transfers are handed to a pool of
+ * transfer workers, so that the answers may be sent out of order
+ * (RFC 7766). So are the messages with other opcodes than QUERY (UPDATE,
+ * NOTIFY), which may block on update_mutex and on the journal, and are
+ * applied one at a time in the order they arrived.
+ *
+ * Transfers and updates wait in a queue of at most xfr_queue entries, and
+ * a client (by address) may have at most xfr_per_client transfers queued
+ * or running; beyond that they are answered REFUSED.
+ *
+ * Connections with no activity for `timeout` seconds are closed; their
+ * deadlines are kept in a timer wheel with one-second slots. When the
+ * output queued for a connection exceeds a high-water mark the server
+ * stops reading from it until the client catches up, and transfers
+ * writing to it block.
+ *
+ * With io_uring, connections are accepted by a multishot accept whose
+ * completions wake up the event loop through epoll, instead of accept4
+ * on the listening socket. Reads and writes stay on epoll.
+ */
+
+#define TCP_MAX_TIMEOUT 86400          // s
+#define TCP_MAX_CONNECTIONS 1048576    // the default limit of open files per process (nr_open)
+#define TCP_MAX_XFR_THREADS 64
+#define TCP_MAX_XFR_QUEUE 65536
+
+typedef struct tcp_options {
+    int timeout;
+    int max_connections;
+    int xfr_threads;
+    int xfr_per_client;
+    int xfr_queue;
+    bool io_uring;
+} tcp_options;
+
+void tcp_server_start(int sock, const tcp_options *opts);
+
+/*
+ * Queue a DNS message on the connection with descriptor fd, adding the
+ * length prefix. Safe to call from the transfer workers.
+ * Returns false if the connection was closed.
+ */
+bool tcp_send(int fd, const uint8_t *wire, size_t size);
+
+/*
+ * Queue a sequence of messages that already carry their length prefix,
+ * setting the message ID of each one to id. Used to serve rendered zone
+ * transfers with large writes.
+ */
+bool tcp_send_stream(int fd, const uint8_t *stream, size_t size, uint16_t id);
+
+#endif
@@ -0,0 +1,152 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+#include "trace.h"
+#include "stats.h"
+
+#ifdef QUERY_TRACE
+
+#include <ldns/ldns.h>
+#include <pthread.h>
+#include <time.h>
+
+typedef struct trace_thread {
+    trace_record batch[TRACE_BATCH];
+    int pending;
+    trace_record slow[TRACE_SLOW];
+    uint64_t slow_count;
+    struct trace_thread *next;
+} trace_thread;
+
+__thread trace_record *trace_current;
+__thread uint64_t trace_mark;
+
+static __thread trace_thread *self;
+static __thread uint64_t batch_start;
+static trace_thread *threads;
+static pthread_mutex_t threads_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t threshold;  // in ticks, 0 when off
+static double ticks_per_us = 1000;
+
+void trace_init(unsigned threshold_us) {
+    // rdtsc runs at a constant rate, which is measured once
+    uint64_t ns = stats_now(), ticks = trace_ticks();
+    nanosleep(&(struct timespec) {0, 20000000}, NULL);
+    ns = stats_now() - ns;
+    ticks = trace_ticks() - ticks;
+    if (ns && ticks) ticks_per_us = ticks * 1000.0 / ns;
+    threshold = (uint64_t) (threshold_us * ticks_per_us);
+    if (!threshold) threshold = 1;
+}
+
+static trace_thread *trace_register() {
+    self = LDNS_CALLOC(trace_thread, 1);
+    pthread_mutex_lock(&threads_mutex);
+    self->next = threads;
+    threads = self;
+    pthread_mutex_unlock(&threads_mutex);
+    return self;
+}
+
+void trace_batch() {
+    if (!threshold) return;
+    batch_start = trace_mark = trace_ticks();
+}
+
+void trace_begin(const uint8_t *query, size_t size) {
+    trace_current = NULL;
+    if (!threshold) return;
+    trace_thread *t = self ? self : trace_register();
+    if (t->pending == TRACE_BATCH) return;
+
+    trace_record *r = &t->batch[t->pending++];
+    memset(r->stages, 0, sizeof r->stages);
+    r->start = batch_start;
+    r->stages[TRACE_QUEUE] = trace_mark - batch_start;
+    r->query = query;
+    r->size = size;
+    trace_current = r;
+}
+
+// the question name and type, only copied for the slow queries
+static void copy_question(trace_record *r) {
+    const uint8_t *query = r->query;
+    size_t size = r->size, pos = LDNS_HEADER_SIZE;
+    while (pos < size && query[pos] && !(query[pos] & 0xC0)) pos += query[pos] + 1;
+    r->qtype = pos + 2 < size ? ldns_read_uint16(query + pos + 1) : 0;
+    r->qname_len = 0;
+    if (pos < size && pos > LDNS_HEADER_SIZE) {
+        r->qname_len = pos - LDNS_HEADER_SIZE < TRACE_QNAME ? pos - LDNS_HEADER_SIZE : TRACE_QNAME;
+        memcpy(r->qname, query + LDNS_HEADER_SIZE, r->qname_len);
+    }
+}
+
+void trace_end() {
+    if (!trace_current) return;
+    trace_current->answered = trace_mark;
+    trace_current = NULL;
+}
+
+void trace_sent() {
+    trace_thread *t = self;
+    if (!t || !t->pending) return;
+    uint64_t now = trace_ticks();
+    for (int i = 0; i < t->pending; i++) {
+        trace_record *r = &t->batch[i];
+        r->stages[TRACE_SEND] = now - r->answered;
+        r->total = now - r->start;
+        if (r->total < threshold) continue;
+        copy_question(r);
+        t->slow[t->slow_count % TRACE_SLOW] = *r;
+        __atomic_store_n(&t->slow_count, t->slow_count + 1, __ATOMIC_RELEASE);
+    }
+    t->pending = 0;
+}
+
+static void print_qname(FILE *out, const trace_record *r) {
+    size_t pos = 0;
+    if (!r->qname_len) fputc('.', out);
+    while (pos < r->qname_len) {
+        size_t len = r->qname[pos++];
+        for (size_t i = 0; i < len && pos < r->qname_len; i++, pos++) {
+            uint8_t c = r->qname[pos];
+            if (c > ' ' && c < 127 && c != '.' && c != '\\') fputc(c, out);
+            else fprintf(out, "\\%03u", c);
+        }
+        fputc('.', out);
+    }
+    if (r->qname_len == TRACE_QNAME) fputs("..", out);
+}
+
+void trace_dump(FILE *out) {
+    if (!threshold) return;
+    static const char *names[TRACE_STAGES] = {
+        "queue", "cache", "fast", "parse", "zone", "rrset", "lock", "render", "send", "other" };
+    fprintf(out, "Slow queries (at least %.0f us), in us:\n", threshold / ticks_per_us);
+
+    pthread_mutex_lock(&threads_mutex);
+    for (trace_thread *t = threads; t; t = t->next) {
+        uint64_t count = __atomic_load_n(&t->slow_count, __ATOMIC_ACQUIRE);
+        for (uint64_t n = count > TRACE_SLOW ? count - TRACE_SLOW : 0; n < count; n++) {
+            const trace_record *r = &t->slow[n % TRACE_SLOW];
+            print_qname(out, r);
+            const ldns_rr_descriptor *d = ldns_rr_descript(r->qtype);
+            if (d && d->_name) fprintf(out, " %s", d->_name);
+            else fprintf(out, " TYPE%u", r->qtype);
+
+            fprintf(out, " total %.1f", r->total / ticks_per_us);
+            for (int s = 0; s < TRACE_STAGES; s++) {
+                if (r->stages[s]) fprintf(out, " %s %.1f", names[s], r->stages[s] / ticks_per_us);
+            }
+            fputc('\n', out);
+        }
+    }
+    pthread_mutex_unlock(&threads_mutex);
+}
+
+#endif
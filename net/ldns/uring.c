@@ -0,0 +1,174 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+#define _GNU_SOURCE
+#include "uring.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+bool uring_init(uring *ring, unsigned entries, unsigned cq_entries) {
+    memset(ring, 0, sizeof *ring);
+    struct io_uring_params p = {
+        .flags = IORING_SETUP_CQSIZE,
+        .cq_entries = cq_entries };
+    ring->fd = io_uring_setup(entries, &p);
+    if (ring->fd < 0) {
+        fprintf(stderr, "io_uring_setup(): %s\n", strerror(errno));
+        return false;
+    }
+
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    // both rings may share a mapping
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = p.features & IORING_FEAT_SINGLE_MMAP ? ring->sq_ring
+        : mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        fprintf(stderr, "mmap(io_uring): %s\n", strerror(errno));
+        uring_free(ring);
+        return false;
+    }
+
+    uint8_t *sq = ring->sq_ring, *cq = ring->cq_ring;
+    ring->sq_head = (unsigned*) (sq + p.sq_off.head);
+    ring->sq_tail = (unsigned*) (sq + p.sq_off.tail);
+    ring->sq_mask = *(unsigned*) (sq + p.sq_off.ring_mask);
+    ring->sq_entries = p.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned*) (cq + p.cq_off.head);
+    ring->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+    ring->cq_mask = *(unsigned*) (cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+
+    // the submission entries are used in ring order, the indirection array maps each slot to itself
+    unsigned *array = (unsigned*) (sq + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++) array[i] = i;
+    return true;
+}
+
+void uring_free(uring *ring) {
+    if (ring->sqes && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring && ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->fd >= 0) close(ring->fd);
+    memset(ring, 0, sizeof *ring);
+    ring->fd = -1;
+}
+
+struct io_uring_sqe *uring_sqe(uring *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local_tail - head >= ring->sq_entries) return NULL;
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sq_local_tail++ & ring->sq_mask];
+    memset(sqe, 0, sizeof *sqe);
+    return sqe;
+}
+
+int uring_submit(uring *ring, unsigned wait) {
+    unsigned pending = ring->sq_local_tail - *ring->sq_tail;
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    while (1) {
+        int n = io_uring_enter(ring->fd, pending, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+        if (n >= 0) return n;
+        if (errno != EINTR) return -errno;
+    }
+}
+
+struct io_uring_cqe *uring_cqe(uring *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(uring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+bool uring_buffers_init(uring *ring, uring_buffers *bufs, uint16_t group, unsigned count, unsigned size) {
+    // count must be a power of two
+    memset(bufs, 0, sizeof *bufs);
+    bufs->ring_size = count * sizeof(struct io_uring_buf);
+    bufs->br = mmap(NULL, bufs->ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    bufs->data = mmap(NULL, (size_t) count * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (bufs->br == MAP_FAILED || bufs->data == MAP_FAILED) {
+        fprintf(stderr, "mmap(): %s\n", strerror(errno));
+        if (bufs->br != MAP_FAILED) munmap(bufs->br, bufs->ring_size);
+        if (bufs->data != MAP_FAILED) munmap(bufs->data, (size_t) count * size);
+        bufs->br = NULL;
+        bufs->data = NULL;
+        return false;
+    }
+    bufs->count = count;
+    bufs->size = size;
+    bufs->group = group;
+
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (uintptr_t) bufs->br,
+        .ring_entries = count,
+        .bgid = group };
+    if (io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        fprintf(stderr, "io_uring_register(PBUF_RING): %s\n", strerror(errno));
+        munmap(bufs->br, bufs->ring_size);
+        munmap(bufs->data, (size_t) count * size);
+        bufs->br = NULL;
+        bufs->data = NULL;
+        return false;
+    }
+
+    for (unsigned i = 0; i < count; i++) uring_buffer_recycle(bufs, i);
+    uring_buffers_commit(bufs);
+    return true;
+}
+
+void uring_buffers_free(uring *ring, uring_buffers *bufs) {
+    if (!bufs->br) return;
+    struct io_uring_buf_reg reg = { .bgid = bufs->group };
+    io_uring_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    munmap(bufs->br, bufs->ring_size);
+    munmap(bufs->data, (size_t) bufs->count * bufs->size);
+    bufs->br = NULL;
+    bufs->data = NULL;
+}
+
+uint8_t *uring_buffer(const uring_buffers *bufs, unsigned id) {
+    return bufs->data + (size_t) id * bufs->size;
+}
+
+void uring_buffer_recycle(uring_buffers *bufs, unsigned id) {
+    struct io_uring_buf *buf = &bufs->br->bufs[bufs->tail & (bufs->count - 1)];
+    buf->addr = (uintptr_t) uring_buffer(bufs, id);
+    buf->len = bufs->size;
+    buf->bid = id;
+    bufs->tail++;
+}
+
+void uring_buffers_commit(uring_buffers *bufs) {
+    __atomic_store_n(&bufs->br->tail, bufs->tail, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,84 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Minimal io_uring rings over the raw system calls, for the optional
+ * io_uring network backend (--io-uring). A ring is used by a single
+ * thread.
+ *
+ * Entries are taken with uring_sqe and handed to the kernel together by
+ * uring_submit, which may also wait for completions. Completions are read
+ * with uring_cqe and released with uring_cqe_seen.
+ *
+ * A group of provided buffers (uring_buffers) is registered as a buffer
+ * ring, from which multishot receives take a buffer per completion; the
+ * buffers are given back with uring_buffer_recycle, and made visible to
+ * the kernel with uring_buffers_commit.
+ *
+ * uring_init fails, with a message, if io_uring is not available (older
+ * kernels, or a seccomp filter); the callers then use epoll/recvmmsg.
+ */
+
+typedef struct uring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail;   // entries taken but not yet submitted end here
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} uring;
+
+typedef struct uring_buffers {
+    struct io_uring_buf_ring *br;
+    uint8_t *data;
+    size_t ring_size;
+    unsigned count;
+    unsigned size;
+    uint16_t group;
+    uint16_t tail;
+} uring_buffers;
+
+bool uring_init(uring *ring, unsigned entries, unsigned cq_entries);
+void uring_free(uring *ring);
+
+/* Returns NULL if the submission queue is full */
+struct io_uring_sqe *uring_sqe(uring *ring);
+
+/* Returns the number of entries submitted, or -errno */
+int uring_submit(uring *ring, unsigned wait);
+
+/* Returns NULL if there are no completions */
+struct io_uring_cqe *uring_cqe(uring *ring);
+void uring_cqe_seen(uring *ring);
+
+bool uring_buffers_init(uring *ring, uring_buffers *bufs, uint16_t group, unsigned count, unsigned size);
+void uring_buffers_free(uring *ring, uring_buffers *bufs);
+uint8_t *uring_buffer(const uring_buffers *bufs, unsigned id);
+void uring_buffer_recycle(uring_buffers *bufs, unsigned id);
+void uring_buffers_commit(uring_buffers *bufs);
+
+#endif
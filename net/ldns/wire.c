@@ -0,0 +1,136 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+#include "wire.h"
+#include <ctype.h>
+
+void wire_init(wire_writer *w, uint8_t *buf, size_t size) {
+    w->buf = buf;
+    w->size = size;
+    w->pos = 0;
+    w->error = false;
+    w->count = 0;
+}
+
+void wire_write_bytes(wire_writer *w, const void *data, size_t len) {
+    if (w->pos + len > w->size) {
+        w->error = true;
+        return;
+    }
+    memcpy(w->buf + w->pos, data, len);
+    w->pos += len;
+}
+
+void wire_write_u16(wire_writer *w, uint16_t value) {
+    if (w->pos + 2 > w->size) {
+        w->error = true;
+        return;
+    }
+    ldns_write_uint16(w->buf + w->pos, value);
+    w->pos += 2;
+}
+
+void wire_write_u32(wire_writer *w, uint32_t value) {
+    if (w->pos + 4 > w->size) {
+        w->error = true;
+        return;
+    }
+    ldns_write_uint32(w->buf + w->pos, value);
+    w->pos += 4;
+}
+
+static uint16_t name_lookup(const wire_writer *w, const uint8_t *name, size_t len) {
+    for (size_t i = 0; i < w->count; i++) {
+        const wire_name *n = &w->names[i];
+        if (n->len != len) continue;
+        size_t j = 0;
+        while (j < len && tolower(n->name[j]) == tolower(name[j])) j++;
+        if (j == len) return n->offset;
+    }
+    return 0;
+}
+
+/*
+ * Write a name given in uncompressed wire format. If compress is set, the longest suffix
+ * already present in the message is replaced by a pointer, and the labels
+ * written are remembered as targets for later names.
+ */
+void wire_write_name(wire_writer *w, const uint8_t *name, size_t len, bool compress) {
+    size_t prefix = 0;
+    uint16_t pointer = 0;
+    while (prefix < len && name[prefix]) {
+        // offset 0 is the header, so it never points to a name
+        if (compress && (pointer = name_lookup(w, name + prefix, len - prefix))) break;
+        prefix += name[prefix] + 1;
+    }
+    if (prefix >= len) {
+        w->error = true;
+        return;
+    }
+
+    size_t start = w->pos;
+    wire_write_bytes(w, name, prefix);
+    if (pointer) {
+        wire_write_u16(w, 0xC000 | pointer);
+    } else {
+        wire_write_bytes(w, name + prefix, 1);
+    }
+    if (w->error || !compress) return;
+
+    for (size_t pos = 0; pos < prefix && w->count < WIRE_MAX_NAMES && start + pos < 0x4000; pos += name[pos] + 1) {
+        w->names[w->count++] = (wire_name) { name + pos, len - pos, start + pos };
+    }
+}
+
+/* RR types whose names in the rdata may be compressed (RFC 3597, section 4) */
+static bool compressible(ldns_rr_type type) {
+    switch (type) {
+    case LDNS_RR_TYPE_NS:
+    case LDNS_RR_TYPE_CNAME:
+    case LDNS_RR_TYPE_SOA:
+    case LDNS_RR_TYPE_PTR:
+    case LDNS_RR_TYPE_MX:
+        return true;
+    default:
+        return false;
+    }
+}
+
+void wire_write_rr(wire_writer *w, const ldns_rr *rr) {
+    const ldns_rdf *owner = ldns_rr_owner(rr);
+    wire_write_name(w, ldns_rdf_data(owner), ldns_rdf_size(owner), true);
+    wire_write_u16(w, ldns_rr_get_type(rr));
+    wire_write_u16(w, ldns_rr_get_class(rr));
+    wire_write_u32(w, ldns_rr_ttl(rr));
+
+    size_t rdlength = w->pos;
+    wire_write_u16(w, 0);
+
+    bool compress = compressible(ldns_rr_get_type(rr));
+    for (size_t i = 0; i < ldns_rr_rd_count(rr); i++) {
+        const ldns_rdf *rdf = ldns_rr_rdf(rr, i);
+        if (!rdf) continue;
+        if (compress && ldns_rdf_get_type(rdf) == LDNS_RDF_TYPE_DNAME) {
+            wire_write_name(w, ldns_rdf_data(rdf), ldns_rdf_size(rdf), true);
+        } else {
+            wire_write_bytes(w, ldns_rdf_data(rdf), ldns_rdf_size(rdf));
+        }
+    }
+
+    if (!w->error) ldns_write_uint16(w->buf + rdlength, w->pos - rdlength - 2);
+}
+
+wire_mark wire_save(const wire_writer *w) {
+    return (wire_mark) { w->pos, w->count };
+}
+
+void wire_rollback(wire_writer *w, wire_mark mark) {
+    w->pos = mark.pos;
+    w->count = mark.count;
+    w->error = false;
+}
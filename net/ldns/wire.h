@@ -0,0 +1,59 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <ldns/ldns.h>
+
+/*
+ * Renders DNS messages into a buffer provided by the caller, with name
+ * compression. A write that does not fit in the buffer sets `error` and
+ * writes nothing. wire_save and wire_rollback undo a partially written
+ * record, so that a message can be closed before it.
+ *
+ * The names written are remembered by reference: the data they point to
+ * must outlive the writer.
+ */
+
+#define WIRE_MAX_NAMES 256
+
+/* A name already written to the message, that later names can point to */
+typedef struct wire_name {
+    const uint8_t *name;
+    size_t len;
+    uint16_t offset;
+} wire_name;
+
+typedef struct wire_writer {
+    uint8_t *buf;
+    size_t size;
+    size_t pos;
+    bool error;
+
+    size_t count;
+    wire_name names[WIRE_MAX_NAMES];
+} wire_writer;
+
+typedef struct wire_mark {
+    size_t pos;
+    size_t count;
+} wire_mark;
+
+void wire_init(wire_writer *w, uint8_t *buf, size_t size);
+
+void wire_write_bytes(wire_writer *w, const void *data, size_t len);
+void wire_write_u16(wire_writer *w, uint16_t value);
+void wire_write_u32(wire_writer *w, uint32_t value);
+void wire_write_name(wire_writer *w, const uint8_t *name, size_t len, bool compress);
+void wire_write_rr(wire_writer *w, const ldns_rr *rr);
+
+wire_mark wire_save(const wire_writer *w);
+void wire_rollback(wire_writer *w, wire_mark mark);
+
+#endif
@@ -0,0 +1,256 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+#include "dns_server.h"
+#include "zone_compiled.h"
+#include "fnv.h"
+#include "rcu.h"
+#include "rrset_index.h"
+#include "zone_snapshot.h"
+#include <fcntl.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define COMPILED_MAGIC "LDNSZC01"
+#define SOURCE_BUCKETS 1021
+
+typedef struct compiled_header {
+    char magic[8];
+    uint64_t source_size;
+    int64_t source_mtime;  // ns
+    uint32_t serial;
+    uint32_t rr_count;     // not counting the SOA
+    uint64_t data_size;
+    uint64_t checksum;     // FNV-1a of the data
+} compiled_header;
+
+/* Text file each zone was loaded from, keyed by apex and class */
+typedef struct zone_source {
+    ldns_rdf *apex;
+    ldns_rr_class rr_class;
+    char *path;
+    bool queued;
+    struct zone_source *next;        // in the bucket
+    struct zone_source *next_queued;
+} zone_source;
+
+static const char *compiled_dir;
+
+static pthread_mutex_t compiled_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compiled_cond = PTHREAD_COND_INITIALIZER;
+static zone_source *sources[SOURCE_BUCKETS];
+static zone_source *queue;
+static bool writing;
+
+static void compiled_path(char *path, size_t size, const char *source) {
+    char *copy = strdup(source);
+    snprintf(path, size, "%s/%s.zc", compiled_dir, basename(copy));
+    free(copy);
+}
+
+static bool source_stat(const char *source, uint64_t *size, int64_t *mtime) {
+    struct stat st;
+    if (stat(source, &st)) return false;
+    *size = st.st_size;
+    *mtime = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    return true;
+}
+
+ldns_zone *zone_compiled_read(const char *source) {
+    if (!compiled_dir) return NULL;
+
+    char path[PATH_MAX];
+    compiled_path(path, sizeof path, source);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (!fstat(fd, &st) && st.st_size >= (off_t) sizeof(compiled_header)) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+
+    const compiled_header *header = map;
+    const uint8_t *data = (const uint8_t*) map + sizeof(compiled_header);
+    uint64_t source_size;
+    int64_t source_mtime;
+    ldns_zone *zone = NULL;
+
+    if (memcmp(header->magic, COMPILED_MAGIC, 8)
+        || header->data_size != st.st_size - sizeof(compiled_header)) {
+        fprintf(stderr, "Ignoring %s: not a compiled zone\n", path);
+    } else if (!source_stat(source, &source_size, &source_mtime)
+        || source_size != header->source_size || source_mtime != header->source_mtime) {
+        fprintf(stderr, "Ignoring %s: stale\n", path);
+    } else if (fnv(FNV_OFFSET, data, header->data_size) != header->checksum) {
+        fprintf(stderr, "Ignoring %s: bad checksum\n", path);
+    } else {
+        size_t pos = 0;
+        ldns_rr *soa;
+        if (ldns_wire2rr(&soa, data, header->data_size, &pos, LDNS_SECTION_ANSWER) == LDNS_STATUS_OK) {
+            zone = ldns_zone_new();
+            ldns_zone_set_soa(zone, soa);
+            for (uint32_t i = 0; zone && i < header->rr_count; i++) {
+                ldns_rr *rr;
+                if (ldns_wire2rr(&rr, data, header->data_size, &pos, LDNS_SECTION_ANSWER) != LDNS_STATUS_OK) {
+                    fprintf(stderr, "Ignoring %s: bad record\n", path);
+                    ldns_zone_deep_free(zone);
+                    zone = NULL;
+                } else {
+                    ldns_zone_push_rr(zone, rr);
+                }
+            }
+        }
+    }
+
+    munmap(map, st.st_size);
+    return zone;
+}
+
+typedef struct compiled_writer {
+    FILE *fp;
+    uint32_t rr_count;
+    uint64_t data_size;
+    uint64_t checksum;
+    bool error;
+} compiled_writer;
+
+static bool write_rr(const ldns_rr *rr, void *arg) {
+    compiled_writer *cw = arg;
+    uint8_t *wire;
+    size_t size;
+    if (ldns_rr2wire(&wire, rr, LDNS_SECTION_ANSWER, &size) != LDNS_STATUS_OK) {
+        cw->error = true;
+        return false;
+    }
+    // FNV-1a is sequential, continue it over each record
+    cw->checksum = fnv(cw->checksum, wire, size);
+    cw->error |= fwrite(wire, 1, size, cw->fp) != size;
+    cw->data_size += size;
+    cw->rr_count++;
+    LDNS_FREE(wire);
+    return !cw->error;
+}
+
+static bool compiled_write(const ldns_zone *zone, const char *source) {
+    compiled_header header = { .magic = COMPILED_MAGIC };
+    if (!source_stat(source, &header.source_size, &header.source_mtime)) return false;
+    header.serial = ldns_rdf2native_int32(ldns_rr_rdf(ldns_zone_soa(zone), 2));
+
+    char path[PATH_MAX], tmp[PATH_MAX];
+    compiled_path(path, sizeof path, source);
+    snprintf(tmp, sizeof tmp, "%s.tmp", path);
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) return false;
+
+    rrset_index *index = zone_snapshot_index(zone);
+
+    compiled_writer cw = { .fp = fp, .checksum = FNV_OFFSET };
+    fwrite(&header, sizeof header, 1, fp);
+    write_rr(ldns_zone_soa(zone), &cw);
+    if (index) {
+        rrset_index_foreach(index, write_rr, &cw);
+    } else {
+        for (size_t i = 0; !cw.error && i < ldns_zone_rr_count(zone); i++) {
+            write_rr(ldns_rr_list_rr(ldns_zone_rrs(zone), i), &cw);
+        }
+    }
+    header.rr_count = cw.rr_count - 1;  // less the SOA
+    header.data_size = cw.data_size;
+    header.checksum = cw.checksum;
+    bool ok = !cw.error && !fseek(fp, 0, SEEK_SET) && fwrite(&header, sizeof header, 1, fp) == 1
+        && !fflush(fp) && !fsync(fileno(fp));
+    ok = !fclose(fp) && ok;
+    return ok && !rename(tmp, path);
+}
+
+static zone_source **source_find(const ldns_rdf *apex, ldns_rr_class rr_class) {
+    zone_source **p = &sources[dname_hash(apex) % SOURCE_BUCKETS];
+    while (*p && ((*p)->rr_class != rr_class || !dname_equal((*p)->apex, apex))) p = &(*p)->next;
+    return p;
+}
+
+static void *compiled_writer_loop(void *arg) {
+    pthread_mutex_lock(&compiled_mutex);
+    while (true) {
+        while (!queue) pthread_cond_wait(&compiled_cond, &compiled_mutex);
+        zone_source *source = queue;
+        queue = source->next_queued;
+        source->queued = false;
+        writing = true;
+        char *path = strdup(source->path);
+        ldns_rdf *apex = ldns_rdf_clone(source->apex);
+        ldns_rr_class rr_class = source->rr_class;
+        pthread_mutex_unlock(&compiled_mutex);
+
+        rcu_read_lock();
+        ldns_zone *zone = zone_find(apex, rr_class);
+        if (zone && !dname_equal(ldns_rr_owner(ldns_zone_soa(zone)), apex)) zone = NULL;
+        if (zone) zone = zone_snapshot_get(zone);
+        rcu_read_unlock();
+
+        if (zone) {
+            if (!compiled_write(zone, path)) fprintf(stderr, "Cannot write compiled zone for %s\n", path);
+            zone_snapshot_put(zone);
+        }
+        free(path);
+        ldns_rdf_deep_free(apex);
+
+        pthread_mutex_lock(&compiled_mutex);
+        writing = false;
+        pthread_cond_broadcast(&compiled_cond);
+    }
+    return NULL;
+}
+
+void zone_compiled_init(const char *dir) {
+    compiled_dir = dir;
+    pthread_t thread;
+    pthread_create(&thread, NULL, compiled_writer_loop, NULL);
+    pthread_detach(thread);
+}
+
+void zone_compiled_track(const ldns_zone *zone, const char *source) {
+    ldns_rr *soa = ldns_zone_soa(zone);
+    if (!compiled_dir || !soa) return;
+
+    pthread_mutex_lock(&compiled_mutex);
+    zone_source **p = source_find(ldns_rr_owner(soa), ldns_rr_get_class(soa));
+    if (!*p) {
+        *p = LDNS_CALLOC(zone_source, 1);
+        (*p)->apex = ldns_rdf_clone(ldns_rr_owner(soa));
+        (*p)->rr_class = ldns_rr_get_class(soa);
+        (*p)->path = strdup(source);
+    }
+    pthread_mutex_unlock(&compiled_mutex);
+}
+
+void zone_compiled_schedule(const ldns_zone *zone) {
+    ldns_rr *soa = ldns_zone_soa(zone);
+    if (!compiled_dir || !soa) return;
+
+    pthread_mutex_lock(&compiled_mutex);
+    zone_source *source = *source_find(ldns_rr_owner(soa), ldns_rr_get_class(soa));
+    if (source && !source->queued) {
+        source->queued = true;
+        source->next_queued = queue;
+        queue = source;
+        pthread_cond_broadcast(&compiled_cond);
+    }
+    pthread_mutex_unlock(&compiled_mutex);
+}
+
+void zone_compiled_flush() {
+    if (!compiled_dir) return;
+    pthread_mutex_lock(&compiled_mutex);
+    while (queue || writing) pthread_cond_wait(&compiled_cond, &compiled_mutex);
+    pthread_mutex_unlock(&compiled_mutex);
+}
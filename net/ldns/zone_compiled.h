@@ -0,0 +1,43 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+#ifndef ZONE_COMPILED_H
+#define ZONE_COMPILED_H
+
+#include <ldns/ldns.h>
+
+/*
+ * Compiled zones: binary snapshots of the zones loaded from text files,
+ * kept in a separate directory as <file>.zc. A snapshot holds the SOA and
+ * the records in uncompressed wire format, grouped by owner and RRset,
+ * with the size and modification time of the text file it stands for and
+ * a checksum of its contents.
+ *
+ * zone_compiled_read maps the snapshot of a zone file and decodes it,
+ * which skips the text parser. It returns NULL when there is no snapshot,
+ * or it is corrupt or older than the text file, and the caller falls back
+ * to zone_read.
+ *
+ * Snapshots are rewritten behind the server's back by a background thread:
+ * after a zone is loaded from text, and after each update of a zone that
+ * was loaded from a file, so that updates survive a restart for as long
+ * as the text file is not modified. zone_compiled_flush waits until the
+ * pending writes are done, for the --compile step.
+ *
+ * Everything is a no-op until zone_compiled_init is called.
+ */
+
+void zone_compiled_init(const char *dir);
+
+ldns_zone *zone_compiled_read(const char *source);
+
+void zone_compiled_track(const ldns_zone *zone, const char *source);
+void zone_compiled_schedule(const ldns_zone *zone);
+void zone_compiled_flush();
+
+#endif
@@ -0,0 +1,119 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+#include "dns_server.h"
+#include "zone_loader.h"
+#include "zone_table.h"
+#include "zone_compiled.h"
+#include "rrset_index.h"
+#include "response_cache.h"
+#include "rcu.h"
+#include "stats.h"
+#include <dirent.h>
+#include <stdatomic.h>
+
+typedef struct zone_load {
+    filename_t *files;
+    ldns_zone **zones;
+    rrset_index **indexes;
+    bool *compiled;  // loaded from a compiled snapshot
+    size_t count;
+    _Atomic size_t next;
+    bool indexing;
+} zone_load;
+
+static void *load_worker(void *arg) {
+    zone_load *load = arg;
+    size_t i;
+    while ((i = atomic_fetch_add(&load->next, 1)) < load->count) {
+        if (!load->indexing) {
+            load->zones[i] = zone_compiled_read(load->files[i]);
+            load->compiled[i] = load->zones[i] != NULL;
+            if (!load->zones[i]) load->zones[i] = zone_read(load->files[i]);
+            if (!load->zones[i]) fprintf(stderr, "Cannot read zone %s\n", load->files[i]);
+        } else if (load->zones[i]) {
+            load->indexes[i] = rrset_index_new(load->zones[i]);
+        }
+    }
+    return NULL;
+}
+
+// Run one phase over all the files, the calling thread being one of the workers
+static void load_phase(zone_load *load, int threads, bool indexing) {
+    load->indexing = indexing;
+    atomic_store(&load->next, 0);
+
+    pthread_t *pool = LDNS_XMALLOC(pthread_t, threads);
+    int started = 0;
+    while (started < threads - 1 && !pthread_create(&pool[started], NULL, load_worker, load)) started++;
+    load_worker(load);
+    while (started--) pthread_join(pool[started], NULL);
+    LDNS_FREE(pool);
+}
+
+size_t zone_load_dir(const char *dir, int threads) {
+    double t0 = stats_now() / 1e6;
+
+    zone_load load = {0};
+    size_t capacity = 0;
+    DIR *d = opendir(dir);
+    if (!d) {
+        fprintf(stderr, "%s does not exist\n", dir);
+        return 0;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (!is_zone_file(entry->d_name)) continue;
+        if (load.count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            load.files = LDNS_XREALLOC(load.files, filename_t, capacity);
+        }
+        set_filename(load.files[load.count++], dir, entry->d_name);
+    }
+    closedir(d);
+    load.zones = LDNS_CALLOC(ldns_zone*, load.count ? load.count : 1);
+    load.indexes = LDNS_CALLOC(rrset_index*, load.count ? load.count : 1);
+    load.compiled = LDNS_CALLOC(bool, load.count ? load.count : 1);
+    if (threads > (int) load.count) threads = load.count ? load.count : 1;
+    double t1 = stats_now() / 1e6;
+
+    load_phase(&load, threads, false);
+    double t2 = stats_now() / 1e6;
+
+    load_phase(&load, threads, true);
+    double t3 = stats_now() / 1e6;
+
+    size_t loaded = 0, compiled = 0;
+    update_mutex_lock();
+    for (size_t i = 0; i < load.count; i++) {
+        if (!load.zones[i]) continue;
+        zone_index_put(load.zones[i], load.indexes[i]);
+        zone_table_insert(load.zones[i]);
+        loaded++;
+    }
+    response_cache_invalidate_all();
+    rcu_synchronize();
+    update_mutex_unlock();
+
+    // the zones parsed from text get their snapshot written in the background
+    for (size_t i = 0; i < load.count; i++) {
+        if (!load.zones[i]) continue;
+        zone_compiled_track(load.zones[i], load.files[i]);
+        if (load.compiled[i]) compiled++; else zone_compiled_schedule(load.zones[i]);
+    }
+    double t4 = stats_now() / 1e6;
+
+    fprintf(stderr, "Loaded %zu of %zu zones (%zu compiled) with %d threads: scan %.1f ms, parse %.1f ms, index %.1f ms, publish %.1f ms\n",
+        loaded, load.count, compiled, threads, t1 - t0, t2 - t1, t3 - t2, t4 - t3);
+
+    LDNS_FREE(load.files);
+    LDNS_FREE(load.zones);
+    LDNS_FREE(load.indexes);
+    LDNS_FREE(load.compiled);
+    return loaded;
+}
@@ -0,0 +1,31 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+#ifndef ZONE_LOADER_H
+#define ZONE_LOADER_H
+
+#include <stddef.h>
+
+/*
+ * Startup loading of the zone files of a directory. The files are parsed
+ * and their indexes built on a pool of `threads` threads, and the zones
+ * are published together at the end, with a single invalidation of the
+ * response cache. The time spent in each phase (directory scan, parse,
+ * index build, publish) is reported on stderr.
+ *
+ * Files with an up-to-date compiled snapshot are read from it instead of
+ * being parsed (see zone_compiled.h).
+ *
+ * Returns the number of zones loaded.
+ */
+
+#define ZONE_LOAD_MAX_THREADS 256
+
+size_t zone_load_dir(const char *dir, int threads);
+
+#endif
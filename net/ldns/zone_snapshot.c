@@ -0,0 +1,72 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+#include "zone_snapshot.h"
+#include "rcu.h"
+#include <pthread.h>
+
+#define SNAPSHOT_BUCKETS 61
+
+typedef struct snapshot_ref {
+    const ldns_zone *zone;
+    int refs;
+    void (*release)(ldns_zone *zone);  // set once the zone is retired
+    struct snapshot_ref *next;
+} snapshot_ref;
+
+// only zones with a transfer in progress are here, a mutex is enough
+static pthread_mutex_t snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+static snapshot_ref *buckets[SNAPSHOT_BUCKETS];
+
+static snapshot_ref **ref_find(const ldns_zone *zone) {
+    snapshot_ref **p = &buckets[(uintptr_t) zone / sizeof(void*) % SNAPSHOT_BUCKETS];
+    while (*p && (*p)->zone != zone) p = &(*p)->next;
+    return p;
+}
+
+ldns_zone *zone_snapshot_get(ldns_zone *zone) {
+    pthread_mutex_lock(&snapshot_mutex);
+    snapshot_ref **p = ref_find(zone);
+    if (!*p) {
+        *p = LDNS_CALLOC(snapshot_ref, 1);
+        (*p)->zone = zone;
+    }
+    (*p)->refs++;
+    pthread_mutex_unlock(&snapshot_mutex);
+    return zone;
+}
+
+void zone_snapshot_put(ldns_zone *zone) {
+    pthread_mutex_lock(&snapshot_mutex);
+    snapshot_ref **p = ref_find(zone);
+    snapshot_ref *ref = *p;
+    void (*release)(ldns_zone *zone) = NULL;
+    if (ref && --ref->refs == 0) {
+        release = ref->release;
+        *p = ref->next;
+        LDNS_FREE(ref);
+    }
+    pthread_mutex_unlock(&snapshot_mutex);
+
+    if (release) release(zone);
+}
+
+bool zone_snapshot_retire(ldns_zone *zone, void (*release)(ldns_zone *zone)) {
+    pthread_mutex_lock(&snapshot_mutex);
+    snapshot_ref *ref = *ref_find(zone);
+    if (ref) ref->release = release;
+    pthread_mutex_unlock(&snapshot_mutex);
+    return ref != NULL;
+}
+
+rrset_index *zone_snapshot_index(const ldns_zone *zone) {
+    rcu_read_lock();
+    rrset_index *index = zone_index(zone);
+    rcu_read_unlock();
+    return index;
+}
@@ -0,0 +1,33 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+#ifndef ZONE_SNAPSHOT_H
+#define ZONE_SNAPSHOT_H
+
+#include <ldns/ldns.h>
+#include "rrset_index.h"
+
+/*
+ * References to published zones that outlive an RCU read-side section,
+ * such as the zone streamed by a transfer. Published zones are never
+ * modified (updates work on a copy), so a reference is an immutable
+ * snapshot of the zone, without copying it.
+ *
+ * zone_snapshot_get must be called inside a read-side section. When the
+ * zone is retired while referenced, zone_snapshot_retire returns true and
+ * the last zone_snapshot_put calls release instead. The zone keeps its
+ * index until then, which zone_snapshot_index returns for a referenced
+ * zone, outside a read-side section.
+ */
+
+ldns_zone *zone_snapshot_get(ldns_zone *zone);
+void zone_snapshot_put(ldns_zone *zone);
+bool zone_snapshot_retire(ldns_zone *zone, void (*release)(ldns_zone *zone));
+rrset_index *zone_snapshot_index(const ldns_zone *zone);
+
+#endif
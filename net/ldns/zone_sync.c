@@ -0,0 +1,183 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+#define _GNU_SOURCE
+#include "dns_server.h"
+#include "zone_sync.h"
+#include "rcu.h"
+#include "rrset_index.h"
+#include "notify.h"
+#include "stats.h"
+
+typedef struct zone_change {
+    const char *name;    // in the diff, relative to the working tree
+    bool deleted;
+    ldns_zone *zone;     // parsed from the new version
+    ldns_rdf *old_apex;  // of a deleted file
+    ldns_rr_class old_class;
+} zone_change;
+
+static git_tree *revparse_tree(git_repository *repo, const char *spec, git_object **commit) {
+    git_object *obj = NULL, *tree = NULL;
+    if (!check_lg2_extra(git_revparse_single(&obj, repo, spec), "Cannot resolve", spec)) return NULL;
+    if (check_lg2_extra(git_object_peel(&tree, obj, GIT_OBJECT_TREE), "Cannot find tree of", spec) && commit) {
+        *commit = obj;
+    } else {
+        git_object_free(obj);
+    }
+    return (git_tree*) tree;
+}
+
+static ldns_zone *read_blob(git_repository *repo, const git_oid *id) {
+    git_blob *blob;
+    if (git_blob_lookup(&blob, repo, id)) return NULL;
+    ldns_zone *zone = NULL;
+    FILE *fp = git_blob_rawsize(blob) ? fmemopen((void*) git_blob_rawcontent(blob), git_blob_rawsize(blob), "r") : NULL;
+    if (fp) {
+        if (ldns_zone_new_frm_fp(&zone, fp, NULL, 0, LDNS_RR_CLASS_IN) != LDNS_STATUS_OK) zone = NULL;
+        fclose(fp);
+    }
+    git_blob_free(blob);
+    return zone;
+}
+
+static ldns_zone *zone_exact(ldns_rdf *apex, ldns_rr_class rr_class) {
+    // zone_find returns the closest enclosing zone
+    ldns_zone *zone = zone_find(apex, rr_class);
+    return zone && dname_equal(ldns_rr_owner(ldns_zone_soa(zone)), apex) ? zone : NULL;
+}
+
+static size_t publish(zone_change *changes, size_t count, zone_sync_reapply *reapply) {
+    size_t replaced = 0;
+    ldns_rr_list *soas = ldns_rr_list_new();
+    update_mutex_lock();
+    // deletions first, a file that was renamed shows up as deleted and added
+    for (size_t i = 0; i < count; i++) {
+        zone_change *c = &changes[i];
+        if (!c->old_apex) continue;
+        ldns_zone *old_zone = zone_exact(c->old_apex, c->old_class);
+        if (old_zone) {
+            zone_del(old_zone);
+            replaced++;
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        zone_change *c = &changes[i];
+        if (!c->zone) continue;
+        ldns_rr *soa = ldns_zone_soa(c->zone);
+        ldns_zone *old_zone = zone_exact(ldns_rr_owner(soa), ldns_rr_get_class(soa));
+        ldns_rr_list_push_rr(soas, ldns_rr_clone(soa));
+        if (old_zone) {
+            zone_replace(old_zone, c->zone);
+        } else {
+            zone_add(c->zone);
+        }
+        notify_schedule(c->zone);
+        replaced++;
+    }
+    // the updates acknowledged but not pushed yet were made on the versions replaced
+    if (reapply && ldns_rr_list_rr_count(soas)) reapply(soas);
+    if (replaced) rcu_synchronize();
+    update_mutex_unlock();
+    ldns_rr_list_deep_free(soas);
+    return replaced;
+}
+
+bool zone_sync(git_repository *repo, const char *dir, zone_sync_reapply *reapply) {
+    double t0 = stats_now() / 1e6;
+    git_tree *old_tree = revparse_tree(repo, "HEAD", NULL);
+    if (!old_tree) return false;
+    if (lg2_fetch(repo)) {
+        git_tree_free(old_tree);
+        return false;
+    }
+
+    git_object *commit = NULL;
+    git_tree *new_tree = revparse_tree(repo, "@{upstream}", &commit);
+    if (!new_tree) {
+        git_tree_free(old_tree);
+        return false;
+    }
+    if (git_oid_equal(git_tree_id(old_tree), git_tree_id(new_tree))) {
+        // nothing to reload, but HEAD still moves to the upstream commit, which
+        // the next push of the replicator takes as its lease
+        bool ok = check_lg2(git_reset(repo, commit, GIT_RESET_SOFT, NULL), "Cannot reset to upstream");
+        git_tree_free(old_tree);
+        git_tree_free(new_tree);
+        git_object_free(commit);
+        return ok;
+    }
+
+    git_diff *diff = NULL;
+    bool ok = check_lg2(git_diff_tree_to_tree(&diff, repo, old_tree, new_tree, NULL), "Cannot compare trees");
+    size_t count = 0;
+    zone_change *changes = NULL;
+    if (ok) {
+        size_t deltas = git_diff_num_deltas(diff);
+        changes = LDNS_CALLOC(zone_change, deltas ? deltas : 1);
+        for (size_t i = 0; i < deltas; i++) {
+            const git_diff_delta *delta = git_diff_get_delta(diff, i);
+            zone_change *c = &changes[count];
+            c->deleted = delta->status == GIT_DELTA_DELETED;
+            c->name = c->deleted ? delta->old_file.path : delta->new_file.path;
+            // zones are read from the top of the working tree only
+            if (strchr(c->name, '/') || !is_zone_file(c->name)) continue;
+            if (c->deleted) {
+                ldns_zone *old_zone = read_blob(repo, &delta->old_file.id);
+                ldns_rr *soa = old_zone ? ldns_zone_soa(old_zone) : NULL;
+                if (soa) {
+                    c->old_apex = ldns_rdf_clone(ldns_rr_owner(soa));
+                    c->old_class = ldns_rr_get_class(soa);
+                }
+                if (old_zone) ldns_zone_deep_free(old_zone);
+                if (!c->old_apex) fprintf(stderr, "Cannot find the zone of deleted file %s\n", c->name);
+            }
+            count++;
+        }
+    }
+
+    // the working tree is brought to the upstream commit before the files are read
+    ok = ok && check_lg2(git_reset(repo, commit, GIT_RESET_HARD, NULL), "Cannot reset to upstream");
+    double t1 = stats_now() / 1e6;
+
+    size_t parsed = 0;
+    for (size_t i = 0; ok && i < count; i++) {
+        zone_change *c = &changes[i];
+        if (c->deleted) continue;
+        filename_t path;
+        set_filename(path, dir, c->name);
+        c->zone = zone_read(path);
+        if (!c->zone || !ldns_zone_soa(c->zone)) {
+            // the version being served stays
+            fprintf(stderr, "Cannot read zone %s\n", path);
+            if (c->zone) ldns_zone_deep_free(c->zone);
+            c->zone = NULL;
+            continue;
+        }
+        zone_index_put(c->zone, rrset_index_new(c->zone));
+        parsed++;
+    }
+    double t2 = stats_now() / 1e6;
+
+    size_t published = ok ? publish(changes, count, reapply) : 0;
+    double t3 = stats_now() / 1e6;
+    if (ok) {
+        fprintf(stderr, "Synced %zu of %zu changed files (%zu parsed): fetch and diff %.1f ms, parse %.1f ms, publish %.1f ms\n",
+            published, count, parsed, t1 - t0, t2 - t1, t3 - t2);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (changes[i].old_apex) ldns_rdf_deep_free(changes[i].old_apex);
+    }
+    LDNS_FREE(changes);
+    git_diff_free(diff);
+    git_tree_free(old_tree);
+    git_tree_free(new_tree);
+    git_object_free(commit);
+    return ok;
+}
@@ -0,0 +1,45 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+#ifndef ZONE_SYNC_H
+#define ZONE_SYNC_H
+
+#include "git/common.h"
+#include <ldns/ldns.h>
+#include <stdbool.h>
+
+/*
+ * Incremental reload of the zones from the git repository, in
+ * MULTI_PRIMARY mode.
+ *
+ * zone_sync fetches the remote, and compares the tree of HEAD with the
+ * tree of the upstream branch. git compares the trees by object id, so
+ * only the subtrees and blobs that changed are read. The working tree is
+ * reset to the upstream commit, then only the zone files whose blob
+ * changed are parsed, and those zones are swapped into the zone table
+ * together, with a single grace period. A zone file that was deleted
+ * takes its zone with it; its apex is read from the old blob.
+ *
+ * Files are matched to the zones they hold by the SOA of the new version,
+ * so a file that changes its apex leaves the old zone behind until the
+ * next restart.
+ *
+ * An update applied while the files are read would be lost with the
+ * version it was applied to, so reapply is called after the swap, before
+ * update_mutex is released, with the SOA records of the zones swapped in;
+ * it applies again the updates to those zones that were not pushed yet.
+ *
+ * It must not run concurrently with a commit of the replicator, which
+ * would be reset away.
+ */
+
+typedef void zone_sync_reapply(const ldns_rr_list *soas);
+
+bool zone_sync(git_repository *repo, const char *dir, zone_sync_reapply *reapply);
+
+#endif
@@ -0,0 +1,258 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+#include "zone_table.h"
+#include "rcu.h"
+#include "fnv.h"
+#include <ctype.h>
+#include <stdatomic.h>
+
+#define MAX_LABELS 128
+
+typedef struct zone_node zone_node;
+
+/* Children of a node, open addressing with linear probing at load <= 1/2 */
+typedef struct zone_children {
+    size_t mask;
+    _Atomic(zone_node*) slots[];
+} zone_children;
+
+/* Zones whose apex is a node, one per class */
+typedef struct zone_list {
+    size_t count;
+    _Atomic(ldns_zone*) zones[];
+} zone_list;
+
+struct zone_node {
+    uint8_t label[64];
+    uint8_t len;
+    uint32_t hash;
+    zone_node *parent;
+    size_t child_count;
+
+    _Atomic(zone_children*) children;
+    _Atomic(zone_list*) zones;
+};
+
+static zone_node root;
+static size_t count;
+
+static uint32_t label_hash(const uint8_t *label, uint8_t len) {
+    uint32_t hash = FNV32_OFFSET;
+    for (uint8_t i = 0; i < len; i++) hash = fnv32_byte(hash, tolower(label[i]));
+    return hash;
+}
+
+static bool label_equal(const zone_node *node, const uint8_t *label, uint8_t len) {
+    if (node->len != len) return false;
+    for (uint8_t i = 0; i < len; i++) {
+        if (node->label[i] != tolower(label[i])) return false;
+    }
+    return true;
+}
+
+/* Split a dname into the offsets of its labels, without the root label */
+static size_t split_labels(const ldns_rdf *name, size_t *offsets) {
+    const uint8_t *data = ldns_rdf_data(name);
+    size_t size = ldns_rdf_size(name);
+    size_t n = 0;
+    for (size_t pos = 0; pos < size && data[pos] && n < MAX_LABELS; pos += data[pos] + 1) {
+        offsets[n++] = pos;
+    }
+    return n;
+}
+
+static zone_node *child_find(const zone_node *node, const uint8_t *label, uint8_t len, uint32_t hash) {
+    zone_children *children = atomic_load_explicit(&node->children, memory_order_acquire);
+    if (!children) return NULL;
+    for (size_t i = hash & children->mask; ; i = (i + 1) & children->mask) {
+        zone_node *child = atomic_load_explicit(&children->slots[i], memory_order_acquire);
+        if (!child) return NULL;
+        if (child->hash == hash && label_equal(child, label, len)) return child;
+    }
+}
+
+static void children_put(zone_children *children, zone_node *child) {
+    size_t i = child->hash & children->mask;
+    while (atomic_load_explicit(&children->slots[i], memory_order_relaxed)) i = (i + 1) & children->mask;
+    atomic_store_explicit(&children->slots[i], child, memory_order_release);
+}
+
+/* Copy the children of a node into a new table, leaving out one of them */
+static zone_children *children_copy(const zone_children *from, size_t count, const zone_node *except) {
+    size_t mask = 3;
+    while (mask + 1 < count * 2) mask = mask * 2 + 1;
+
+    zone_children *children = calloc(1, sizeof(zone_children) + (mask + 1) * sizeof(zone_node*));
+    children->mask = mask;
+    for (size_t i = 0; from && i <= from->mask; i++) {
+        zone_node *child = atomic_load_explicit(&from->slots[i], memory_order_relaxed);
+        if (child && child != except) children_put(children, child);
+    }
+    return children;
+}
+
+static void child_insert(zone_node *node, zone_node *child) {
+    zone_children *children = atomic_load_explicit(&node->children, memory_order_relaxed);
+    node->child_count++;
+    if (!children || children->mask + 1 < node->child_count * 2) {
+        zone_children *grown = children_copy(children, node->child_count, NULL);
+        children_put(grown, child);
+        atomic_store_explicit(&node->children, grown, memory_order_release);
+        if (children) rcu_retire(free, children);
+    } else {
+        children_put(children, child);
+    }
+}
+
+static void child_remove(zone_node *node, zone_node *child) {
+    zone_children *children = atomic_load_explicit(&node->children, memory_order_relaxed);
+    // removing from a linear-probing table in place would break the probe
+    // sequences seen by concurrent readers, so the table is copied instead
+    zone_children *copy = --node->child_count ? children_copy(children, node->child_count, child) : NULL;
+    atomic_store_explicit(&node->children, copy, memory_order_release);
+    rcu_retire(free, children);
+}
+
+static zone_node *node_lookup(const ldns_rdf *name, bool create) {
+    size_t offsets[MAX_LABELS];
+    size_t n = split_labels(name, offsets);
+    const uint8_t *data = ldns_rdf_data(name);
+
+    zone_node *node = &root;
+    while (n-- > 0) {
+        const uint8_t *label = data + offsets[n] + 1;
+        uint8_t len = data[offsets[n]];
+        uint32_t hash = label_hash(label, len);
+        zone_node *child = child_find(node, label, len, hash);
+        if (!child) {
+            if (!create) return NULL;
+            child = LDNS_CALLOC(zone_node, 1);
+            for (uint8_t i = 0; i < len; i++) child->label[i] = tolower(label[i]);
+            child->len = len;
+            child->hash = hash;
+            child->parent = node;
+            child_insert(node, child);
+        }
+        node = child;
+    }
+    return node;
+}
+
+static zone_list *zone_list_copy(const zone_list *from, const ldns_zone *except, ldns_zone *append) {
+    size_t n = from ? from->count : 0;
+    zone_list *list = calloc(1, sizeof(zone_list) + (n + 1) * sizeof(ldns_zone*));
+    for (size_t i = 0; i < n; i++) {
+        ldns_zone *zone = atomic_load_explicit(&from->zones[i], memory_order_relaxed);
+        if (zone != except) atomic_init(&list->zones[list->count++], zone);
+    }
+    if (append) atomic_init(&list->zones[list->count++], append);
+    return list;
+}
+
+void zone_table_insert(ldns_zone *zone) {
+    ldns_rr *soa = ldns_zone_soa(zone);
+    if (!soa) return;
+
+    zone_node *node = node_lookup(ldns_rr_owner(soa), true);
+    zone_list *zones = atomic_load_explicit(&node->zones, memory_order_relaxed);
+    atomic_store_explicit(&node->zones, zone_list_copy(zones, NULL, zone), memory_order_release);
+    if (zones) rcu_retire(free, zones);
+    count++;
+}
+
+void zone_table_replace(ldns_zone *old_zone, ldns_zone *zone) {
+    zone_node *node = node_lookup(ldns_rr_owner(ldns_zone_soa(old_zone)), false);
+    zone_list *zones = node ? atomic_load_explicit(&node->zones, memory_order_relaxed) : NULL;
+    for (size_t i = 0; zones && i < zones->count; i++) {
+        if (atomic_load_explicit(&zones->zones[i], memory_order_relaxed) == old_zone) {
+            atomic_store_explicit(&zones->zones[i], zone, memory_order_release);
+            return;
+        }
+    }
+}
+
+void zone_table_remove(ldns_zone *zone) {
+    ldns_rr *soa = ldns_zone_soa(zone);
+    if (!soa) return;
+
+    zone_node *node = node_lookup(ldns_rr_owner(soa), false);
+    if (!node) return;
+
+    zone_list *zones = atomic_load_explicit(&node->zones, memory_order_relaxed);
+    if (!zones) return;
+    zone_list *copy = zone_list_copy(zones, zone, NULL);
+    if (copy->count == zones->count) {
+        free(copy);
+        return;
+    }
+
+    count--;
+    if (!copy->count) {
+        // the node is left without zones
+        free(copy);
+        copy = NULL;
+    }
+    atomic_store_explicit(&node->zones, copy, memory_order_release);
+    rcu_retire(free, zones);
+
+    // prune the branch that no longer leads to any zone
+    while (node != &root && !atomic_load_explicit(&node->zones, memory_order_relaxed) && !node->child_count) {
+        zone_node *parent = node->parent;
+        child_remove(parent, node);
+        rcu_retire(free, node);
+        node = parent;
+    }
+}
+
+static ldns_zone *node_zone(const zone_node *node, ldns_rr_class zclass) {
+    zone_list *zones = atomic_load_explicit(&node->zones, memory_order_acquire);
+    for (size_t i = 0; zones && i < zones->count; i++) {
+        ldns_zone *zone = atomic_load_explicit(&zones->zones[i], memory_order_acquire);
+        if (ldns_rr_get_class(ldns_zone_soa(zone)) == zclass) return zone;
+    }
+    return NULL;
+}
+
+ldns_zone *zone_table_find(const ldns_rdf *name, ldns_rr_class zclass) {
+    size_t offsets[MAX_LABELS];
+    size_t n = split_labels(name, offsets);
+    const uint8_t *data = ldns_rdf_data(name);
+
+    const zone_node *node = &root;
+    ldns_zone *zone = node_zone(node, zclass);
+    while (n-- > 0) {
+        const uint8_t *label = data + offsets[n] + 1;
+        uint8_t len = data[offsets[n]];
+        node = child_find(node, label, len, label_hash(label, len));
+        if (!node) break;
+        ldns_zone *z = node_zone(node, zclass);
+        if (z) zone = z;
+    }
+    return zone;
+}
+
+static void node_foreach(zone_node *node, void (*callback)(ldns_zone *zone, void *arg), void *arg) {
+    zone_list *zones = atomic_load_explicit(&node->zones, memory_order_acquire);
+    for (size_t i = 0; zones && i < zones->count; i++) {
+        callback(atomic_load_explicit(&zones->zones[i], memory_order_acquire), arg);
+    }
+    zone_children *children = atomic_load_explicit(&node->children, memory_order_acquire);
+    for (size_t i = 0; children && i <= children->mask; i++) {
+        zone_node *child = atomic_load_explicit(&children->slots[i], memory_order_acquire);
+        if (child) node_foreach(child, callback, arg);
+    }
+}
+
+void zone_table_foreach(void (*callback)(ldns_zone *zone, void *arg), void *arg) {
+    node_foreach(&root, callback, arg);
+}
+
+size_t zone_table_count() {
+    return count;
+}
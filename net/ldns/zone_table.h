@@ -0,0 +1,34 @@
+/*
+ * (c) Roberto Javier Godoy, 2024
+ * All rights reserved.
+ *
+ * This program is distributed under a conditioned source-available license.
+ * For license terms, see LICENSE.
+ */
+
+#ifndef ZONE_TABLE_H
+#define ZONE_TABLE_H
+
+#include <ldns/ldns.h>
+
+/*
+ * Table of the zones served, stored as a trie of reversed labels
+ * (com -> example -> www). zone_table_find walks the query name once
+ * from the root and returns the deepest zone found on the way, which
+ * is the closest enclosing zone. Lookups do not allocate.
+ *
+ * Zones are keyed by the owner and class of their SOA record. Lookups
+ * must be done inside an RCU read-side section. Modifications must be
+ * serialized by update_mutex; the nodes they unlink are retired with
+ * rcu_retire. zone_table_replace swaps a zone for a new version of it
+ * with a single atomic store.
+ */
+
+void zone_table_insert(ldns_zone *zone);
+void zone_table_replace(ldns_zone *old_zone, ldns_zone *zone);
+void zone_table_remove(ldns_zone *zone);
+ldns_zone *zone_table_find(const ldns_rdf *name, ldns_rr_class zclass);
+void zone_table_foreach(void (*callback)(ldns_zone *zone, void *arg), void *arg);
+size_t zone_table_count();
+
+#endif